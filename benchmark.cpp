@@ -0,0 +1,963 @@
+/*
+	James Marcel
+
+	Benchmarks for each recog.h function and for the whole per frame pipeline
+	on synthetic scenes (dark blobs on a white background with noise) and real frames.
+	Writes one result per stage and resolution as csv or json lines so runs can be diffed
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cmath>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <functional>
+#include <limits>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+#include "recog.h"
+#include "morph.h"
+#include "pipeline.h"
+#include "kdtree.h"
+#include "catalog.h"
+#include "csv_util.h"
+
+
+//every heap allocation in the process goes through here so a stage's allocations can be counted
+static std::atomic<int64_t> allocCount{ 0 };
+
+void* operator new(size_t size) {
+	allocCount.fetch_add(1, std::memory_order_relaxed);
+	void* p = malloc(size == 0 ? 1 : size);
+	if (p == NULL) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void* p) noexcept {
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+
+//one synthetic scene setting
+struct SceneSpec {
+	int width = 640;
+	int height = 480;
+	int blobs = 5; //dark ellipses and rectangles
+	double noise = 0.01; //fraction of pixels flipped to the other color
+	unsigned seed = 1;
+	bool centered = false; //first blob goes in the central third, where the single object mode looks
+};
+
+//draws dark blobs at random positions, sizes and angles on a light background with salt and pepper noise
+static void makeScene(SceneSpec& spec, cv::Mat& dst) {
+
+	dst.create(spec.height, spec.width, CV_8UC3);
+	cv::RNG rng(spec.seed);
+
+	for (int i = 0; i < dst.rows; i++) {
+		uchar* dptr = dst.ptr<uchar>(i);
+		for (int j = 0; j < dst.cols * 3; j++) {
+			dptr[j] = static_cast<uchar>(200 + rng.uniform(0, 40));
+		}
+	}
+
+	int scale = std::min(spec.width, spec.height);
+	for (int b = 0; b < spec.blobs; b++) {
+
+		double lo = (spec.centered && b == 0) ? 0.4 : 0.1;
+		double cx = rng.uniform(lo, 1 - lo) * spec.width;
+		double cy = rng.uniform(lo, 1 - lo) * spec.height;
+		double a = rng.uniform(0.03, 0.12) * scale; //half length
+		double c = a * rng.uniform(0.2, 1.0); //half width
+		double ang = rng.uniform(0.0, 3.14159265358979323846);
+		bool ellipse = rng.uniform(0, 2) == 0;
+		double cosA = cos(ang);
+		double sinA = sin(ang);
+
+		int r = static_cast<int>(a) + 1;
+		for (int i = std::max(0, static_cast<int>(cy) - r); i < std::min(dst.rows, static_cast<int>(cy) + r); i++) {
+
+			uchar* dptr = dst.ptr<uchar>(i);
+			for (int j = std::max(0, static_cast<int>(cx) - r); j < std::min(dst.cols, static_cast<int>(cx) + r); j++) {
+
+				double u = (j - cx) * cosA + (i - cy) * sinA;
+				double v = -(j - cx) * sinA + (i - cy) * cosA;
+				bool inside = ellipse ? (u * u / (a * a) + v * v / (c * c) <= 1) : (fabs(u) <= a && fabs(v) <= c);
+				if (inside) {
+					dptr[3 * j] = dptr[3 * j + 1] = dptr[3 * j + 2] = static_cast<uchar>(rng.uniform(10, 60));
+				}
+			}
+		}
+	}
+
+	int64_t flips = static_cast<int64_t>(spec.noise * dst.rows * dst.cols);
+	for (int64_t n = 0; n < flips; n++) {
+		int i = rng.uniform(0, dst.rows);
+		int j = rng.uniform(0, dst.cols);
+		uchar* p = dst.ptr<uchar>(i) + 3 * j;
+		uchar value = (p[0] > 120) ? 30 : 230;
+		p[0] = p[1] = p[2] = value;
+	}
+}
+
+
+//timing result for one stage on one input
+struct BenchResult {
+	std::string input; //scene name or file
+	std::string stage;
+	int width = 0;
+	int height = 0;
+	int iters = 0;
+	double msPerFrame = 0;
+	double allocsPerFrame = 0;
+};
+
+//runs fn until minMs have passed (at least minIters times) after one warm up call
+static BenchResult timeStage(const std::string& stage, cv::Size size, int minIters, double minMs, const std::function<void()>& fn) {
+
+	fn(); //warm up, buffers that are reused get allocated here
+
+	BenchResult res;
+	res.stage = stage;
+	res.width = size.width;
+	res.height = size.height;
+
+	int64_t allocs = allocCount.load();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	double elapsed = 0;
+	int iters = 0;
+
+	while (iters < minIters || elapsed < minMs) {
+		fn();
+		iters++;
+		elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	res.iters = iters;
+	res.msPerFrame = elapsed / iters;
+	res.allocsPerFrame = static_cast<double>(allocCount.load() - allocs) / iters;
+	return res;
+}
+
+
+//benchmarks every stage on frame and adds the results to out
+//fdb, index and devs are used for the classification stages on their own
+static void benchFrame(const std::string& input, cv::Mat& frame, PipelineSettings& settings, FeatureDatabase& fdb, FeatureIndex& index,
+	float* devs, int minIters, double minMs, std::vector<BenchResult>& out) {
+
+	cv::Size size = frame.size();
+	cv::Mat bImg, distance, eroded, final, labels, colors;
+	std::vector<RegionInfo> table;
+	int regnum = 0;
+	int central = 0;
+	RegionStats stats;
+	int moments[3] = { 0 };
+	double mu[FEAT_COUNT] = { 0 };
+	char result[256];
+	int radius = settings.radius.load();
+
+	std::vector<BenchResult> res;
+
+	res.push_back(timeStage("binaryImg", size, minIters, minMs, [&]() { binaryImg(frame, bImg, settings.thresh); }));
+	res.push_back(timeStage("grassfire", size, minIters, minMs, [&]() { grassfire(bImg, distance); }));
+	res.push_back(timeStage("distErosion", size, minIters, minMs, [&]() { distErosion(distance, eroded, settings.level); }));
+	res.push_back(timeStage("dilate", size, minIters, minMs, [&]() { dilate(eroded, final, radius); }));
+
+	//morphology templates at the default settings (level 2, radius 6) and a few other elements
+	cv::Mat morphed;
+	res.push_back(timeStage("Morphology<4,1>::erode", size, minIters, minMs, [&]() {
+		Morphology<BallElement<4, 1>>::erode(bImg, morphed);
+	}));
+	res.push_back(timeStage("Morphology<4,1,nearest>::erode", size, minIters, minMs, [&]() {
+		Morphology<BallElement<4, 1>, MORPH_BORDER_NEAREST>::erode(bImg, morphed);
+	}));
+	res.push_back(timeStage("Morphology<8,6>::dilate", size, minIters, minMs, [&]() {
+		Morphology<BallElement<8, 6>>::dilate(eroded, morphed);
+	}));
+	res.push_back(timeStage("Morphology<8,2>::open", size, minIters, minMs, [&]() {
+		Morphology<BallElement<8, 2>>::open(bImg, morphed);
+	}));
+	res.push_back(timeStage("Morphology<cross3>::close", size, minIters, minMs, [&]() {
+		Morphology<CrossElement<3>>::close(bImg, morphed);
+	}));
+	res.push_back(timeStage("regions", size, minIters, minMs, [&]() { regnum = regions(final, labels, table); }));
+	res.push_back(timeStage("centralRegion", size, minIters, minMs, [&]() { central = centralRegion(labels, table); }));
+	res.push_back(timeStage("regionStats", size, minIters, minMs, [&]() { regionStats(labels, central, table[central], stats); }));
+	res.push_back(timeStage("regColor", size, minIters, minMs, [&]() { regColor(labels, colors, regnum); }));
+
+	//every region big enough for multi-object mode, in one pass
+	std::vector<int> selected;
+	std::vector<RegionStats> allStats;
+	selectRegions(labels.size(), table, settings.filter, selected);
+	res.push_back(timeStage("regionStatsAll", size, minIters, minMs, [&]() { regionStatsAll(labels, table, selected, allStats); }));
+
+	//the same labelling and measuring on the run length encoded image, with the same labels
+	RunImage runs;
+	std::vector<RegionInfo> runTable;
+	res.push_back(timeStage("RunImage::encode", size, minIters, minMs, [&]() { runs.encode(final); }));
+	res.push_back(timeStage("RunImage::finish", size, minIters, minMs, [&]() { runs.finish(runTable); }));
+	res.push_back(timeStage("centralRegion runs", size, minIters, minMs, [&]() { central = centralRegion(runs, runTable); }));
+	res.push_back(timeStage("regionStats runs", size, minIters, minMs, [&]() { regionStats(runs, central, runTable[central], stats); }));
+	res.push_back(timeStage("regionStatsAll runs", size, minIters, minMs, [&]() { regionStatsAll(runs, runTable, selected, allStats); }));
+
+	statFeatures(stats, moments, mu);
+	res.push_back(timeStage("nearestNeighb", size, minIters, minMs, [&]() {
+		nearestNeighb(mu, devs, fdb, result);
+	}));
+	res.push_back(timeStage("kNearest", size, minIters, minMs, [&]() {
+		kNearest(mu, devs, fdb, result, settings.k);
+	}));
+	//one call for a batch of queries spread around this frame's features, like every region of a busy frame
+	const int batch = 64;
+	std::vector<double> queries(batch * FEAT_COUNT);
+	std::vector<Neighbor> neighbors(batch * settings.k);
+	for (int q = 0; q < batch; q++) {
+		memcpy(&queries[q * FEAT_COUNT], mu, sizeof(mu));
+		//an 8 x 8 grid over the first two match features
+		for (int d = 0; d < std::min(MATCH_FEATURES, 2); d++) {
+			int step = (d == 0) ? q % 8 : q / 8;
+			queries[q * FEAT_COUNT + MatchFeatures::id(d)] += devs[d] * (step - 4) / 4.0;
+		}
+	}
+	res.push_back(timeStage("nearestBatch/64", size, minIters, minMs, [&]() {
+		nearestBatch(queries.data(), batch, devs, fdb, settings.k, neighbors.data());
+	}));
+	res.push_back(timeStage("FeatureIndex::nearest", size, minIters, minMs, [&]() {
+		index.nearest(mu, devs, result);
+	}));
+	res.push_back(timeStage("FeatureIndex::kNearest", size, minIters, minMs, [&]() {
+		index.kNearest(mu, devs, result, settings.k);
+	}));
+
+	CleanupStream cleanup;
+	cleanup.thresh = settings.thresh;
+	cleanup.level = settings.level;
+	cleanup.radius = radius;
+	res.push_back(timeStage("CleanupStream", size, minIters, minMs, [&]() { regnum = cleanup.run(frame, labels, table); }));
+	res.push_back(timeStage("CleanupStream runs", size, minIters, minMs, [&]() {
+		cleanup.stream(frame, runs);
+		regnum = cleanup.finish(runTable);
+	}));
+
+	//whole frame as the workers run it, with and without display images
+	//timeStage's warm up call sizes the workspace, so allocs_per_frame is the steady state
+	FrameWorkspace ws;
+	FrameResult fr;
+	fr.frame = frame;
+	bool views = settings.views;
+	settings.views = false;
+	res.push_back(timeStage("processFrame", size, minIters, minMs, [&]() { processFrame(fr, ws, settings); }));
+	settings.views = true;
+	res.push_back(timeStage("processFrame+views", size, minIters, minMs, [&]() { processFrame(fr, ws, settings); }));
+	//tracking on a still scene, the first call finds the object and sets the window
+	settings.views = false;
+	settings.track = true;
+	processFrame(fr, ws, settings);
+	res.push_back(timeStage("processFrame track", size, minIters, minMs, [&]() { processFrame(fr, ws, settings); }));
+	settings.track = false;
+	settings.pyramid = 2;
+	res.push_back(timeStage("processFrame pyramid 2", size, minIters, minMs, [&]() { processFrame(fr, ws, settings); }));
+	settings.pyramid = 1;
+	settings.multi = true;
+	res.push_back(timeStage("processFrame multi", size, minIters, minMs, [&]() { processFrame(fr, ws, settings); }));
+	settings.multi = false;
+	settings.views = views;
+
+	for (size_t r = 0; r < res.size(); r++) {
+		res[r].input = input;
+		out.push_back(res[r]);
+	}
+}
+
+
+//pyramid mode against full resolution for one reduction factor, summed over frames
+struct PyramidReport {
+	std::string input;
+	int width = 0;
+	int height = 0;
+	int factor = 1;
+	int frames = 0;
+	int objects = 0; //frames where full resolution found an object
+	int agree = 0; //of those, frames where pyramid mode gave the same label
+	int refined = 0; //frames pyramid mode measured in a window instead of falling back to a full pass
+	double fullMs = 0;
+	double pyramidMs = 0;
+	double fillErr = 0, fillMax = 0; //absolute error of fill %
+	double ratioErr = 0, ratioMax = 0; //absolute error of h/w ratio
+};
+
+//processes frame at full resolution and shrunk by report.factor and adds the differences to report
+static void pyramidCompare(cv::Mat& frame, PipelineSettings& settings, int minIters, double minMs, PyramidReport& report) {
+
+	FrameWorkspace ws;
+	FrameResult full;
+	FrameResult small;
+	full.frame = frame;
+	small.frame = frame;
+
+	bool views = settings.views;
+	settings.views = false;
+
+	settings.pyramid = 1;
+	BenchResult a = timeStage("processFrame", frame.size(), minIters, minMs, [&]() { processFrame(full, ws, settings); });
+	settings.pyramid = report.factor;
+	BenchResult b = timeStage("processFrame pyramid", frame.size(), minIters, minMs, [&]() { processFrame(small, ws, settings); });
+	settings.pyramid = 1;
+	settings.views = views;
+
+	report.frames++;
+	report.fullMs += a.msPerFrame;
+	report.pyramidMs += b.msPerFrame;
+	report.refined += (small.scale > 1);
+
+	if (full.central == 0) {
+		return;
+	}
+	report.objects++;
+	report.agree += (strcmp(full.result, small.result) == 0);
+
+	double fillErr = fabs(full.mu[FEAT_FILL] - small.mu[FEAT_FILL]);
+	double ratioErr = fabs(full.mu[FEAT_RATIO] - small.mu[FEAT_RATIO]);
+	report.fillErr += fillErr;
+	report.fillMax = std::max(report.fillMax, fillErr);
+	report.ratioErr += ratioErr;
+	report.ratioMax = std::max(report.ratioMax, ratioErr);
+}
+
+
+//one csv line per input and factor: label agreement and feature error against full resolution, and the speed up
+static int writePyramidReport(const char* path, std::vector<PyramidReport>& reports) {
+
+	FILE* fp = fopen(path, "w");
+	if (fp == NULL) {
+		printf("Unable to open %s\n", path);
+		return -1;
+	}
+
+	fprintf(fp, "input,width,height,factor,frames,refined,objects,label_agreement,fill_err_mean,fill_err_max,"
+		"ratio_err_mean,ratio_err_max,full_ms,pyramid_ms,speedup\n");
+	for (size_t r = 0; r < reports.size(); r++) {
+		PyramidReport& p = reports[r];
+		int n = std::max(p.objects, 1);
+		int f = std::max(p.frames, 1);
+		fprintf(fp, "%s,%d,%d,%d,%d,%d,%d,%.4f,%.5f,%.5f,%.5f,%.5f,%.3f,%.3f,%.2f\n", p.input.c_str(), p.width, p.height,
+			p.factor, p.frames, p.refined, p.objects, static_cast<double>(p.agree) / n, p.fillErr / n, p.fillMax, p.ratioErr / n,
+			p.ratioMax, p.fullMs / f, p.pyramidMs / f, p.fullMs / std::max(p.pyramidMs, 1e-9));
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+
+//writes results as json lines if path ends in .jsonl, otherwise csv, to stdout if path is NULL
+static int writeResults(const char* path, std::vector<BenchResult>& results) {
+
+	FILE* fp = stdout;
+	if (path != NULL) {
+		fp = fopen(path, "w");
+		if (fp == NULL) {
+			printf("Unable to open %s\n", path);
+			return -1;
+		}
+	}
+
+	bool json = path != NULL && strlen(path) > 6 && strcmp(path + strlen(path) - 6, ".jsonl") == 0;
+
+	if (!json) {
+		fprintf(fp, "input,stage,width,height,iters,ms_per_frame,ns_per_pixel,frames_per_s,allocs_per_frame\n");
+	}
+
+	for (size_t r = 0; r < results.size(); r++) {
+
+		BenchResult& b = results[r];
+		double nsPerPixel = b.msPerFrame * 1e6 / (static_cast<double>(b.width) * b.height);
+		double fps = 1000.0 / b.msPerFrame;
+
+		if (json) {
+			fprintf(fp, "{\"input\":\"%s\",\"stage\":\"%s\",\"width\":%d,\"height\":%d,\"iters\":%d,"
+				"\"ms_per_frame\":%.4f,\"ns_per_pixel\":%.4f,\"frames_per_s\":%.2f,\"allocs_per_frame\":%.2f}\n",
+				b.input.c_str(), b.stage.c_str(), b.width, b.height, b.iters, b.msPerFrame, nsPerPixel, fps, b.allocsPerFrame);
+		}
+		else {
+			fprintf(fp, "%s,%s,%d,%d,%d,%.4f,%.4f,%.2f,%.2f\n",
+				b.input.c_str(), b.stage.c_str(), b.width, b.height, b.iters, b.msPerFrame, nsPerPixel, fps, b.allocsPerFrame);
+		}
+	}
+
+	if (fp != stdout) {
+		fclose(fp);
+	}
+	return 0;
+}
+
+
+//turns vga, 720p, 1080p, 4k or WxH into a size
+static bool parseResolution(const std::string& name, cv::Size& size) {
+
+	if (name == "vga") {
+		size = cv::Size(640, 480);
+	}
+	else if (name == "720p") {
+		size = cv::Size(1280, 720);
+	}
+	else if (name == "1080p") {
+		size = cv::Size(1920, 1080);
+	}
+	else if (name == "4k") {
+		size = cv::Size(3840, 2160);
+	}
+	else if (sscanf(name.c_str(), "%dx%d", &size.width, &size.height) != 2) {
+		return false;
+	}
+	return size.width > 0 && size.height > 0;
+}
+
+
+//checks nearestBatch against a plain scan over the same scaled floats before anything is timed,
+//so a build with another MatchFeatures (see featureset.h) runs the batch kernel at its block layout
+//returns -1 if a query's nearest row is farther than the closest one the scan finds
+static int checkBatch(FeatureDatabase& fdb, float* devs) {
+
+	const int m = 64;
+	const int F = FEAT_COUNT;
+	cv::RNG rng(11);
+	std::vector<double> queries(m * F, 0.0);
+	for (int q = 0; q < m; q++) {
+		int row = rng.uniform(0, fdb.rows());
+		for (int s = 0; s < StoredFeatures::size; s++) {
+			queries[q * F + StoredFeatures::id(s)] = fdb.column(StoredFeatures::id(s))[row] + rng.gaussian(0.05);
+		}
+	}
+
+	std::vector<Neighbor> best(m);
+	nearestBatch(queries.data(), m, devs, fdb, 1, best.data());
+
+	for (int q = 0; q < m; q++) {
+
+		float closest = std::numeric_limits<float>::max();
+		for (int r = 0; r < fdb.rows(); r++) {
+			float dist = 0;
+			for (int d = 0; d < MATCH_FEATURES; d++) {
+				float inv = 1.0f / devs[d];
+				float diff = static_cast<float>(queries[q * F + MatchFeatures::id(d)]) * inv - fdb.column(MatchFeatures::id(d))[r] * inv;
+				dist += diff * diff;
+			}
+			closest = std::min(closest, dist);
+		}
+
+		if (best[q].row < 0 || best[q].dist > closest * (1 + 1e-5f) + 1e-6f) {
+			printf("nearestBatch check failed on query %d: %g against %g\n", q, best[q].dist, closest);
+			return -1;
+		}
+	}
+
+	fprintf(stderr, "nearestBatch matches the scan over %d match features\n", MATCH_FEATURES);
+	return 0;
+}
+
+
+//true if a and b have the same size, type and pixels
+static bool sameMat(const cv::Mat& a, const cv::Mat& b) {
+
+	if (a.size() != b.size() || a.type() != b.type()) {
+		return false;
+	}
+	for (int i = 0; i < a.rows; i++) {
+		if (memcmp(a.ptr(i), b.ptr(i), a.cols * a.elemSize()) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+//true if entries 1 to count - 1 of two region tables are the same
+static bool sameTable(const std::vector<RegionInfo>& a, const std::vector<RegionInfo>& b, int count) {
+
+	if (static_cast<int>(a.size()) < count || static_cast<int>(b.size()) < count) {
+		return false;
+	}
+	for (int l = 1; l < count; l++) {
+		if (a[l].area != b[l].area || memcmp(a[l].box, b[l].box, sizeof(a[l].box)) != 0 || a[l].sumx != b[l].sumx || a[l].sumy != b[l].sumy) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+//CleanupStream into a region map and into runs against binaryImg -> grassfire -> distErosion -> dilate -> regions
+//returns -1 if any image, label or table entry differs
+static int checkCleanup(int trial, cv::Mat& frame, int thresh, int level, int radius) {
+
+	cv::Mat bin, distance, eroded, cleaned, labels;
+	std::vector<RegionInfo> table;
+	binaryImg(frame, bin, thresh);
+	grassfire(bin, distance);
+	distErosion(distance, eroded, level);
+	dilate(eroded, cleaned, radius);
+	int count = regions(cleaned, labels, table);
+
+	CleanupStream cleanup;
+	cleanup.thresh = thresh;
+	cleanup.level = level;
+	cleanup.radius = radius;
+	cv::Mat streamBin, streamClean, streamLabels;
+	std::vector<RegionInfo> streamTable;
+	int streamCount = cleanup.run(frame, streamLabels, streamTable, &streamBin, &streamClean);
+
+	RunImage runs;
+	cv::Mat runLabels;
+	std::vector<RegionInfo> runTable;
+	cleanup.stream(frame, runs);
+	int runCount = cleanup.finish(runTable);
+	runs.paint(runLabels);
+
+	const char* bad = !sameMat(bin, streamBin) ? "binary images"
+		: !sameMat(cleaned, streamClean) ? "cleaned images"
+		: (streamCount != count || !sameMat(labels, streamLabels) || !sameTable(table, streamTable, count)) ? "labels"
+		: (runCount != count || !sameMat(labels, runLabels) || !sameTable(table, runTable, count)) ? "labels from runs" : NULL;
+	if (bad != NULL) {
+		printf("CleanupStream check failed on case %d (%dx%d, thresh %d, level %d, radius %d): %s differ\n",
+			trial, frame.cols, frame.rows, thresh, level, radius, bad);
+		return -1;
+	}
+	return 0;
+}
+
+
+//regions on parallel strips against one strip, and against RowLabeler and the runs, which label a row at a time
+//binary is 0 and 255, returns -1 if any label or table entry differs
+static int checkLabels(int trial, cv::Mat& binary) {
+
+	cv::Mat labels;
+	std::vector<RegionInfo> table;
+	int count = regions(binary, labels, table);
+
+	int threads = cv::getNumThreads();
+	cv::setNumThreads(1);
+	cv::Mat serial;
+	std::vector<RegionInfo> serialTable;
+	int serialCount = regions(binary, serial, serialTable);
+	cv::setNumThreads(threads);
+
+	RowLabeler labeler;
+	cv::Mat rowLabels;
+	std::vector<RegionInfo> rowTable;
+	labeler.begin(rowLabels, binary.size());
+	for (int i = 0; i < binary.rows; i++) {
+		labeler.push(binary.ptr<uchar>(i));
+	}
+	int rowCount = labeler.finish(rowTable);
+
+	RunImage runs;
+	cv::Mat runLabels;
+	std::vector<RegionInfo> runTable;
+	runs.encode(binary);
+	int runCount = runs.finish(runTable);
+	runs.paint(runLabels);
+
+	const char* bad = (serialCount != count || !sameMat(labels, serial) || !sameTable(table, serialTable, count)) ? "one strip"
+		: (rowCount != count || !sameMat(labels, rowLabels) || !sameTable(table, rowTable, count)) ? "RowLabeler"
+		: (runCount != count || !sameMat(labels, runLabels) || !sameTable(table, runTable, count)) ? "RunImage" : NULL;
+	if (bad != NULL) {
+		printf("labelling check failed on case %d (%dx%d, %d strips): regions on strips and %s differ\n",
+			trial, binary.cols, binary.rows, std::max(1, std::min(threads, binary.rows / 32)), bad);
+		return -1;
+	}
+	return 0;
+}
+
+
+//FeatureIndex against the nearestNeighb and kNearest scans on a random database, built, grown by insert
+//and saved and loaded again, with some rows repeated so ties have to break the same way
+//returns -1 if any answer differs
+static int checkIndex(int trial, cv::RNG& rng) {
+
+	int rows = rng.uniform(2, 600);
+	int objects = rng.uniform(1, 12);
+	int built = rng.uniform(1, rows + 1); //rows the index is built over, the rest are inserted
+
+	std::vector<std::string> objectNames(objects);
+	for (int c = 0; c < objects; c++) {
+		objectNames[c] = "object" + std::to_string(c);
+	}
+	std::vector<std::vector<float>> data(rows, std::vector<float>(FeatureDatabase::FEATURES));
+	std::vector<char*> names(rows);
+	for (int r = 0; r < rows; r++) {
+		//the first two rows differ, so every deviation is above 0
+		int copy = (r >= 2 && rng.uniform(0, 5) == 0) ? rng.uniform(0, r) : -1;
+		for (int f = 0; f < FeatureDatabase::FEATURES; f++) {
+			data[r][f] = (copy >= 0) ? data[copy][f] : static_cast<float>(rng.uniform(0.0, 1.0));
+		}
+		names[r] = &objectNames[rng.uniform(0, objects)][0];
+	}
+
+	FeatureDatabase db;
+	db.load(std::vector<std::vector<float>>(data.begin(), data.begin() + built), std::vector<char*>(names.begin(), names.begin() + built));
+	FeatureIndex index;
+	index.build(db);
+	for (int r = built; r < rows; r++) {
+		db.add(data[r].data(), names[r]);
+		index.insert(data[r].data(), names[r]);
+	}
+
+	std::vector<char> saved;
+	index.save(saved);
+	FeatureIndex loaded;
+	if (loaded.load(saved.data(), saved.size(), db) != 0) {
+		printf("FeatureIndex check failed on case %d: a saved index doesn't load back\n", trial);
+		return -1;
+	}
+
+	float devs[MATCH_FEATURES] = { 0 };
+	deviation(db, devs);
+
+	for (int q = 0; q < 50; q++) {
+
+		//on a row (distance 0, tied with its copies), near one or far from all of them
+		double target[FEAT_COUNT] = { 0 };
+		int row = rng.uniform(0, rows);
+		int kind = rng.uniform(0, 3);
+		for (int s = 0; s < StoredFeatures::size; s++) {
+			double v = data[row][s];
+			target[StoredFeatures::id(s)] = (kind == 0) ? v : (kind == 1) ? v + rng.gaussian(0.05) : rng.uniform(-5.0, 5.0);
+		}
+
+		char scan[256], fast[256], again[256];
+		nearestNeighb(target, devs, db, scan);
+		index.nearest(target, devs, fast);
+		loaded.nearest(target, devs, again);
+		int bad = (strcmp(scan, fast) != 0 || strcmp(scan, again) != 0) ? 1 : 0;
+		for (int k = 1; k <= 4 && !bad; k++) {
+			kNearest(target, devs, db, scan, k);
+			index.kNearest(target, devs, fast, k);
+			loaded.kNearest(target, devs, again, k);
+			bad = (strcmp(scan, fast) != 0 || strcmp(scan, again) != 0) ? k + 1 : 0;
+		}
+		if (bad) {
+			std::string what = (bad == 1) ? "nearest" : "k = " + std::to_string(bad - 1);
+			printf("FeatureIndex check failed on case %d (%d rows, %d built, %s): scan says %s, index %s, loaded index %s\n",
+				trial, rows, built, what.c_str(), scan, fast, again);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+//randomized cases for the fast paths against the plain ones they stand in for, nothing is timed
+//returns -1 at the first case that differs
+static int runChecks(int cases, unsigned seed) {
+
+	cv::RNG rng(seed);
+
+	for (int t = 0; t < cases; t++) {
+
+		SceneSpec scene;
+		scene.width = rng.uniform(1, 700);
+		scene.height = rng.uniform(1, 500);
+		scene.blobs = rng.uniform(0, 12);
+		scene.noise = rng.uniform(0.0, 0.05);
+		scene.seed = static_cast<unsigned>(rng.next());
+		cv::Mat frame;
+		makeScene(scene, frame);
+		if (checkCleanup(t, frame, rng.uniform(60, 200), rng.uniform(1, 5), rng.uniform(0, 13)) != 0) {
+			return -1;
+		}
+
+		//noise around the percolation density, so regions wind across many strip seams
+		cv::Mat binary(rng.uniform(1, 400), rng.uniform(1, 300), CV_8UC1);
+		double density = rng.uniform(0.3, 0.7);
+		for (int i = 0; i < binary.rows; i++) {
+			uchar* bptr = binary.ptr<uchar>(i);
+			for (int j = 0; j < binary.cols; j++) {
+				bptr[j] = (rng.uniform(0.0, 1.0) < density) ? 0 : 255;
+			}
+		}
+		if (checkLabels(t, binary) != 0) {
+			return -1;
+		}
+
+		if (checkIndex(t, rng) != 0) {
+			return -1;
+		}
+	}
+
+	fprintf(stderr, "CleanupStream, strip labelling and FeatureIndex match the plain versions on %d random cases\n", cases);
+	return 0;
+}
+
+
+static void usage(const char* prog) {
+
+	printf("usage: %s [--res vga,720p,1080p,4k,WxH] [--blobs n] [--noise f] [--seed n]\n", prog);
+	printf("          [--input <video|dir|glob>] [--frames n] [--iters n] [--min-ms t] [--k n] [--db-rows n]\n");
+	printf("          [--out file.csv|file.jsonl] [--pyramid-report file.csv] [--factors 2,4] [--samples n] [--check n]\n");
+	printf("  --res     synthetic scene sizes, comma separated (default vga,720p,1080p,4k)\n");
+	printf("  --blobs   dark objects per scene (default 5)\n");
+	printf("  --noise   fraction of noise pixels (default 0.01)\n");
+	printf("  --input   also benchmark the first --frames frames (default 3) of real footage\n");
+	printf("  --db-rows classify against n generated database entries (100 per object) instead of object_database\n");
+	printf("  --iters   minimum timed calls per stage (default 10), --min-ms minimum time per stage (default 200)\n");
+	printf("  --pyramid-report  compare pyramid mode with each of --factors (default 2,4) against full resolution\n");
+	printf("            on --samples scenes per size (default 20) with an object in the middle, and on --input frames\n");
+	printf("  --check   instead of timing, check CleanupStream against the separate clean-up functions, labelling on\n");
+	printf("            parallel strips against one strip and the k-d tree index against the scans on n random cases\n");
+	printf("            (seeded by --seed), exits with -1 at the first difference\n");
+}
+
+
+//benchmarks each stage on synthetic scenes at several resolutions and optionally real frames
+int main(int argc, char* argv[]) {
+
+	std::vector<cv::Size> sizes;
+	SceneSpec spec;
+	const char* input = NULL;
+	const char* outFile = NULL;
+	int frames = 3;
+	int minIters = 10;
+	double minMs = 200;
+	int k = 3;
+	int dbRows = 0; //synthetic database size, 0 uses object_database
+	const char* pyramidFile = NULL;
+	std::vector<int> factors;
+	int samples = 20;
+	int checks = 0; //random cases for --check, 0 times the stages instead
+
+	for (int a = 1; a < argc; a++) {
+
+		std::string arg(argv[a]);
+		bool more = a + 1 < argc;
+
+		if (arg == "--res" && more) {
+			std::string list(argv[++a]);
+			size_t start = 0;
+			while (start <= list.size()) {
+				size_t end = list.find(',', start);
+				if (end == std::string::npos) {
+					end = list.size();
+				}
+				cv::Size size;
+				if (!parseResolution(list.substr(start, end - start), size)) {
+					printf("Unknown resolution %s\n", list.substr(start, end - start).c_str());
+					return -1;
+				}
+				sizes.push_back(size);
+				start = end + 1;
+			}
+		}
+		else if (arg == "--blobs" && more) {
+			spec.blobs = atoi(argv[++a]);
+		}
+		else if (arg == "--noise" && more) {
+			spec.noise = atof(argv[++a]);
+		}
+		else if (arg == "--seed" && more) {
+			spec.seed = static_cast<unsigned>(atoi(argv[++a]));
+		}
+		else if (arg == "--input" && more) {
+			input = argv[++a];
+		}
+		else if (arg == "--frames" && more) {
+			frames = atoi(argv[++a]);
+		}
+		else if (arg == "--iters" && more) {
+			minIters = std::max(1, atoi(argv[++a]));
+		}
+		else if (arg == "--min-ms" && more) {
+			minMs = atof(argv[++a]);
+		}
+		else if (arg == "--db-rows" && more) {
+			dbRows = atoi(argv[++a]);
+		}
+		else if (arg == "--k" && more) {
+			k = atoi(argv[++a]);
+		}
+		else if (arg == "--out" && more) {
+			outFile = argv[++a];
+		}
+		else if (arg == "--pyramid-report" && more) {
+			pyramidFile = argv[++a];
+		}
+		else if (arg == "--factors" && more) {
+			std::string list(argv[++a]);
+			for (size_t start = 0; start < list.size();) {
+				size_t end = std::min(list.find(',', start), list.size());
+				factors.push_back(std::max(2, atoi(list.substr(start, end - start).c_str())));
+				start = end + 1;
+			}
+		}
+		else if (arg == "--samples" && more) {
+			samples = std::max(1, atoi(argv[++a]));
+		}
+		else if (arg == "--check" && more) {
+			checks = std::max(1, atoi(argv[++a]));
+		}
+		else {
+			usage(argv[0]);
+			return arg == "--help" ? 0 : -1;
+		}
+	}
+
+	if (factors.empty()) {
+		factors.push_back(2);
+		factors.push_back(4);
+	}
+
+	if (sizes.empty()) {
+		sizes.push_back(cv::Size(640, 480));
+		sizes.push_back(cv::Size(1280, 720));
+		sizes.push_back(cv::Size(1920, 1080));
+		sizes.push_back(cv::Size(3840, 2160));
+	}
+
+	//classification runs against the real database when it's there, unless a size is asked for
+	std::vector<char*> objNames;
+	std::vector<std::vector<float>> objData;
+	char csvFile[] = "object_database";
+	FILE* db = (dbRows > 0) ? NULL : fopen(csvFile, "r");
+	if (db != NULL) {
+		fclose(db);
+		read_image_data_csv(csvFile, objNames, objData, 0);
+	}
+	if (objData.empty()) {
+		cv::RNG rng(7);
+		for (int i = 0; i < std::max(dbRows, 80); i++) {
+			//every feature varies, so any MatchFeatures has deviations to scale by
+			std::vector<float> row(FeatureDatabase::FEATURES, 0.0f);
+			for (int f = 0; f < FeatureDatabase::FEATURES; f++) {
+				row[f] = static_cast<float>(rng.uniform(0.0, 1.0));
+			}
+			if (StoredFeatures::has(FEAT_FILL)) {
+				row[StoredFeatures::index(FEAT_FILL)] = static_cast<float>(rng.uniform(0.3, 1.0));
+			}
+			if (StoredFeatures::has(FEAT_RATIO)) {
+				row[StoredFeatures::index(FEAT_RATIO)] = static_cast<float>(rng.uniform(0.1, 1.0));
+			}
+			objData.push_back(row);
+			objNames.push_back(strdup(("class" + std::to_string(i % std::max(10, dbRows / 100))).c_str()));
+		}
+	}
+	FeatureDatabase fdb;
+	fdb.load(objData, objNames);
+	float devs[MATCH_FEATURES] = { 0 };
+	deviation(fdb, devs);
+	if (checkBatch(fdb, devs) != 0) {
+		return -1;
+	}
+	if (checks > 0) {
+		return runChecks(checks, spec.seed);
+	}
+
+	PipelineSettings settings;
+	settings.knn = true;
+	settings.k = k;
+
+	FeatureIndex index;
+	index.build(fdb);
+
+	ObjectCatalog catalog;
+	catalog.load(objData, objNames, NULL);
+	settings.catalog = &catalog;
+
+	std::vector<BenchResult> results;
+
+	for (size_t s = 0; s < sizes.size(); s++) {
+
+		spec.width = sizes[s].width;
+		spec.height = sizes[s].height;
+		cv::Mat scene;
+		makeScene(spec, scene);
+
+		std::string name = "synthetic_" + std::to_string(spec.blobs) + "blobs";
+		benchFrame(name, scene, settings, fdb, index, devs, minIters, minMs, results);
+		fprintf(stderr, "%s %dx%d done\n", name.c_str(), spec.width, spec.height);
+	}
+
+	if (input != NULL) {
+
+		FrameSource* source = openSource(input);
+		if (source == NULL) {
+			printf("Unable to open %s\n", input);
+			return -1;
+		}
+
+		cv::Mat frame;
+		std::string name;
+		for (int f = 0; f < frames && source->read(frame, name); f++) {
+			if (name.empty()) {
+				name = std::string(input) + "#" + std::to_string(f);
+			}
+			benchFrame(name, frame, settings, fdb, index, devs, minIters, minMs, results);
+			fprintf(stderr, "%s done\n", name.c_str());
+		}
+		delete source;
+	}
+
+	if (pyramidFile != NULL) {
+
+		std::vector<PyramidReport> reports;
+		settings.knn = false;
+
+		for (size_t s = 0; s < sizes.size(); s++) {
+			for (size_t f = 0; f < factors.size(); f++) {
+
+				PyramidReport report;
+				report.input = "synthetic_centered";
+				report.width = sizes[s].width;
+				report.height = sizes[s].height;
+				report.factor = factors[f];
+
+				SceneSpec scene = spec;
+				scene.width = sizes[s].width;
+				scene.height = sizes[s].height;
+				scene.centered = true;
+				for (int n = 0; n < samples; n++) {
+					scene.seed = spec.seed + n;
+					cv::Mat frame;
+					makeScene(scene, frame);
+					pyramidCompare(frame, settings, minIters, minMs, report);
+				}
+				reports.push_back(report);
+				fprintf(stderr, "pyramid %d %dx%d done\n", factors[f], report.width, report.height);
+			}
+		}
+
+		FrameSource* source = (input != NULL) ? openSource(input) : NULL;
+		if (source != NULL) {
+
+			std::vector<PyramidReport> real(factors.size());
+			cv::Mat frame;
+			std::string name;
+			for (int n = 0; n < frames && source->read(frame, name); n++) {
+				for (size_t f = 0; f < factors.size(); f++) {
+					real[f].input = input;
+					real[f].width = frame.cols;
+					real[f].height = frame.rows;
+					real[f].factor = factors[f];
+					pyramidCompare(frame, settings, minIters, minMs, real[f]);
+				}
+			}
+			reports.insert(reports.end(), real.begin(), real.end());
+			delete source;
+		}
+
+		settings.knn = true;
+		writePyramidReport(pyramidFile, reports);
+	}
+
+	return writeResults(outFile, results);
+}
@@ -0,0 +1,269 @@
+/*
+	James Marcel
+
+	Object catalog: classification against the database and live enrollment
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "catalog.h"
+#include "recog.h"
+#include "dbfile.h"
+
+
+//stops the writer once everything enrolled has been saved
+ObjectCatalog::~ObjectCatalog() {
+
+	{
+		std::lock_guard<std::mutex> guard(queueLock);
+		stopping = true;
+	}
+	queueCond.notify_all();
+
+	if (writer.joinable()) {
+		writer.join();
+	}
+}
+
+
+//snapshot classify calls read, they keep it alive for as long as they use it
+std::shared_ptr<const ObjectCatalog::Snapshot> ObjectCatalog::snapshot() const {
+
+	return std::atomic_load(&current);
+}
+
+
+//makes next the snapshot every later classify call reads
+void ObjectCatalog::publish(std::shared_ptr<const Snapshot> next) {
+
+	std::atomic_store(&current, next);
+}
+
+
+//deviation of each match feature from the running sums, so nothing has to read every row
+static void runningDeviations(const FeatureDatabase& db, float* devs) {
+
+	for (int d = 0; d < MATCH_FEATURES; d++) {
+		devs[d] = static_cast<float>(db.stats().deviation(MatchFeatures::id(d)));
+	}
+}
+
+
+//fills the catalog from csv rows
+int ObjectCatalog::load(const std::vector<std::vector<float>>& data, const std::vector<char*>& names, const char* path) {
+
+	std::lock_guard<std::mutex> guard(enrollLock);
+
+	std::shared_ptr<Snapshot> next = std::make_shared<Snapshot>();
+	next->db.load(data, names);
+	next->index.build(next->db);
+	deviation(next->db, next->devs);  //calculate std dev for database features
+	publish(next);
+
+	if (path != NULL && !writer.joinable()) {
+		this->path = path;
+		writer = std::thread(&ObjectCatalog::writerLoop, this);
+	}
+
+	return 0;
+}
+
+
+//fills the catalog from a binary database file
+int ObjectCatalog::open(const char* path) {
+
+	std::lock_guard<std::mutex> guard(enrollLock);
+
+	std::shared_ptr<Snapshot> next = std::make_shared<Snapshot>();
+	int prebuilt = openDatabaseFile(path, next->db, &next->index);
+	if (prebuilt < 0) {
+		return -1;
+	}
+	if (prebuilt == 0) {
+		//a loaded index has checked the order column, building one goes by it unchecked
+		if (!next->db.orderValid()) {
+			printf("%s has a damaged order column\n", path);
+			return -1;
+		}
+		next->index.build(next->db);
+	}
+
+	//the file keeps running sums, so nothing has to read every row
+	runningDeviations(next->db, next->devs);
+	publish(next);
+
+	if (!writer.joinable()) {
+		this->path = path;
+		binary = true;
+		writer = std::thread(&ObjectCatalog::writerLoop, this);
+	}
+
+	return 0;
+}
+
+
+//name of the closest object to features through the index
+int ObjectCatalog::classify(double* features, bool knn, int k, char* result) const {
+
+	std::shared_ptr<const Snapshot> snap = snapshot();
+
+	float dev[MATCH_FEATURES];
+	memcpy(dev, snap->devs, sizeof(dev));
+	if (knn) {
+		return snap->index.kNearest(features, dev, result, k);
+	}
+	return snap->index.nearest(features, dev, result);
+}
+
+
+//a scan of every row for a batch beats one index lookup per vector up to about this many rows
+static const int batchScanRows = 4096;
+
+//names of the closest objects to m feature vectors, all from one snapshot
+int ObjectCatalog::classify(const double* features, int m, bool knn, int k, char** results) const {
+
+	std::shared_ptr<const Snapshot> snap = snapshot();
+	const FeatureDatabase& db = snap->db;
+	const FeatureIndex& index = snap->index;
+
+	float dev[MATCH_FEATURES];
+	memcpy(dev, snap->devs, sizeof(dev));
+	const int F = FEAT_COUNT;
+
+	if (knn || db.rows() > batchScanRows) {
+		for (int q = 0; q < m; q++) {
+			double target[F];
+			memcpy(target, features + q * F, sizeof(target));
+			if (knn) {
+				index.kNearest(target, dev, results[q], k);
+			}
+			else {
+				index.nearest(target, dev, results[q]);
+			}
+		}
+		return 0;
+	}
+
+	static thread_local std::vector<Neighbor> best;
+	best.resize(m);
+	nearestBatch(features, m, dev, db, 1, best.data());
+
+	for (int q = 0; q < m; q++) {
+		if (best[q].row < 0) {
+			results[q][0] = '\0';
+		}
+		else {
+			strcpy(results[q], db.className(db.rowClass(best[q].row)));
+		}
+	}
+
+	return 0;
+}
+
+
+//adds an entry to the database and index, updates the deviations and queues it to be saved
+int ObjectCatalog::enroll(const double* features, const char* name) {
+
+	float row[FeatureDatabase::FEATURES];
+	storedRow(features, row);
+
+	{
+		std::lock_guard<std::mutex> guard(enrollLock);
+
+		//attached columns are shared by the copy until add copies them
+		std::shared_ptr<Snapshot> next = std::make_shared<Snapshot>(*snapshot());
+		next->db.add(row, name);
+		next->index.insert(row, name);
+
+		//running sums instead of another pass over every entry
+		runningDeviations(next->db, next->devs);
+		publish(next);
+	}
+
+	if (writer.joinable()) {
+		Pending p;
+		p.name = name;
+		memcpy(p.row, row, sizeof(p.row));
+		{
+			std::lock_guard<std::mutex> guard(queueLock);
+			pending.push_back(p);
+		}
+		queueCond.notify_all();
+	}
+
+	return 0;
+}
+
+
+int ObjectCatalog::size() const {
+
+	return snapshot()->db.rows();
+}
+
+
+void ObjectCatalog::deviations(float* out) const {
+
+	std::shared_ptr<const Snapshot> snap = snapshot();
+	memcpy(out, snap->devs, sizeof(snap->devs));
+}
+
+
+//waits until every enrolled entry has been written
+void ObjectCatalog::flush() {
+
+	std::unique_lock<std::mutex> guard(queueLock);
+	queueCond.wait(guard, [this]() { return (pending.empty() && !writing) || !writer.joinable(); });
+}
+
+
+//appends enrolled entries to the database file so the display thread never waits on the disk
+//(binary files are rewritten whole, since their columns can't be appended to)
+void ObjectCatalog::writerLoop() {
+
+	std::unique_lock<std::mutex> guard(queueLock);
+
+	for (;;) {
+
+		queueCond.wait(guard, [this]() { return stopping || !pending.empty(); });
+		if (pending.empty()) {
+			return; //stopping with nothing left to write
+		}
+
+		if (binary) {
+			//every queued entry is already in db, so one rewrite saves all of them
+			pending.clear();
+			writing = true;
+			guard.unlock();
+
+			//the latest snapshot has every entry queued so far and can't change underneath
+			std::vector<char> bytes;
+			std::shared_ptr<const Snapshot> snap = snapshot();
+			encodeDatabase(snap->db, &snap->index, bytes);
+			writeFileAtomic(path.c_str(), bytes);
+
+			guard.lock();
+			writing = false;
+			queueCond.notify_all();
+			continue;
+		}
+
+		Pending p = pending.front();
+		pending.pop_front();
+		writing = true;
+		guard.unlock();
+
+		appendCsvRow(path.c_str(), p.name.c_str(), p.row);
+
+		guard.lock();
+		writing = false;
+		queueCond.notify_all();
+	}
+}
@@ -0,0 +1,94 @@
+/*
+	James Marcel
+
+	header for the object catalog: the feature database, its k-d tree index and
+	the feature deviations, kept together so objects can be enrolled while frames are classified
+	classification reads an immutable snapshot of all three, so any number of threads (and cameras)
+	share one copy of the database without taking a lock
+*/
+
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "database.h"
+#include "kdtree.h"
+
+
+class ObjectCatalog {
+public:
+	~ObjectCatalog();
+
+	//fills the catalog from csv rows (names[i] is the object in row i)
+	//entries enrolled later are appended to path in the background, NULL doesn't save them
+	int load(const std::vector<std::vector<float>>& data, const std::vector<char*>& names, const char* path);
+
+	//fills the catalog from a binary database file (dbfile.h), mapped instead of parsed
+	//uses the file's prebuilt index if it has one, enrolled entries rewrite the file in the background
+	int open(const char* path);
+
+	//name of the closest object to features (a feature vector, FEAT_COUNT values like the mu arrays) into result
+	//k-nearest neighbors if knn is set, otherwise nearest neighbor
+	int classify(double* features, bool knn, int k, char* result) const;
+
+	//same for m feature vectors at once (FEAT_COUNT values each), results[i] gets the name for vector i
+	//nearest neighbor goes through nearestBatch on databases small enough for it to beat the index
+	int classify(const double* features, int m, bool knn, int k, char** results) const;
+
+	//adds an entry that's recognized from the next classify call on, features is a feature vector like classify takes
+	//the next snapshot is a copy of the current one with the entry added, swapped in atomically,
+	//so classify calls already running finish on the old one
+	//the deviations are updated from running sums, and the entry is written to the file by another thread
+	//the copy takes time proportional to the database (a few ms at 100,000 entries), which is fine one key press at a time
+	//but not for adding many entries, those should go in the csv or binary file
+	int enroll(const double* features, const char* name);
+
+	int size() const;
+
+	//current deviations of the match features (fill % and h/w ratio), MATCH_FEATURES values
+	void deviations(float* out) const;
+
+	//waits until every enrolled entry has been written
+	void flush();
+
+private:
+	//an enrolled entry waiting to be written
+	struct Pending {
+		std::string name;
+		float row[FeatureDatabase::FEATURES]; //stored features, like a database row
+	};
+
+	//one version of the database, its index and the deviations, never changed once published
+	struct Snapshot {
+		FeatureDatabase db;
+		FeatureIndex index;
+		float devs[MATCH_FEATURES] = { 0 }; //one per match feature
+	};
+
+	void writerLoop();
+
+	//current snapshot, read with std::atomic_load and replaced with std::atomic_store
+	std::shared_ptr<const Snapshot> snapshot() const;
+	void publish(std::shared_ptr<const Snapshot> next);
+
+	std::shared_ptr<const Snapshot> current = std::make_shared<const Snapshot>();
+	std::mutex enrollLock; //one snapshot is built at a time
+
+	std::string path;
+	bool binary = false; //path is a binary database file, rewritten whole instead of appended to
+	std::mutex queueLock;
+	std::condition_variable queueCond;
+	std::deque<Pending> pending;
+	bool writing = false; //writer has taken an entry off pending and not finished it
+	bool stopping = false;
+	std::thread writer;
+};
+
+#endif
@@ -0,0 +1,230 @@
+/*
+	James Marcel
+
+	In-memory feature database, one column per stored feature with rows grouped by object
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "database.h"
+
+
+//moves each mean toward the new value and adds to the squared differences
+//using the difference from both the old and new mean (Welford)
+void RunningStats::add(const float* row) {
+
+	count++;
+	for (int s = 0; s < StoredFeatures::size; s++) {
+		double delta = row[s] - mean[s];
+		mean[s] += delta / count;
+		m2[s] += delta * (row[s] - mean[s]);
+	}
+}
+
+
+//population standard deviation of feature f
+double RunningStats::deviation(int f) const {
+
+	int s = StoredFeatures::index(f);
+	if (count == 0 || s < 0) {
+		return 0;
+	}
+	return sqrt(m2[s] / count);
+}
+
+
+//replaces the contents with the rows of data, names[i] is the object in row i
+int FeatureDatabase::load(const std::vector<std::vector<float>>& data, const std::vector<char*>& names) {
+
+	clear();
+
+	int n = static_cast<int>(std::min(data.size(), names.size()));
+
+	//file order within each object, objects by name
+	std::vector<int> order(n);
+	for (int i = 0; i < n; i++) {
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&names](int a, int b) { return strcmp(names[a], names[b]) < 0; });
+
+	for (int f = 0; f < FEATURES; f++) {
+		cols[f].resize(n);
+	}
+	seqs.resize(n);
+
+	for (int r = 0; r < n; r++) {
+
+		int i = order[r];
+		if (classNames.empty() || classNames.back() != names[i]) {
+			classNames.push_back(names[i]);
+			offsets.back() = r;
+			offsets.push_back(r);
+		}
+
+		for (int f = 0; f < FEATURES; f++) {
+			cols[f][r] = (f < static_cast<int>(data[i].size())) ? data[i][f] : 0.0f;
+		}
+		seqs[r] = i;
+	}
+	offsets.back() = n;
+	count = n;
+	repoint();
+
+	//stats in file order so they match what adding one at a time would give
+	for (int i = 0; i < n; i++) {
+		float features[FEATURES] = { 0 };
+		for (int f = 0; f < FEATURES && f < static_cast<int>(data[i].size()); f++) {
+			features[f] = data[i][f];
+		}
+		running.add(features);
+	}
+
+	return 0;
+}
+
+
+//uses columns stored somewhere else without copying them
+void FeatureDatabase::attach(std::shared_ptr<const void> owner, int rows, const float* const* columns, const int32_t* seq,
+	const std::vector<std::string>& names, const std::vector<int>& offsets, const RunningStats& stats) {
+
+	clear();
+
+	attached = owner;
+	count = rows;
+	for (int f = 0; f < FEATURES; f++) {
+		colPtr[f] = columns[f];
+	}
+	seqPtr = seq;
+	classNames = names;
+	this->offsets = offsets;
+	running = stats;
+}
+
+
+//a copy shares attached columns, which are never written, and copies owned ones
+FeatureDatabase::FeatureDatabase(const FeatureDatabase& other)
+	: seqs(other.seqs), count(other.count), attached(other.attached),
+	classNames(other.classNames), offsets(other.offsets), running(other.running) {
+
+	for (int f = 0; f < FEATURES; f++) {
+		cols[f] = other.cols[f];
+	}
+
+	if (attached) {
+		for (int f = 0; f < FEATURES; f++) {
+			colPtr[f] = other.colPtr[f];
+		}
+		seqPtr = other.seqPtr;
+	}
+	else {
+		repoint();
+	}
+}
+
+
+//copies attached columns into cols and seqs
+void FeatureDatabase::own() {
+
+	if (!attached) {
+		return;
+	}
+
+	for (int f = 0; f < FEATURES; f++) {
+		cols[f].assign(colPtr[f], colPtr[f] + count);
+	}
+	seqs.assign(seqPtr, seqPtr + count);
+	attached.reset();
+	repoint();
+}
+
+
+//points colPtr and seqPtr at cols and seqs
+void FeatureDatabase::repoint() {
+
+	for (int f = 0; f < FEATURES; f++) {
+		colPtr[f] = cols[f].data();
+	}
+	seqPtr = seqs.data();
+}
+
+
+//adds one entry after the others of its object, returns its row
+int FeatureDatabase::add(const float* features, const char* name) {
+
+	own();
+
+	std::vector<std::string>::iterator it = std::lower_bound(classNames.begin(), classNames.end(), std::string(name));
+	int c = static_cast<int>(it - classNames.begin());
+
+	//new object with no rows yet, just before the object after it
+	if (it == classNames.end() || *it != name) {
+		classNames.insert(it, std::string(name));
+		offsets.insert(offsets.begin() + c, offsets[c]);
+	}
+
+	int r = offsets[c + 1];
+	for (int f = 0; f < FEATURES; f++) {
+		cols[f].insert(cols[f].begin() + r, features[f]);
+	}
+	seqs.insert(seqs.begin() + r, count);
+	count++;
+	repoint();
+
+	for (size_t o = c + 1; o < offsets.size(); o++) {
+		offsets[o]++;
+	}
+
+	running.add(features);
+
+	return r;
+}
+
+
+void FeatureDatabase::clear() {
+
+	for (int f = 0; f < FEATURES; f++) {
+		cols[f].clear();
+	}
+	seqs.clear();
+	count = 0;
+	attached.reset();
+	repoint();
+	classNames.clear();
+	offsets.assign(1, 0);
+	running = RunningStats();
+}
+
+
+//object of row r, found from the offsets
+int FeatureDatabase::rowClass(int r) const {
+
+	return static_cast<int>(std::upper_bound(offsets.begin() + 1, offsets.end(), r) - (offsets.begin() + 1));
+}
+
+
+//true if the order column numbers every row once, from 0 up to rows()
+bool FeatureDatabase::orderValid() const {
+
+	std::vector<char> seen(count, 0);
+	for (int r = 0; r < count; r++) {
+		int32_t seq = seqPtr[r];
+		if (seq < 0 || seq >= count || seen[seq]) {
+			return false;
+		}
+		seen[seq] = 1;
+	}
+	return true;
+}
+
+
+//copies the stored features of row r into out
+void FeatureDatabase::row(int r, float* out) const {
+
+	for (int f = 0; f < FEATURES; f++) {
+		out[f] = colPtr[f][r];
+	}
+}
@@ -0,0 +1,111 @@
+/*
+	James Marcel
+
+	header for the in-memory feature database
+	each feature is its own contiguous column and rows are grouped by object,
+	so classifying reads straight down the columns without copying anything
+*/
+
+#ifndef DATABASE_H
+#define DATABASE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <memory>
+#include "featureset.h"
+
+
+//running mean and variance of every stored feature, updated one entry at a time (Welford's method)
+//so the deviations never need a pass over the whole database
+struct RunningStats {
+	int64_t count = 0;
+	double mean[StoredFeatures::size] = { 0 }; //in StoredFeatures order, like a database row
+	double m2[StoredFeatures::size] = { 0 }; //sum of squared differences from the mean
+
+	void add(const float* row);
+
+	//population standard deviation of feature f (a stored Feature), same as deviation() works out
+	double deviation(int f) const;
+};
+
+//the stored features of a feature vector (FEAT_COUNT values by Feature, like the mu arrays) as a database row
+inline void storedRow(const double* features, float* row) {
+
+	for (int s = 0; s < StoredFeatures::size; s++) {
+		row[s] = static_cast<float>(features[StoredFeatures::id(s)]);
+	}
+}
+
+class FeatureDatabase {
+public:
+	static const int FEATURES = StoredFeatures::size; //one column per stored feature, rows hold them in StoredFeatures order
+
+	FeatureDatabase() {}
+	//a copy shares attached columns (they're never written) and copies its own
+	FeatureDatabase(const FeatureDatabase& other);
+	FeatureDatabase& operator=(const FeatureDatabase&) = delete; //columns may point into its own storage
+
+	//replaces the contents with the rows of data, names[i] is the object in row i
+	//(the layout read_image_data_csv gives, the stored features in order)
+	int load(const std::vector<std::vector<float>>& data, const std::vector<char*>& names);
+
+	//uses columns stored somewhere else (a mapped database file) without copying them
+	//owner keeps that memory alive for as long as the database points into it
+	//columns[s] (stored feature s) and seq hold rows values each, grouped by object with offsets (classes + 1 values)
+	void attach(std::shared_ptr<const void> owner, int rows, const float* const* columns, const int32_t* seq,
+		const std::vector<std::string>& names, const std::vector<int>& offsets, const RunningStats& stats);
+
+	//adds one entry after the others of its object, returns its row
+	//features is a database row (FEATURES values), attached columns are copied first
+	int add(const float* features, const char* name);
+
+	void clear();
+
+	int rows() const { return count; }
+	int classes() const { return static_cast<int>(classNames.size()); }
+
+	//feature f (a Feature in StoredFeatures) of every row
+	const float* column(int f) const { return colPtr[StoredFeatures::index(f)]; }
+
+	//rows of object c are classBegin(c) up to classEnd(c), objects are sorted by name
+	int classBegin(int c) const { return offsets[c]; }
+	int classEnd(int c) const { return offsets[c + 1]; }
+	const char* className(int c) const { return classNames[c].c_str(); }
+
+	//object of row r
+	int rowClass(int r) const;
+
+	//order row r was added in, used to break ties the way a scan in file order would
+	int rowSeq(int r) const { return seqPtr[r]; }
+
+	//true if the order column numbers every row once, from 0 up to rows()
+	//the order column of a mapped file isn't checked when it's opened, so anything indexing by it has to ask first
+	bool orderValid() const;
+
+	//copies the stored features of row r into out, in StoredFeatures order
+	void row(int r, float* out) const;
+
+	//mean and variance of every feature, kept up to date by load and add
+	const RunningStats& stats() const { return running; }
+
+private:
+	//copies attached columns into cols and seqs
+	void own();
+	//points colPtr and seqPtr at cols and seqs
+	void repoint();
+
+	std::vector<float> cols[FEATURES];
+	std::vector<int32_t> seqs;
+	const float* colPtr[FEATURES] = { NULL };
+	const int32_t* seqPtr = NULL;
+	int count = 0;
+	std::shared_ptr<const void> attached; //set while the columns point outside cols
+
+	std::vector<std::string> classNames;
+	std::vector<int> offsets = std::vector<int>(1, 0); //first row of each object, plus one past the end
+	RunningStats running;
+};
+
+#endif
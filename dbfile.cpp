@@ -0,0 +1,449 @@
+/*
+	James Marcel
+
+	Binary database file: writing, memory mapped reading and csv conversion
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <memory>
+#include "dbfile.h"
+#include "database.h"
+#include "kdtree.h"
+#include "csv_util.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define DBFILE_MMAP 1
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+static const char FILE_MAGIC[8] = { 'O', 'B', 'J', 'R', 'E', 'C', 'D', 'B' };
+static const uint32_t FILE_VERSION = 2;
+
+//start of the file, every offset is from the start of the file
+struct FileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t features; //columns per row, StoredFeatures::size
+	uint32_t rows;
+	uint32_t classes;
+	uint64_t objectsOffset; //classes pairs of (first row, name offset), then the names, each ending in 0
+	uint64_t objectsSize;
+	uint64_t columnsOffset;
+	uint64_t columnStride; //bytes from the start of one column to the next
+	uint64_t indexOffset; //0 if there's no prebuilt index
+	uint64_t indexSize;
+	int64_t statsCount; //RunningStats, so deviations don't need a pass over the columns
+	double statsMean[FeatureDatabase::FEATURES];
+	double statsM2[FeatureDatabase::FEATURES];
+	int32_t featureIds[FeatureDatabase::FEATURES]; //Feature of each column (version 2 on)
+};
+
+//version 1 files have no feature ids, their columns are the first eight features in enum order
+//and their header is this one without featureIds, which only fits when that's what is stored now
+static bool legacyColumns() {
+
+	if (StoredFeatures::size != 8) {
+		return false;
+	}
+	for (int s = 0; s < StoredFeatures::size; s++) {
+		if (StoredFeatures::id(s) != s) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+static uint64_t align64(uint64_t n) {
+
+	return (n + 63) & ~static_cast<uint64_t>(63);
+}
+
+
+//true if path starts with the binary database magic
+bool isDatabaseFile(const char* path) {
+
+	FILE* fp = fopen(path, "rb");
+	if (fp == NULL) {
+		return false;
+	}
+
+	char magic[8];
+	bool match = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) && memcmp(magic, FILE_MAGIC, sizeof(magic)) == 0;
+	fclose(fp);
+
+	return match;
+}
+
+
+//lays db (and index if not NULL) out in the binary format
+int encodeDatabase(const FeatureDatabase& db, const FeatureIndex* index, std::vector<char>& out) {
+
+	const int F = FeatureDatabase::FEATURES;
+	uint32_t rows = static_cast<uint32_t>(db.rows());
+	uint32_t classes = static_cast<uint32_t>(db.classes());
+
+	//object table and names
+	std::vector<char> objects(classes * 2 * sizeof(uint32_t));
+	for (uint32_t c = 0; c < classes; c++) {
+		uint32_t entry[2] = { static_cast<uint32_t>(db.classBegin(c)), static_cast<uint32_t>(objects.size() - classes * 2 * sizeof(uint32_t)) };
+		memcpy(&objects[c * sizeof(entry)], entry, sizeof(entry));
+		const char* name = db.className(c);
+		objects.insert(objects.end(), name, name + strlen(name) + 1);
+	}
+
+	std::vector<char> trees;
+	if (index != NULL) {
+		index->save(trees);
+	}
+
+	FileHeader head;
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, FILE_MAGIC, sizeof(head.magic));
+	head.version = FILE_VERSION;
+	head.features = F;
+	for (int f = 0; f < F; f++) {
+		head.featureIds[f] = StoredFeatures::id(f);
+	}
+	head.rows = rows;
+	head.classes = classes;
+	head.objectsOffset = align64(sizeof(FileHeader));
+	head.objectsSize = objects.size();
+	head.columnsOffset = align64(head.objectsOffset + head.objectsSize);
+	head.columnStride = align64(static_cast<uint64_t>(rows) * sizeof(float));
+	uint64_t columnsEnd = head.columnsOffset + (F + 1) * head.columnStride;
+	head.indexOffset = (index != NULL) ? columnsEnd : 0;
+	head.indexSize = trees.size();
+
+	const RunningStats& stats = db.stats();
+	head.statsCount = stats.count;
+	memcpy(head.statsMean, stats.mean, sizeof(head.statsMean));
+	memcpy(head.statsM2, stats.m2, sizeof(head.statsM2));
+
+	out.assign(columnsEnd + trees.size(), 0);
+	memcpy(&out[0], &head, sizeof(head));
+	if (!objects.empty()) {
+		memcpy(&out[head.objectsOffset], objects.data(), objects.size());
+	}
+
+	for (int f = 0; f < F; f++) {
+		if (rows > 0) {
+			memcpy(&out[head.columnsOffset + f * head.columnStride], db.column(StoredFeatures::id(f)), rows * sizeof(float));
+		}
+	}
+	for (uint32_t r = 0; r < rows; r++) {
+		int32_t seq = db.rowSeq(r);
+		memcpy(&out[head.columnsOffset + F * head.columnStride + r * sizeof(int32_t)], &seq, sizeof(seq));
+	}
+
+	if (!trees.empty()) {
+		memcpy(&out[head.indexOffset], trees.data(), trees.size());
+	}
+
+	return 0;
+}
+
+
+//writes bytes to path through a temporary file and a rename
+int writeFileAtomic(const char* path, const std::vector<char>& bytes) {
+
+	std::string tmp = std::string(path) + ".tmp";
+
+	FILE* fp = fopen(tmp.c_str(), "wb");
+	if (fp == NULL) {
+		printf("Unable to open %s\n", tmp.c_str());
+		return -1;
+	}
+
+	bool ok = bytes.empty() || fwrite(bytes.data(), 1, bytes.size(), fp) == bytes.size();
+	ok = (fclose(fp) == 0) && ok;
+
+	if (!ok || rename(tmp.c_str(), path) != 0) {
+		printf("Unable to write %s\n", path);
+		remove(tmp.c_str());
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int writeDatabaseFile(const char* path, const FeatureDatabase& db, const FeatureIndex* index) {
+
+	std::vector<char> bytes;
+	encodeDatabase(db, index, bytes);
+	return writeFileAtomic(path, bytes);
+}
+
+
+//whole file, mapped read only where possible and read into memory otherwise
+static std::shared_ptr<const void> mapFile(const char* path, size_t& size) {
+
+#ifdef DBFILE_MMAP
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return std::shared_ptr<const void>();
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
+		return std::shared_ptr<const void>();
+	}
+	size = static_cast<size_t>(st.st_size);
+
+	//the mapping stays valid after the descriptor is closed
+	void* addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		return std::shared_ptr<const void>();
+	}
+
+	size_t length = size;
+	return std::shared_ptr<const void>(addr, [length](const void* p) { munmap(const_cast<void*>(p), length); });
+#else
+	FILE* fp = fopen(path, "rb");
+	if (fp == NULL) {
+		return std::shared_ptr<const void>();
+	}
+
+	std::shared_ptr<std::vector<double>> buf = std::make_shared<std::vector<double>>(); //double keeps the columns aligned
+	std::vector<char> bytes;
+	char chunk[65536];
+	size_t got;
+	while ((got = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+		bytes.insert(bytes.end(), chunk, chunk + got);
+	}
+	fclose(fp);
+
+	size = bytes.size();
+	buf->resize(size / sizeof(double) + 1);
+	memcpy(buf->data(), bytes.data(), size);
+	return std::shared_ptr<const void>(buf, buf->data());
+#endif
+}
+
+
+//maps path and attaches db's columns to it
+int openDatabaseFile(const char* path, FeatureDatabase& db, FeatureIndex* index) {
+
+	const int F = FeatureDatabase::FEATURES;
+
+	size_t size = 0;
+	std::shared_ptr<const void> file = mapFile(path, size);
+	if (!file) {
+		printf("Unable to open %s\n", path);
+		return -1;
+	}
+	const char* base = static_cast<const char*>(file.get());
+
+	//everything in the header has to agree with the file before anything points into it
+	FileHeader head;
+	if (size < sizeof(head)) {
+		printf("%s is not a database file\n", path);
+		return -1;
+	}
+	memcpy(&head, base, sizeof(head));
+
+	//the columns have to be the features this build stores, in the same order
+	bool known = memcmp(head.magic, FILE_MAGIC, sizeof(head.magic)) == 0 && (head.version == FILE_VERSION || head.version == 1);
+	bool sameColumns = head.features == static_cast<uint32_t>(F) && (head.version == FILE_VERSION || legacyColumns());
+	for (int f = 0; f < F && sameColumns && head.version == FILE_VERSION; f++) {
+		sameColumns = head.featureIds[f] == StoredFeatures::id(f);
+	}
+	if (known && !sameColumns) {
+		printf("%s stores other features than this build does\n", path);
+		return -1;
+	}
+
+	uint64_t tableSize = static_cast<uint64_t>(head.classes) * 2 * sizeof(uint32_t);
+	if (!known || !sameColumns
+		|| head.objectsOffset > size || head.objectsSize > size - head.objectsOffset || tableSize > head.objectsSize
+		|| head.columnsOffset % 64 != 0 || head.columnStride < static_cast<uint64_t>(head.rows) * sizeof(float)
+		|| head.columnStride % 64 != 0 || head.columnsOffset > size
+		|| head.columnStride > (size - head.columnsOffset) / (F + 1)
+		|| (head.indexOffset != 0 && (head.indexOffset > size || head.indexSize > size - head.indexOffset))) {
+		printf("%s is not a valid database file (version %u)\n", path, head.version);
+		return -1;
+	}
+
+	//object table, first rows must go up and names must be sorted like FeatureDatabase keeps them
+	const char* table = base + head.objectsOffset;
+	const char* names = table + tableSize;
+	uint64_t namesSize = head.objectsSize - tableSize;
+
+	std::vector<std::string> classNames(head.classes);
+	std::vector<int> offsets(head.classes + 1);
+	for (uint32_t c = 0; c < head.classes; c++) {
+
+		uint32_t entry[2];
+		memcpy(entry, table + c * sizeof(entry), sizeof(entry));
+
+		const char* name = names + entry[1];
+		if (entry[1] >= namesSize || memchr(name, '\0', namesSize - entry[1]) == NULL
+			|| entry[0] > head.rows || (c == 0 && entry[0] != 0) || (c > 0 && static_cast<int>(entry[0]) < offsets[c - 1])
+			|| (c > 0 && classNames[c - 1].compare(name) >= 0)) {
+			printf("%s has a damaged object table\n", path);
+			return -1;
+		}
+		classNames[c] = name;
+		offsets[c] = static_cast<int>(entry[0]);
+	}
+	offsets[head.classes] = static_cast<int>(head.rows);
+	if (head.classes == 0 && head.rows != 0) {
+		printf("%s has a damaged object table\n", path);
+		return -1;
+	}
+
+	const float* columns[F];
+	for (int f = 0; f < F; f++) {
+		columns[f] = reinterpret_cast<const float*>(base + head.columnsOffset + f * head.columnStride);
+	}
+	const int32_t* seq = reinterpret_cast<const int32_t*>(base + head.columnsOffset + F * head.columnStride);
+
+
+	RunningStats stats;
+	stats.count = head.statsCount;
+	memcpy(stats.mean, head.statsMean, sizeof(stats.mean));
+	memcpy(stats.m2, head.statsM2, sizeof(stats.m2));
+
+	db.attach(file, static_cast<int>(head.rows), columns, seq, classNames, offsets, stats);
+
+	if (index == NULL || head.indexOffset == 0) {
+		return 0;
+	}
+	if (index->load(base + head.indexOffset, head.indexSize, db) != 0) {
+		printf("%s has a damaged index or one over other features, rebuilding it\n", path);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+//opens path and checks what opening leaves out, the order column and the prebuilt index if the file has one
+int verifyDatabaseFile(const char* path) {
+
+	FeatureDatabase db;
+	FeatureIndex index;
+	int prebuilt = openDatabaseFile(path, db, &index);
+	if (prebuilt < 0) {
+		return -1;
+	}
+
+	if (!db.orderValid()) {
+		printf("%s has a damaged order column\n", path);
+		return -1;
+	}
+
+	//0 is returned for a damaged index too, the header tells if there was one
+	if (prebuilt == 0) {
+		FileHeader head;
+		FILE* fp = fopen(path, "rb");
+		bool read = fp != NULL && fread(&head, 1, sizeof(head), fp) >= offsetof(FileHeader, statsCount);
+		if (fp != NULL) {
+			fclose(fp);
+		}
+		if (!read || head.indexOffset != 0) {
+			return -1;
+		}
+	}
+
+	printf("%s: %d entries, order column ok, %s\n", path, db.rows(), prebuilt ? "prebuilt index ok" : "no index");
+	return 0;
+}
+
+
+//csv rows (name then the stored features) into a binary file
+int csvToDatabaseFile(const char* csvPath, const char* binPath, bool withIndex) {
+
+	std::vector<char*> names;
+	std::vector<std::vector<float>> data;
+
+	std::vector<char> fname(csvPath, csvPath + strlen(csvPath) + 1);
+	if (read_image_data_csv(fname.data(), names, data, 0) != 0) {
+		printf("Unable to read %s\n", csvPath);
+		return -1;
+	}
+
+	FeatureDatabase db;
+	db.load(data, names);
+
+	if (!withIndex) {
+		return writeDatabaseFile(binPath, db, NULL);
+	}
+
+	FeatureIndex index;
+	index.build(db);
+	return writeDatabaseFile(binPath, db, &index);
+}
+
+
+//one csv row at the end of path, the number format append_image_data_csv writes
+int appendCsvRow(const char* path, const char* name, const float* row) {
+
+	FILE* fp = fopen(path, "a");
+	if (fp == NULL) {
+		printf("Unable to open %s\n", path);
+		return -1;
+	}
+
+	fprintf(fp, "%s", name);
+	for (int f = 0; f < FeatureDatabase::FEATURES; f++) {
+		fprintf(fp, ",%.4f", row[f]);
+	}
+	fprintf(fp, "\n");
+
+	fclose(fp);
+	return 0;
+}
+
+
+//binary file back into csv rows, in the order the entries were added
+int databaseFileToCsv(const char* binPath, const char* csvPath) {
+
+	FeatureDatabase db;
+	if (openDatabaseFile(binPath, db, NULL) < 0) {
+		return -1;
+	}
+
+	//opening doesn't read the order column, it has to be checked before rows are placed by it
+	if (!db.orderValid()) {
+		printf("%s has a damaged order column\n", binPath);
+		return -1;
+	}
+
+	std::vector<int> order(db.rows());
+	for (int r = 0; r < db.rows(); r++) {
+		order[db.rowSeq(r)] = r;
+	}
+
+	FILE* fp = fopen(csvPath, "w");
+	if (fp == NULL) {
+		printf("Unable to open %s\n", csvPath);
+		return -1;
+	}
+
+	//same number format append_image_data_csv writes
+	for (int i = 0; i < db.rows(); i++) {
+
+		int r = order[i];
+		fprintf(fp, "%s", db.className(db.rowClass(r)));
+		for (int f = 0; f < FeatureDatabase::FEATURES; f++) {
+			fprintf(fp, ",%.4f", db.column(StoredFeatures::id(f))[r]);
+		}
+		fprintf(fp, "\n");
+	}
+
+	fclose(fp);
+	return 0;
+}
@@ -0,0 +1,54 @@
+/*
+	James Marcel
+
+	header for the binary database file
+	the file is mapped read only, so opening it doesn't depend on its size and
+	processes opening the same file share its pages
+
+	layout (little endian, every section starts on a 64 byte boundary):
+	  header      magic "OBJRECDB", version, row/object counts, section offsets, running stats, the Feature of each column
+	  objects     first row and name offset of each object (sorted by name), then the names
+	  columns     the stored features as float32 columns, then the int32 order each row was added in
+	  index       optional prebuilt k-d trees (FeatureIndex::save)
+*/
+
+#ifndef DBFILE_H
+#define DBFILE_H
+
+#include <cstdio>
+#include <vector>
+#include "database.h"
+#include "kdtree.h"
+
+
+//true if path starts with the binary database magic
+bool isDatabaseFile(const char* path);
+
+//lays db (and index if not NULL) out in the binary format
+int encodeDatabase(const FeatureDatabase& db, const FeatureIndex* index, std::vector<char>& out);
+
+//writes bytes to path through a temporary file and a rename, so readers never see half a file
+//and anything that has the old file mapped keeps its copy
+int writeFileAtomic(const char* path, const std::vector<char>& bytes);
+
+//encodeDatabase then writeFileAtomic
+int writeDatabaseFile(const char* path, const FeatureDatabase& db, const FeatureIndex* index);
+
+//maps path and attaches db's columns to it
+//index is filled from the prebuilt index if the file has one, returns 1 if it did, 0 if it didn't
+//and -1 if the file can't be opened or isn't a valid database
+//only the header and the object table are checked, the columns aren't read (see FeatureDatabase::orderValid)
+int openDatabaseFile(const char* path, FeatureDatabase& db, FeatureIndex* index);
+
+//opens path and checks what opening leaves out, the order column and the prebuilt index if the file has one
+//reads every row, returns 0 if the file is sound and -1 if not
+int verifyDatabaseFile(const char* path);
+
+//converts between the csv layout read_image_data_csv reads (name then the stored features per line) and the binary file
+int csvToDatabaseFile(const char* csvPath, const char* binPath, bool withIndex);
+int databaseFileToCsv(const char* binPath, const char* csvPath);
+
+//appends name and a database row (the stored features) to a csv file in the same layout
+int appendCsvRow(const char* path, const char* name, const float* row);
+
+#endif
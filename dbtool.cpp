@@ -0,0 +1,78 @@
+/*
+	James Marcel
+
+	Converts the object database between csv and the binary file, and prints what a binary file holds
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "dbfile.h"
+#include "database.h"
+#include "kdtree.h"
+
+
+//prints the command line options
+static void usage(const char* prog) {
+
+	printf("usage: %s import <csv> <bin> [--no-index]\n", prog);
+	printf("       %s export <bin> <csv>\n", prog);
+	printf("       %s info <bin>\n", prog);
+	printf("       %s verify <bin>\n", prog);
+	printf("  import      csv rows (name then the stored features) into a binary file, with a prebuilt k-d tree index\n");
+	printf("              unless --no-index is given\n");
+	printf("  export      binary file back into csv rows, in the order the entries were added\n");
+	printf("  info        objects, entry counts and deviations of a binary file\n");
+	printf("  verify      reads every row of a binary file and checks its order column and prebuilt index\n");
+}
+
+
+//object and entry counts of a binary file
+static int info(const char* path) {
+
+	FeatureDatabase db;
+	FeatureIndex index;
+	int prebuilt = openDatabaseFile(path, db, &index);
+	if (prebuilt < 0) {
+		return -1;
+	}
+
+	printf("%s: %d entries, %d objects, %s\n", path, db.rows(), db.classes(), prebuilt ? "prebuilt index" : "no index");
+	for (int c = 0; c < db.classes(); c++) {
+		printf("  %-20s %d\n", db.className(c), db.classEnd(c) - db.classBegin(c));
+	}
+	printf("deviations:");
+	for (int s = 0; s < FeatureDatabase::FEATURES; s++) {
+		printf(" %s %.4f", featureName(StoredFeatures::id(s)), db.stats().deviation(StoredFeatures::id(s)));
+	}
+	printf("\n");
+
+	return 0;
+}
+
+
+int main(int argc, char* argv[]) {
+
+	if (argc < 3) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	std::string cmd(argv[1]);
+
+	if (cmd == "import" && (argc == 4 || (argc == 5 && strcmp(argv[4], "--no-index") == 0))) {
+		return csvToDatabaseFile(argv[2], argv[3], argc == 4) == 0 ? 0 : 1;
+	}
+	if (cmd == "export" && argc == 4) {
+		return databaseFileToCsv(argv[2], argv[3]) == 0 ? 0 : 1;
+	}
+	if (cmd == "info" && argc == 3) {
+		return info(argv[2]) == 0 ? 0 : 1;
+	}
+	if (cmd == "verify" && argc == 3) {
+		return verifyDatabaseFile(argv[2]) == 0 ? 0 : 1;
+	}
+
+	usage(argv[0]);
+	return -1;
+}
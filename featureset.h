@@ -0,0 +1,138 @@
+/*
+	James Marcel
+
+	header for the feature vector layout and the compile time feature sets
+	moments are only accumulated for the features that are kept, and the distance
+	kernels are unrolled for the features that are matched on
+*/
+
+#ifndef FEATURESET_H
+#define FEATURESET_H
+
+#include <cstddef>
+#include <utility>
+
+
+//position of each feature in a feature vector (the mu arrays and the database columns)
+enum Feature {
+	FEAT_MU20, FEAT_MU02, FEAT_MU11, //central moments
+	FEAT_ALPHA, FEAT_BETA, //angle of least central moment, alpha + pi/2
+	FEAT_MU22, //second moment about beta axis
+	FEAT_FILL, //pixels in region / pixels in oriented box
+	FEAT_RATIO, //short side / long side of oriented box
+	FEAT_HU3, //third Hu invariant, (n30 - 3 n12)^2 + (3 n21 - n03)^2 of the scale normalized third order moments
+	FEAT_COUNT
+};
+
+//highest order of raw moment sums feature f is worked out from
+constexpr int featureOrder(int f) {
+
+	if (f == FEAT_HU3) {
+		return 3;
+	}
+	return (f >= 0 && f < FEAT_COUNT) ? 2 : 0;
+}
+
+//column name of feature f in result and csv headers
+constexpr const char* featureName(int f) {
+
+	const char* names[FEAT_COUNT] = { "mu20", "mu02", "mu11", "alpha", "beta", "mu22", "fill", "ratio", "hu3" };
+	return (f >= 0 && f < FEAT_COUNT) ? names[f] : "";
+}
+
+//list of features fixed at compile time, in the order a kernel stores them
+template <int... F>
+struct FeatureSet {
+	static constexpr int size = sizeof...(F);
+	typedef std::make_index_sequence<sizeof...(F)> Index;
+
+	//feature at position i of the list
+	static constexpr int id(int i) {
+		const int ids[] = { F... };
+		return ids[i];
+	}
+
+	static constexpr bool has(int f) {
+		return ((F == f) || ...);
+	}
+
+	//position of feature f in the list, -1 if it isn't in it
+	static constexpr int index(int f) {
+		const int ids[] = { F... };
+		for (int i = 0; i < size; i++) {
+			if (ids[i] == f) {
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	//every feature of this list is also in Other
+	template <typename Other>
+	static constexpr bool within() {
+		return (Other::has(F) && ...);
+	}
+
+	//raw moment sums up to this order are needed for every feature in the list
+	static constexpr int order() {
+		int o = 0;
+		((o = featureOrder(F) > o ? featureOrder(F) : o), ...);
+		return o;
+	}
+};
+
+//features worked out for every region, written to results and stored in the database
+//the database columns, csv rows and binary files hold these in this order, the others stay 0 in feature vectors
+//it can be swapped at build time too, like -DSTORED_FEATURE_LIST=FEAT_MU22,FEAT_FILL,FEAT_RATIO,FEAT_HU3
+#ifndef STORED_FEATURE_LIST
+#define STORED_FEATURE_LIST FEAT_MU20, FEAT_MU02, FEAT_MU11, FEAT_ALPHA, FEAT_BETA, FEAT_MU22, FEAT_FILL, FEAT_RATIO
+#endif
+typedef FeatureSet<STORED_FEATURE_LIST> StoredFeatures;
+
+//features objects are matched on, each scaled by its deviation over the database
+//the scans, the batch kernel, the deviations and the k-d tree are all generated for this list
+//it can be swapped at build time, like -DMATCH_FEATURE_LIST=FEAT_MU22,FEAT_FILL,FEAT_RATIO
+#ifndef MATCH_FEATURE_LIST
+#define MATCH_FEATURE_LIST FEAT_FILL, FEAT_RATIO
+#endif
+typedef FeatureSet<MATCH_FEATURE_LIST> MatchFeatures;
+
+static const int MATCH_FEATURES = MatchFeatures::size;
+
+static_assert(MatchFeatures::size > 0, "objects have to be matched on at least one feature");
+static_assert(MatchFeatures::within<StoredFeatures>(), "objects can only be matched on stored features");
+
+
+//squared difference scaled by dev, worked out in double and then stored as float
+//so the scans and the k-d tree give identical distances
+inline float scaledSq(double t, float f, float dev) {
+
+	return static_cast<float>(((t - f) / dev) * ((t - f) / dev));
+}
+
+template <size_t... I>
+inline float matchDistance(const double* target, const float* const* cols, int r, const float* dev, std::index_sequence<I...>) {
+
+	return (0.0f + ... + scaledSq(target[MatchFeatures::id(I)], cols[I][r], dev[I]));
+}
+
+//scaled squared distance from target (a whole feature vector) to row r of the match columns
+//cols[i] is the column of MatchFeatures::id(i), dev[i] its deviation
+inline float matchDistance(const double* target, const float* const* cols, int r, const float* dev) {
+
+	return matchDistance(target, cols, r, dev, MatchFeatures::Index());
+}
+
+template <size_t... I>
+inline float pointDistance(const double* q, const float* p, const float* dev, std::index_sequence<I...>) {
+
+	return (0.0f + ... + scaledSq(q[I], p[I], dev[I]));
+}
+
+//same between a query and a point that only hold the match features, in MatchFeatures order
+inline float pointDistance(const double* q, const float* p, const float* dev) {
+
+	return pointDistance(q, p, dev, MatchFeatures::Index());
+}
+
+#endif
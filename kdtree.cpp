@@ -0,0 +1,591 @@
+/*
+	James Marcel
+
+	k-d tree index for nearest neighbor and k-nearest neighbors classification
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+#include <string>
+#include <map>
+#include <limits>
+#include <algorithm>
+#include "kdtree.h"
+
+
+//start of a saved index, followed by the number of features its trees are over and which ones in order
+//indexes saved without it are over fill % and h/w ratio
+static const int32_t INDEX_TAG = 0x4654444B; //"KDTF"
+
+//true if the trees were built over the same features as MatchFeatures, in the same order
+static bool sameFeatures(const int32_t* ids, int count) {
+
+	if (count != MATCH_FEATURES) {
+		return false;
+	}
+	for (int d = 0; d < count; d++) {
+		if (ids[d] != MatchFeatures::id(d)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+//the match features of target (a whole feature vector), as a k-d tree query
+static inline void matchQuery(const double* target, double* q) {
+
+	for (int d = 0; d < MATCH_FEATURES; d++) {
+		q[d] = target[MatchFeatures::id(d)];
+	}
+}
+
+
+//true if (d, id) ranks before (e, eid)
+static inline bool closer(float d, int id, float e, int eid) {
+
+	return d < e || (d == e && id < eid);
+}
+
+
+//balanced tree over points (median splits)
+void KdTree::build(const std::vector<Point>& points) {
+
+	nodes.resize(points.size());
+	for (size_t i = 0; i < points.size(); i++) {
+		nodes[i] = Node();
+		nodes[i].p = points[i];
+	}
+
+	for (int d = 0; d < DIMS && !points.empty(); d++) {
+		box[2 * d] = box[2 * d + 1] = points[0].f[d];
+	}
+	for (size_t i = 0; i < points.size(); i++) {
+		for (int d = 0; d < DIMS; d++) {
+			box[2 * d] = std::min(box[2 * d], points[i].f[d]);
+			box[2 * d + 1] = std::max(box[2 * d + 1], points[i].f[d]);
+		}
+	}
+
+	root = buildRange(0, static_cast<int>(nodes.size()));
+	builtSize = static_cast<int>(nodes.size());
+}
+
+
+//puts the median of nodes [lo, hi) on the feature with the wider spread at the middle
+//and builds each half under it, returns the middle index
+int KdTree::buildRange(int lo, int hi) {
+
+	if (lo >= hi) {
+		return -1;
+	}
+
+	float low[DIMS], high[DIMS];
+	for (int d = 0; d < DIMS; d++) {
+		low[d] = high[d] = nodes[lo].p.f[d];
+	}
+	for (int i = lo + 1; i < hi; i++) {
+		for (int d = 0; d < DIMS; d++) {
+			low[d] = std::min(low[d], nodes[i].p.f[d]);
+			high[d] = std::max(high[d], nodes[i].p.f[d]);
+		}
+	}
+	//the first of the widest, if several are as wide
+	int axis = 0;
+	for (int d = 1; d < DIMS; d++) {
+		if (high[d] - low[d] > high[axis] - low[axis]) {
+			axis = d;
+		}
+	}
+
+	int mid = lo + (hi - lo) / 2;
+	std::nth_element(nodes.begin() + lo, nodes.begin() + mid, nodes.begin() + hi,
+		[axis](const Node& a, const Node& b) { return a.p.f[axis] < b.p.f[axis]; });
+
+	nodes[mid].axis = axis;
+	nodes[mid].left = buildRange(lo, mid);
+	nodes[mid].right = buildRange(mid + 1, hi);
+
+	return mid;
+}
+
+
+//adds p as a new leaf, rebuilds once the tree has doubled since the last build
+void KdTree::insert(const Point& p) {
+
+	if (nodes.size() >= 16 && static_cast<int>(nodes.size()) >= 2 * builtSize) {
+		std::vector<Point> points(nodes.size() + 1);
+		for (size_t i = 0; i < nodes.size(); i++) {
+			points[i] = nodes[i].p;
+		}
+		points[nodes.size()] = p;
+		build(points);
+		return;
+	}
+
+	Node leaf;
+	leaf.p = p;
+	int n = static_cast<int>(nodes.size());
+
+	if (root < 0) {
+		for (int d = 0; d < DIMS; d++) {
+			box[2 * d] = box[2 * d + 1] = p.f[d];
+		}
+		nodes.push_back(leaf);
+		root = n;
+		return;
+	}
+
+	for (int d = 0; d < DIMS; d++) {
+		box[2 * d] = std::min(box[2 * d], p.f[d]);
+		box[2 * d + 1] = std::max(box[2 * d + 1], p.f[d]);
+	}
+
+	int cur = root;
+	for (;;) {
+		Node& node = nodes[cur];
+		int& child = (p.f[node.axis] < node.p.f[node.axis]) ? node.left : node.right;
+		if (child < 0) {
+			child = n;
+			leaf.axis = (node.axis + 1) % DIMS;
+			break;
+		}
+		cur = child;
+	}
+	nodes.push_back(leaf);
+}
+
+
+//k closest points to target, nearest first
+int KdTree::nearest(const double* target, const float* dev, int k, std::pair<float, int>* best) const {
+
+	int found = 0;
+	if (k > 0) {
+		search(root, target, dev, k, best, found);
+	}
+	return found;
+}
+
+
+//visits the side of each split target is on first, and the other side only if it could hold a closer point
+void KdTree::search(int n, const double* target, const float* dev, int k, std::pair<float, int>* best, int& found) const {
+
+	while (n >= 0) {
+
+		const Node& node = nodes[n];
+		float d = pointDistance(target, node.p.f, dev);
+
+		//insertion into the sorted best list
+		if (found < k || closer(d, node.p.id, best[found - 1].first, best[found - 1].second)) {
+			int pos = (found < k) ? found++ : k - 1;
+			while (pos > 0 && closer(d, node.p.id, best[pos - 1].first, best[pos - 1].second)) {
+				best[pos] = best[pos - 1];
+				pos--;
+			}
+			best[pos] = std::make_pair(d, node.p.id);
+		}
+
+		int axis = node.axis;
+		bool goLeft = target[axis] < node.p.f[axis];
+		int nearSide = goLeft ? node.left : node.right;
+		int farSide = goLeft ? node.right : node.left;
+
+		//every point past the split is at least this far away
+		float plane = scaledSq(target[axis], node.p.f[axis], dev[axis]);
+		if (farSide >= 0 && (found < k || plane <= best[found - 1].first)) {
+			search(nearSide, target, dev, k, best, found);
+			if (found < k || plane <= best[found - 1].first) {
+				search(farSide, target, dev, k, best, found);
+			}
+			return;
+		}
+		n = nearSide;
+	}
+}
+
+
+//scaled squared distance from target to the box around every point
+float KdTree::boxDist(const double* target, const float* dev) const {
+
+	if (root < 0) {
+		return std::numeric_limits<float>::infinity();
+	}
+
+	//closest point of the box, then the same distance as to a point
+	float corner[DIMS];
+	for (int d = 0; d < DIMS; d++) {
+		double c = std::min(std::max(target[d], static_cast<double>(box[2 * d])), static_cast<double>(box[2 * d + 1]));
+		corner[d] = static_cast<float>(c);
+	}
+	return pointDistance(target, corner, dev);
+}
+
+
+//counts and box first, then the nodes as they are in memory
+void KdTree::save(std::vector<char>& out) const {
+
+	static_assert(std::is_trivially_copyable<Node>::value, "nodes are saved as raw bytes");
+
+	int32_t head[3] = { static_cast<int32_t>(nodes.size()), root, builtSize };
+	const char* h = reinterpret_cast<const char*>(head);
+	out.insert(out.end(), h, h + sizeof(head));
+
+	const char* b = reinterpret_cast<const char*>(box);
+	out.insert(out.end(), b, b + sizeof(box));
+
+	const char* n = reinterpret_cast<const char*>(nodes.data());
+	out.insert(out.end(), n, n + nodes.size() * sizeof(Node));
+}
+
+
+//reads a tree written by save, checking it is a tree over points with ids below ids
+const char* KdTree::load(const char* p, const char* end, int ids) {
+
+	int32_t head[3];
+	if (end - p < static_cast<ptrdiff_t>(sizeof(head) + sizeof(box))) {
+		return NULL;
+	}
+	memcpy(head, p, sizeof(head));
+	p += sizeof(head);
+	memcpy(box, p, sizeof(box));
+	p += sizeof(box);
+
+	int n = head[0];
+	if (n < 0 || end - p < static_cast<ptrdiff_t>(n * sizeof(Node)) || head[1] < -1 || head[1] >= n) {
+		return NULL;
+	}
+
+	nodes.resize(n);
+	memcpy(nodes.data(), p, n * sizeof(Node));
+
+	//walks down from the root, a node reached twice means a cycle or shared child
+	//and a node never reached would be counted in size() but never searched
+	std::vector<char> seen(n, 0);
+	std::vector<int> stack;
+	if (head[1] >= 0) {
+		stack.push_back(head[1]);
+	}
+	int visited = 0;
+	while (!stack.empty()) {
+		int i = stack.back();
+		stack.pop_back();
+		const Node& node = nodes[i];
+		if (seen[i] || node.left < -1 || node.left >= n || node.right < -1 || node.right >= n
+			|| node.axis < 0 || node.axis >= DIMS || node.p.id < 0 || node.p.id >= ids) {
+			nodes.clear();
+			return NULL;
+		}
+		seen[i] = 1;
+		visited++;
+		if (node.left >= 0) {
+			stack.push_back(node.left);
+		}
+		if (node.right >= 0) {
+			stack.push_back(node.right);
+		}
+	}
+	if (visited != n) {
+		nodes.clear();
+		return NULL;
+	}
+	root = head[1];
+	builtSize = head[2];
+
+	return p + n * sizeof(Node);
+}
+
+
+//indexes the match feature columns of db
+//ids are the order entries were added in, so ties break like the scans
+void FeatureIndex::build(const FeatureDatabase& db) {
+
+	classNames.clear();
+	classIds.clear();
+	perClass.clear();
+	rowClass.assign(db.rows(), 0);
+
+	const float* cols[MATCH_FEATURES];
+	for (int d = 0; d < MATCH_FEATURES; d++) {
+		cols[d] = db.column(MatchFeatures::id(d));
+	}
+
+	std::vector<KdTree::Point> points(db.rows());
+	perClass.resize(db.classes());
+
+	for (int c = 0; c < db.classes(); c++) {
+
+		int id = classId(db.className(c));
+		std::vector<KdTree::Point> classPoints;
+
+		for (int r = db.classBegin(c); r < db.classEnd(c); r++) {
+			KdTree::Point p;
+			for (int d = 0; d < MATCH_FEATURES; d++) {
+				p.f[d] = cols[d][r];
+			}
+			p.id = db.rowSeq(r);
+			points[r] = p;
+			classPoints.push_back(p);
+			rowClass[p.id] = id;
+		}
+
+		perClass[id].build(classPoints);
+	}
+
+	all.build(points);
+}
+
+
+//id for an object name, adding it if it's new
+int FeatureIndex::classId(const std::string& name) {
+
+	std::map<std::string, int>::iterator it = classIds.find(name);
+	if (it != classIds.end()) {
+		return it->second;
+	}
+
+	int c = static_cast<int>(classNames.size());
+	classNames.push_back(name);
+	classIds[name] = c;
+	return c;
+}
+
+
+//adds one entry, row holds the stored features like a database row
+void FeatureIndex::insert(const float* row, const char* name) {
+
+	KdTree::Point p;
+	for (int d = 0; d < MATCH_FEATURES; d++) {
+		p.f[d] = row[StoredFeatures::index(MatchFeatures::id(d))];
+	}
+	p.id = static_cast<int>(rowClass.size());
+
+	int c = classId(name);
+	rowClass.push_back(c);
+	if (c >= static_cast<int>(perClass.size())) {
+		perClass.resize(c + 1);
+	}
+
+	all.insert(p);
+	perClass[c].insert(p);
+}
+
+
+//closest entry's name, same as nearestNeighb
+int FeatureIndex::nearest(double* target, float* dev, char* result) const {
+
+	result[0] = '\0';
+	double q[MATCH_FEATURES];
+	matchQuery(target, q);
+	std::pair<float, int> best;
+	if (all.nearest(q, dev, 1, &best) == 0) {
+		return -1;
+	}
+
+	//the scan starts from row 0 with a distance of 99999
+	int row = (best.first < 99999) ? best.second : 0;
+	strcpy(result, classNames[rowClass[row]].c_str());
+
+	return 0;
+}
+
+
+//object with the smallest sum of its k closest distances, same as kNearest
+//objects are tried nearest box first and skipped once even k times the distance to their box can't win
+int FeatureIndex::kNearest(double* target, float* dev, char* result, int k) const {
+
+	if (k > 4) { //same limit as kNearest
+		k = 4;
+	}
+	else if (k < 1) {
+		k = 1;
+	}
+
+	result[0] = '\0';
+	if (rowClass.empty()) {
+		return -1;
+	}
+
+	double q[MATCH_FEATURES];
+	matchQuery(target, q);
+
+	//reused between calls on each thread so classifying doesn't allocate
+	static thread_local std::vector<std::pair<float, int>> order;
+	order.resize(perClass.size());
+	for (size_t c = 0; c < perClass.size(); c++) {
+		order[c] = std::make_pair(perClass[c].boxDist(q, dev), static_cast<int>(c));
+	}
+	std::sort(order.begin(), order.end());
+
+	float topScore = 99999;
+	int topObj = -1;
+	std::pair<float, int> best[4];
+
+	for (size_t i = 0; i < order.size(); i++) {
+
+		//a little slack so float rounding in the sum can't skip an object that ties
+		if (order[i].first * k * 0.999999f > topScore) {
+			break;
+		}
+
+		int c = order[i].second;
+		int found = perClass[c].nearest(q, dev, k, best);
+		if (found == 0) {
+			continue;
+		}
+
+		float score = 0;
+		for (int z = 0; z < found; z++) {
+			score += best[z].first;
+		}
+		//objects with fewer than k entries are scored as if the rest were as far as their average
+		if (found < k) {
+			score = score * k / found;
+		}
+
+		//ties go to the name that sorts first, like the scan over the name map
+		if (score < topScore || (score == topScore && topObj >= 0 && classNames[c] < classNames[topObj])) {
+			topScore = score;
+			topObj = c;
+		}
+	}
+
+	if (topObj >= 0) {
+		strcpy(result, classNames[topObj].c_str());
+	}
+
+	return 0;
+}
+
+
+//which features the trees are over, number of objects, the tree over every entry,
+//then one tree per object in the database's order
+void FeatureIndex::save(std::vector<char>& out) const {
+
+	int32_t features[2 + MATCH_FEATURES] = { INDEX_TAG, MATCH_FEATURES };
+	for (int d = 0; d < MATCH_FEATURES; d++) {
+		features[2 + d] = MatchFeatures::id(d);
+	}
+	const char* f = reinterpret_cast<const char*>(features);
+	out.insert(out.end(), f, f + sizeof(features));
+
+	int32_t classes = static_cast<int32_t>(perClass.size());
+	const char* c = reinterpret_cast<const char*>(&classes);
+	out.insert(out.end(), c, c + sizeof(classes));
+
+	//each object's tree in name order, which is the database's object order load matches them to
+	//(objects inserted after the build have the last ids wherever their names sort)
+	all.save(out);
+	for (std::map<std::string, int>::const_iterator it = classIds.begin(); it != classIds.end(); ++it) {
+		perClass[it->second].save(out);
+	}
+}
+
+
+//takes back trees saved for db, the names and entry to object table come from db
+int FeatureIndex::load(const char* data, size_t size, const FeatureDatabase& db) {
+
+	const char* p = data;
+	const char* end = data + size;
+
+	//trees over other features than MatchFeatures can't be used
+	int32_t head[2];
+	if (size >= sizeof(head) && (memcpy(head, p, sizeof(head)), head[0] == INDEX_TAG)) {
+		p += sizeof(head);
+		if (head[1] != MATCH_FEATURES || end - p < static_cast<ptrdiff_t>(head[1] * sizeof(int32_t))) {
+			return -1;
+		}
+		int32_t ids[MATCH_FEATURES];
+		memcpy(ids, p, sizeof(ids));
+		if (!sameFeatures(ids, head[1])) {
+			return -1;
+		}
+		p += sizeof(ids);
+	}
+	else {
+		const int32_t legacy[2] = { FEAT_FILL, FEAT_RATIO };
+		if (!sameFeatures(legacy, 2)) {
+			return -1;
+		}
+	}
+
+	int32_t classes;
+	if (end - p < static_cast<ptrdiff_t>(sizeof(classes))) {
+		return -1;
+	}
+	memcpy(&classes, p, sizeof(classes));
+	p += sizeof(classes);
+	if (classes != db.classes()) {
+		return -1;
+	}
+
+	p = all.load(p, end, db.rows());
+	perClass.assign(classes, KdTree());
+	for (int t = 0; t < classes && p != NULL; t++) {
+		p = perClass[t].load(p, end, db.rows());
+	}
+	if (p == NULL || all.size() != db.rows()) {
+		perClass.clear();
+		return -1;
+	}
+	//each object's tree has to hold exactly its entries
+	for (int c = 0; c < classes; c++) {
+		if (perClass[c].size() != db.classEnd(c) - db.classBegin(c)) {
+			perClass.clear();
+			return -1;
+		}
+	}
+
+	//the order column of a mapped file isn't checked when it's opened, so an id can't be trusted until it is here
+	classNames.clear();
+	classIds.clear();
+	rowClass.assign(db.rows(), -1);
+	bool valid = true;
+	for (int c = 0; c < db.classes(); c++) {
+		classId(db.className(c));
+		for (int r = db.classBegin(c); r < db.classEnd(c) && valid; r++) {
+			int id = db.rowSeq(r);
+			valid = id >= 0 && id < db.rows() && rowClass[id] < 0;
+			if (valid) {
+				rowClass[id] = c;
+			}
+		}
+	}
+
+	//the whole tree has to hold every entry once, and each object's tree only its own entries
+	//(the sizes already match, so no repeats means each holds exactly them)
+	if (valid) {
+		std::vector<char> inAll(db.rows(), 0);
+		std::vector<char> inClass(db.rows(), 0);
+		all.forEachId([&](int id) {
+			valid = valid && !inAll[id];
+			inAll[id] = 1;
+		});
+		for (int c = 0; c < classes && valid; c++) {
+			perClass[c].forEachId([&](int id) {
+				valid = valid && rowClass[id] == c && !inClass[id];
+				inClass[id] = 1;
+			});
+		}
+	}
+
+	if (!valid) {
+		classNames.clear();
+		classIds.clear();
+		rowClass.clear();
+		all = KdTree();
+		perClass.clear();
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int FeatureIndex::size() const {
+
+	return static_cast<int>(rowClass.size());
+}
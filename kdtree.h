@@ -0,0 +1,115 @@
+/*
+	James Marcel
+
+	header for the k-d tree index used to classify objects
+	points are the match features (MatchFeatures in featureset.h, fill % and h/w ratio) of each database entry
+*/
+
+#ifndef KDTREE_H
+#define KDTREE_H
+
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <map>
+#include <utility>
+#include "database.h"
+#include "featureset.h"
+
+
+//k-d tree over points of the match features, (fill %, h/w ratio) by default
+//every split is on one feature, so distances can be scaled per feature (by the deviations)
+//at query time and the tree never has to be rebuilt when the deviations change
+class KdTree {
+public:
+	static const int DIMS = MATCH_FEATURES;
+
+	struct Point {
+		float f[DIMS]; //in MatchFeatures order
+		int id;
+	};
+
+	//balanced tree over points (median splits)
+	void build(const std::vector<Point>& points);
+
+	//adds p as a new leaf, rebuilds once the tree has doubled since the last build
+	void insert(const Point& p);
+
+	int size() const { return static_cast<int>(nodes.size()); }
+
+	//calls visit with the id of every point, in no particular order
+	template <class Visit>
+	void forEachId(Visit visit) const {
+		for (const Node& node : nodes) {
+			visit(node.p.id);
+		}
+	}
+
+	//k closest points to target (DIMS values), each feature difference divided by dev before squaring
+	//best gets (distance, id) nearest first, ties go to the lower id
+	//returns the number found (less than k if the tree is smaller)
+	int nearest(const double* target, const float* dev, int k, std::pair<float, int>* best) const;
+
+	//scaled squared distance from target to the box around every point, no point can be closer
+	float boxDist(const double* target, const float* dev) const;
+
+	//appends the tree to out as raw bytes, load reads it back from p (up to end)
+	//every point's id has to be below ids and every node has to hang off the root once
+	//returns the byte after the tree, or NULL if it doesn't fit or doesn't make sense
+	void save(std::vector<char>& out) const;
+	const char* load(const char* p, const char* end, int ids);
+
+private:
+	struct Node {
+		Point p;
+		int left = -1;
+		int right = -1;
+		int axis = 0;
+	};
+
+	int buildRange(int lo, int hi);
+	void search(int n, const double* target, const float* dev, int k, std::pair<float, int>* best, int& found) const;
+
+	std::vector<Node> nodes;
+	int root = -1;
+	int builtSize = 0; //size at the last build
+	float box[2 * DIMS] = { 0 }; //min and max of each feature
+};
+
+//index over the feature database for nearest neighbor and k-nearest neighbors
+//one tree over every entry and one per object name
+//queries only read it, so any number of threads can query at once as long as nothing builds, inserts or loads
+//meanwhile (the catalog only changes copies that haven't been published yet)
+class FeatureIndex {
+public:
+	//indexes the match feature columns of db
+	void build(const FeatureDatabase& db);
+
+	//adds one entry, row holds the stored features like a database row
+	//ids carry on from the database's entries, in the order they're added
+	void insert(const float* row, const char* name);
+
+	//same results as the nearestNeighb and kNearest scans (k from 1 to 4)
+	//result is left empty and -1 returned if there's nothing in the index
+	int nearest(double* target, float* dev, char* result) const;
+	int kNearest(double* target, float* dev, char* result, int k) const;
+
+	int size() const;
+
+	//saves every tree so a database file can carry a prebuilt index
+	//load takes them back for the same db, returns -1 if they don't match it
+	//(every entry has to be once in the whole tree and once in its object's tree, and nowhere else)
+	void save(std::vector<char>& out) const;
+	int load(const char* data, size_t size, const FeatureDatabase& db);
+
+private:
+	int classId(const std::string& name);
+
+	std::vector<std::string> classNames;
+	std::map<std::string, int> classIds;
+	std::vector<int> rowClass; //object of each entry, by id
+	KdTree all;
+	std::vector<KdTree> perClass;
+};
+
+#endif
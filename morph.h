@@ -0,0 +1,301 @@
+/*
+	James Marcel
+
+	header for the morphology templates: erosion, dilation, opening and closing of CV_8UC1 images
+	with the connectivity, structuring element and border policy fixed at compile time
+	foreground is 0 like everywhere else, so dilation is a running min and erosion a running max
+	(gray images work too, they get the usual min/max filters)
+*/
+
+#ifndef MORPH_H
+#define MORPH_H
+
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define MORPH_SSE2 1 //part of every x86-64 cpu, so unlike recog.cpp's AVX2 kernels no dispatch is needed
+#include <emmintrin.h>
+#endif
+
+
+//what pixels outside the image are taken to be
+enum MorphBorder {
+	MORPH_BORDER_BACKGROUND, //background (255), objects touching the edge are eroded from it like grassfire does
+	MORPH_BORDER_NEAREST //the closest pixel inside, so the edge neither erodes nor dilates anything
+};
+
+//every pixel within Radius steps of the center, a diamond for 4-connectivity and a square for 8
+template <int Connectivity, int Radius>
+struct BallElement {
+	static_assert(Connectivity == 4 || Connectivity == 8, "connectivity is 4 or 8");
+	static_assert(Radius >= 0, "radius can't be negative");
+	static const int connectivity = Connectivity;
+	static const int radius = Radius;
+	static const bool cross = false;
+};
+
+//only the center's row and column, Radius pixels each way
+template <int Radius>
+struct CrossElement {
+	static_assert(Radius >= 0, "radius can't be negative");
+	static const int connectivity = 4;
+	static const int radius = Radius;
+	static const bool cross = true;
+};
+
+//grows foreground (min)
+struct MorphMin {
+	static uchar apply(uchar a, uchar b) { return std::min(a, b); }
+#ifdef MORPH_SSE2
+	static __m128i apply(__m128i a, __m128i b) { return _mm_min_epu8(a, b); }
+#endif
+};
+
+//grows background (max)
+struct MorphMax {
+	static uchar apply(uchar a, uchar b) { return std::max(a, b); }
+#ifdef MORPH_SSE2
+	static __m128i apply(__m128i a, __m128i b) { return _mm_max_epu8(a, b); }
+#endif
+};
+
+
+//the passes every element is built from
+//each one handles the border outside its inner loop (padding for rows, a row pointer for columns),
+//so all of them end in combine, whose window is a compile time constant
+//bodies are ParallelLoopBody classes rather than lambdas so starting a pass doesn't allocate
+template <class Op, MorphBorder Border>
+struct MorphPass {
+
+	//dst[j] = Op over the W rows of src at j, for j < n
+	//16 pixels at a time with the window held in a register, dst can be one of the src rows
+	//(gcc's -O2 vectorizer leaves loops like this scalar since n isn't known)
+	template <int W>
+	static void combine(uchar* dst, const uchar* const* src, int n) {
+
+		int j = 0;
+#ifdef MORPH_SSE2
+		for (; j + 16 <= n; j += 16) {
+			__m128i acc = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[0] + j));
+			for (int k = 1; k < W; k++) {
+				acc = Op::apply(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[k] + j)));
+			}
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + j), acc);
+		}
+#endif
+		for (; j < n; j++) {
+			uchar v = src[0][j];
+			for (int k = 1; k < W; k++) {
+				v = Op::apply(v, src[k][j]);
+			}
+			dst[j] = v;
+		}
+	}
+
+	//window of 2R + 1 pixels along each row of src into dst, src and dst can be the same Mat
+	template <int R>
+	class Rows : public cv::ParallelLoopBody {
+	public:
+		Rows(cv::Mat& src, cv::Mat& dst) : src(src), dst(dst) {}
+
+		void operator()(const cv::Range& range) const {
+
+			const int W = 2 * R + 1;
+			int cols = src.cols;
+
+			//the row with R border pixels each side, kept per thread
+			static thread_local std::vector<uchar> scratch;
+			size_t len = static_cast<size_t>(cols) + 2 * R;
+			if (scratch.size() < len) {
+				scratch.resize(len);
+			}
+			uchar* x = scratch.data();
+
+			//window k starts k pixels into the padded row
+			const uchar* win[W];
+			for (int k = 0; k < W; k++) {
+				win[k] = x + k;
+			}
+
+			for (int i = range.start; i < range.end; i++) {
+
+				const uchar* sptr = src.ptr<uchar>(i);
+				memcpy(x + R, sptr, cols);
+
+				//border columns
+				uchar left = (Border == MORPH_BORDER_BACKGROUND) ? 255 : sptr[0];
+				uchar right = (Border == MORPH_BORDER_BACKGROUND) ? 255 : sptr[cols - 1];
+				memset(x, left, R);
+				memset(x + R + cols, right, R);
+
+				combine<W>(dst.ptr<uchar>(i), win, cols);
+			}
+		}
+
+	private:
+		cv::Mat& src;
+		cv::Mat& dst;
+	};
+
+	//window of 2R + 1 pixels down each column of src into dst, src and dst can be the same Mat
+	//a strip of columns at a time, keeping copies of the last 2R + 1 source rows so dst can be written in place
+	template <int R>
+	class Cols : public cv::ParallelLoopBody {
+	public:
+		static constexpr int stripW = 256; //constexpr, std::min takes it by reference
+
+		Cols(cv::Mat& src, cv::Mat& dst) : src(src), dst(dst) {}
+
+		void operator()(const cv::Range& range) const {
+
+			const int W = 2 * R + 1;
+			int rows = src.rows;
+			int cols = src.cols;
+
+			//ring of source rows and a background row, kept per thread
+			static thread_local std::vector<uchar> scratch;
+			size_t need = static_cast<size_t>(W + 1) * stripW;
+			if (scratch.size() < need) {
+				scratch.resize(need);
+			}
+			uchar* ring = scratch.data();
+			uchar* pad = ring + static_cast<size_t>(W) * stripW;
+			memset(pad, 255, stripW);
+
+			for (int s = range.start; s < range.end; s++) {
+
+				int cstart = s * stripW;
+				int n = std::min(stripW, cols - cstart);
+
+				//rows 0 to R - 1 go in first, each step adds the row R below
+				for (int i = 0; i < std::min(R, rows); i++) {
+					memcpy(ring + static_cast<size_t>(i % W) * stripW, src.ptr<uchar>(i) + cstart, n);
+				}
+
+				for (int i = 0; i < rows; i++) {
+
+					if (i + R < rows) {
+						memcpy(ring + static_cast<size_t>((i + R) % W) * stripW, src.ptr<uchar>(i + R) + cstart, n);
+					}
+
+					//border rows are picked here, once per row
+					const uchar* win[W];
+					for (int k = 0; k < W; k++) {
+						int y = i - R + k;
+						if (y < 0 || y >= rows) {
+							if (Border == MORPH_BORDER_BACKGROUND) {
+								win[k] = pad;
+								continue;
+							}
+							y = std::min(std::max(y, 0), rows - 1);
+						}
+						win[k] = ring + static_cast<size_t>(y % W) * stripW;
+					}
+
+					combine<W>(dst.ptr<uchar>(i) + cstart, win, n);
+				}
+			}
+		}
+
+	private:
+		cv::Mat& src;
+		cv::Mat& dst;
+	};
+
+	template <int R>
+	static void rows(cv::Mat& src, cv::Mat& dst) {
+		cv::parallel_for_(cv::Range(0, src.rows), Rows<R>(src, dst));
+	}
+
+	template <int R>
+	static void cols(cv::Mat& src, cv::Mat& dst) {
+		int strips = (src.cols + Cols<R>::stripW - 1) / Cols<R>::stripW;
+		cv::parallel_for_(cv::Range(0, strips), Cols<R>(src, dst));
+	}
+
+	//center row and column R pixels each way, src and dst can be the same Mat
+	template <int R>
+	static void cross(cv::Mat& src, cv::Mat& dst) {
+
+		//the row pass needs the source too, so it goes first into a buffer kept per thread
+		static thread_local cv::Mat across;
+		across.create(src.size(), CV_8UC1);
+		rows<R>(src, across);
+		cols<R>(src, dst);
+
+		for (int i = 0; i < dst.rows; i++) {
+			uchar* dptr = dst.ptr<uchar>(i);
+			const uchar* both[2] = { dptr, across.ptr<uchar>(i) };
+			combine<2>(dptr, both, dst.cols);
+		}
+	}
+
+//min or max over Element around each pixel
+	template <class Element>
+	static void apply(cv::Mat& src, cv::Mat& dst) {
+
+		const int R = Element::radius;
+		dst.create(src.size(), CV_8UC1);
+
+		if (R == 0 || src.empty()) {
+			if (dst.data != src.data) {
+				src.copyTo(dst);
+			}
+			return;
+		}
+
+		if constexpr (Element::cross) {
+			cross<R>(src, dst);
+		}
+		else if constexpr (Element::connectivity == 8) {
+			//a square is a row window followed by a column window
+			rows<R>(src, dst);
+			cols<R>(dst, dst);
+		}
+		else {
+			//a diamond of radius R is R steps of the 3x3 cross
+			cross<1>(src, dst);
+			for (int step = 1; step < R; step++) {
+				cross<1>(dst, dst);
+			}
+		}
+	}
+};
+
+
+//erosion, dilation, opening and closing with Element and Border, for example
+//Morphology<BallElement<4, 1>>::erode gives the same image as grassfire then distErosion with level 2,
+//and Morphology<BallElement<8, 6>>::dilate the same as dilate with radius 6
+//src is CV_8UC1, dst is only allocated when its size changes and can be the same Mat as src
+template <class Element, MorphBorder Border = MORPH_BORDER_BACKGROUND>
+struct Morphology {
+
+	//shrinks foreground, a pixel stays foreground only if all of Element around it is
+	static int erode(cv::Mat& src, cv::Mat& dst) {
+		MorphPass<MorphMax, Border>::template apply<Element>(src, dst);
+		return 0;
+	}
+
+	//grows foreground over Element around each foreground pixel
+	static int dilate(cv::Mat& src, cv::Mat& dst) {
+		MorphPass<MorphMin, Border>::template apply<Element>(src, dst);
+		return 0;
+	}
+
+	//erosion then dilation, removes specks and thin bridges smaller than Element
+	static int open(cv::Mat& src, cv::Mat& dst) {
+		erode(src, dst);
+		return dilate(dst, dst);
+	}
+
+	//dilation then erosion, fills holes and gaps smaller than Element
+	static int close(cv::Mat& src, cv::Mat& dst) {
+		dilate(src, dst);
+		return erode(dst, dst);
+	}
+};
+
+#endif
@@ -4,6 +4,7 @@
 	Runs webcam and processes each frame into cleaned up binary image
 	with regions identified, then chooses a region and compares it to other objects 
 	in the database, then overlays the nearest match in window
+	several cameras or streams can be processed at once, sharing the workers and the database
 */
 
 #include <cstdio>
@@ -11,206 +12,377 @@
 #include <cstdlib>
 #include <iostream>
 #include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cctype>
 #include "recog.h"
+#include "pipeline.h"
+#include "dbfile.h"
 #include "csv_util.h"
 
 
 
+//prints the command line options
+static void usage(const char* prog) {
+
+	printf("usage: %s [k] [--input <camera|video|dir|glob>]... [--headless] [--out <file.csv|file.jsonl>] [--workers n]\n"
+		"          [--stats <file|->] [--stats-every s] [--overlay] [--perf] [--db <file>]\n"
+		"          [--multi] [--min-area n] [--keep-border] [--track] [--pyramid n]\n", prog);
+	printf("  k           use k-nearest neighbors with k from 1 to 5 (default is nearest neighbor)\n");
+	printf("  --input     camera index, video file or stream, directory of images, or image glob like \"frames/*.png\"\n"
+		"              (default is camera 0), repeat to process several at once with a stream column in --out\n");
+	printf("  --headless  no windows, process as fast as possible and write results\n");
+	printf("  --out       per frame results, csv or json lines by extension (default results.csv when headless)\n");
+	printf("  --workers   number of processing threads\n");
+	printf("  --stats     write per stage p50/p90/p99 latencies to a file (or - for stdout) every few seconds\n");
+	printf("  --stats-every  seconds between stats reports (default 5)\n");
+	printf("  --overlay   draw stage latencies over the video window (toggle with s)\n");
+	printf("  --perf      count cycles, instructions, cache and branch misses for each stage (Linux),\n");
+	printf("              added to --out lines and summed up at exit\n");
+	printf("  --db        object database, csv or binary (see dbtool) by its contents (default object_database)\n");
+	printf("  --multi     classify every region instead of only the one in the middle of the frame\n");
+	printf("  --min-area  smallest region in pixels classified with --multi (default 1000)\n");
+	printf("  --keep-border  with --multi, also classify regions touching the frame edge\n");
+	printf("  --track     only process a window around the object found in the last frame, with a full frame\n");
+	printf("              pass when it's lost or reaches the window's edge (and every 30 frames)\n");
+	printf("  --pyramid   find the object on the frame shrunk by this factor, then clean up and measure only a window\n"
+		"              around it at full resolution\n");
+}
+
+
 //Run webcam and processes binary image for each frame,
 //cleans it, runs segmentation (region growing) and then
 //calculates scale/translation/rotation invariant feature vectors
+//capture, processing and display run as separate threads (see pipeline.h)
 //pressing 'n' key will capture the feature vector for the current frame with user input as object name
+//with --headless there are no windows and every frame's results are written to a file instead
 int main(int argc, char* argv[]) {
 
 	bool knn = false;
 	int k = 3; //default k value
+	int dilateRadius = 6; //clean-up dilation radius, changed with + and - keys
 	std::vector<char*> objNames;
 	std::vector<std::vector<float>>objData;
-	char csvFile[] = "object_database";
-
-	float devs[2] = { 0 };  //stores std dev for the two invariant features used in distance calculation
-	read_image_data_csv(csvFile, objNames, objData, 0);
-	
-	deviation(objData, devs);  //calculate std dev for database features
-
-	//getting K from arguments if provided
-	if (argc > 1) {
-		if (std::stoi(argv[1]) < 1 || std::stoi(argv[1]) > 5) {
-			printf("For K-nearest neighbors, please provide an integer value from 1 to 5.\n");
+	std::string dbFile = "object_database";
+
+	std::vector<const char*> inputs; //camera 0 if none given
+	const char* outFile = NULL;
+	bool headless = false;
+	int workers = 0; //0 picks from core count
+	const char* statsFile = NULL;
+	double statsEvery = 5;
+	bool overlay = false;
+	bool perf = false;
+	bool multi = false;
+	bool track = false;
+	int pyramid = 1;
+	RegionFilter filter;
+
+	//getting K and options from arguments if provided
+	for (int a = 1; a < argc; a++) {
+
+		std::string arg(argv[a]);
+
+		if (arg == "--input" && a + 1 < argc) {
+			inputs.push_back(argv[++a]);
+		}
+		else if (arg == "--out" && a + 1 < argc) {
+			outFile = argv[++a];
+		}
+		else if (arg == "--workers" && a + 1 < argc) {
+			workers = atoi(argv[++a]);
+		}
+		else if (arg == "--stats" && a + 1 < argc) {
+			statsFile = argv[++a];
+		}
+		else if (arg == "--stats-every" && a + 1 < argc) {
+			statsEvery = atof(argv[++a]);
+		}
+		else if (arg == "--db" && a + 1 < argc) {
+			dbFile = argv[++a];
+		}
+		else if (arg == "--overlay") {
+			overlay = true;
+		}
+		else if (arg == "--perf") {
+			perf = true;
+		}
+		else if (arg == "--multi") {
+			multi = true;
+		}
+		else if (arg == "--min-area" && a + 1 < argc) {
+			filter.minArea = atoi(argv[++a]);
+		}
+		else if (arg == "--keep-border") {
+			filter.dropBorder = false;
+		}
+		else if (arg == "--track") {
+			track = true;
+		}
+		else if (arg == "--pyramid" && a + 1 < argc) {
+			pyramid = std::max(1, atoi(argv[++a]));
+		}
+		else if (arg == "--headless") {
+			headless = true;
+		}
+		else if (arg == "--help" || arg == "-h") {
+			usage(argv[0]);
+			return 0;
+		}
+		else if (isdigit(static_cast<unsigned char>(arg[0]))) {
+			if (std::stoi(arg) < 1 || std::stoi(arg) > 5) {
+				printf("For K-nearest neighbors, please provide an integer value from 1 to 5.\n");
+			}
+			else {
+				knn = true;
+				k = std::stoi(arg);
+			}
 		}
 		else {
-			knn = true;
-			k = std::stoi(argv[1]);
-			printf("Using %d-Nearest Neighbors\n", k);
+			usage(argv[0]);
+			return -1;
 		}
 	}
+
+	if (knn) {
+		printf("Using %d-Nearest Neighbors\n", k);
+	}
 	else {
 		printf("Using nearest neighbor.\n");
 	}
 
-
-
-	//opening video device
-	cv::VideoCapture* capdev;
-	capdev = new cv::VideoCapture(0);
-	if (!capdev->isOpened()) {
-		printf("Unable to open video device\n");
-		return -1;
-
+	//features in columns grouped by object, a k-d tree over them and the std dev of the two
+	//invariant features used in distance calculation; new objects are saved back to dbFile
+	ObjectCatalog catalog;
+	if (isDatabaseFile(dbFile.c_str())) {
+		if (catalog.open(dbFile.c_str()) != 0) {
+			return -1;
+		}
+	}
+	else {
+		std::vector<char> csvFile(dbFile.begin(), dbFile.end());
+		csvFile.push_back('\0');
+		read_image_data_csv(csvFile.data(), objNames, objData, 0);
+		catalog.load(objData, objNames, csvFile.data());
 	}
 
-	//get some properties of the image
-	cv::Size refS((int)capdev->get(cv::CAP_PROP_FRAME_WIDTH),
-		(int)capdev->get(cv::CAP_PROP_FRAME_HEIGHT));
-	printf("Expected size: %d %d \n", refS.width, refS.height);
 
-	cv::namedWindow("Video", 1); //identifies a window
-	cv::Mat frame;
 
+	//opening video devices, files or image lists, one stream each
+	std::vector<FrameSource*> sources;
+	if (inputs.empty()) {
+		cv::VideoCapture* capdev;
+		capdev = new cv::VideoCapture(0);
+		if (!capdev->isOpened()) {
+			printf("Unable to open video device\n");
+			return -1;
 
+		}
 
+		//get some properties of the image
+		cv::Size refS((int)capdev->get(cv::CAP_PROP_FRAME_WIDTH),
+			(int)capdev->get(cv::CAP_PROP_FRAME_HEIGHT));
+		printf("Expected size: %d %d \n", refS.width, refS.height);
 
-	for (;;) {
-		*capdev >> frame;
-		if (frame.empty()) {
-			printf("frame is empty\n");
-			break;
+		sources.push_back(new VideoSource(capdev));
+	}
+	for (size_t i = 0; i < inputs.size(); i++) {
+		FrameSource* source = openSource(inputs[i]);
+		if (source == NULL) {
+			printf("Unable to open %s\n", inputs[i]);
+			for (size_t s = 0; s < sources.size(); s++) {
+				delete sources[s];
+			}
+			return -1;
 		}
-
-		//see if there is a keystroke
-		char key = cv::waitKey(10);
-		if (key == 'q') {
-			break;
+		sources.push_back(source);
+	}
+	int streams = static_cast<int>(sources.size());
+
+	//clean-up settings: threshold 120, erode pixels closer than 2 to background, dilate by dilateRadius
+	PipelineSettings settings;
+	settings.thresh = 120;
+	settings.level = 2;
+	settings.radius = dilateRadius;
+	settings.knn = knn;
+	settings.k = k;
+	settings.catalog = &catalog;
+	settings.views = !headless;
+
+	//stage histograms are always kept, they cost a few atomic adds per stage
+	PipelineStats stats;
+	settings.stats = &stats;
+	settings.perf = perf;
+	settings.multi = multi;
+	settings.track = track;
+	settings.pyramid = pyramid;
+	settings.filter = filter;
+
+	StatsReporter reporter;
+	reporter.interval = statsEvery;
+	if (statsFile != NULL) {
+		if (reporter.open(statsFile) != 0) {
+			return -1;
 		}
+	}
+	else if (overlay || !headless) {
+		reporter.interval = 1; //only refreshes the overlay
+	}
 
-		cv::imshow("Video",frame);
-
-		cv::Mat bImg;  //used to store binary image
-
-		binaryImg(frame, bImg, 120);
-		cv::imshow("Binary/Threshold", bImg);
-
-		cv::Mat distance; //used to store distance matrix
-		grassfire(bImg, distance); //calculating distance on binary img
-
-		cv::Mat eroded; //stores eroded/dilated image
-		distErosion(distance, eroded, 2);
-
-		cv::Mat final;
-		cv::Mat temp;
+	//capture and processing run on their own threads, this thread only displays/writes
+	//leaving a core for capture and one for display, or just capture when headless
+	if (workers < 1) {
+		int spare = headless ? 1 : 2;
+		workers = std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - spare);
+	}
 
-		int x = 6;
-		//repeats dilation x number of times
-		for (int i = 0; i < x; i++) {
-			dilate(eroded, final);
-			eroded = final.clone();
+	ResultWriter writer;
+	if (outFile != NULL || headless) {
+		if (writer.open(outFile != NULL ? outFile : "results.csv", perf, streams > 1) != 0) {
+			return -1;
 		}
+	}
 
-		cv::imshow("Clean-up", eroded);
-
-		cv::Mat regtest;
-
-		//finding regions
-		int regnum = regions(final, regtest);
-
-		//finding majority region in center of image
-		int central = centralRegion(regtest);
-
-		//calculate raw moments for this region (M10 avg x, M01 avg y, M00 total pix)
-		int moments[3] = { 0 };
-		rawMoments(regtest, central, moments);
-
-
-
-		cv::Mat tester;
-		//gives each region a different color
-		regColor(regtest, tester, regnum);
-		//adds littl red cross to center of object
-		objCenter(tester, moments);
+	//every stream shares the workers and classifies against the same database snapshot
+	FramePipeline pipeline(settings, workers);
+	pipeline.start(sources);
+
+	if (headless) {
+
+		std::vector<int64_t> count(streams, 0);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		//each stream's frames come out in capture order, streams are read in turn
+		while (!pipeline.finished()) {
+			bool any = false;
+			for (int s = 0; s < streams; s++) {
+				FrameResult res;
+				if (!pipeline.next(s, res)) {
+					continue;
+				}
+				writer.write(res);
+				count[s]++;
+				any = true;
+			}
+			if (!any) {
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+			}
+			reporter.poll(stats);
+		}
 
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		int64_t total = 0;
+		for (int s = 0; s < streams; s++) {
+			total += count[s];
+			if (streams > 1) {
+				printf("Stream %d (%s): %lld frames (%.1f frames/s)\n", s, inputs.empty() ? "camera 0" : inputs[s],
+					static_cast<long long>(count[s]), count[s] / std::max(secs, 1e-9));
+			}
+		}
+		printf("Processed %lld frames in %.2f s (%.1f frames/s) with %d workers\n",
+			static_cast<long long>(total), secs, total / std::max(secs, 1e-9), workers);
+
+		pipeline.stop();
+		writer.close();
+		reporter.writeTotals(stats);
+		reporter.close();
+		if (perf) {
+			writePerfTotals(stdout, stats);
+		}
+		for (int s = 0; s < streams; s++) {
+			delete sources[s];
+		}
+		return 0;
+	}
 
-		//mu stores the feature vector for each frame: mu 20, mu 02, mu 11, angle alpha, angle beta, mu 22, fill %, h/w ratio
-		double mu[8] = { 0 }; 
-		//calculating invariant moments
-		angleAlpha(regtest, central, moments, mu);
-		invarMoment(regtest, central, moments, mu);
+	//one set of windows per stream, named with the stream number when there's more than one
+	std::vector<std::string> suffix(streams);
+	for (int s = 0; s < streams && streams > 1; s++) {
+		suffix[s] = " " + std::to_string(s);
+	}
 
-		//used for calculating degrees from radians
-		const double deg = 180 / 3.14159265358979323846;
-		double tilt = mu[4] * deg;
+	cv::namedWindow("Video" + suffix[0], 1); //identifies a window
 
-		//rotating image - first get rotation matrix
-		cv::Mat rotation = cv::getRotationMatrix2D(cv::Point2f(static_cast<float>(moments[0]), static_cast<float>(moments[1])), tilt, 1);
+	FrameResult shown; //last frame displayed from any stream, used for enrolling
 
-		cv::Mat rotatedFinal;
-		cv::Mat rotatedRegion;
 
-		//then warp based on that matrix
-		//warp uses no flags so region values aren't affected by the algo
-		warpAffine(final, rotatedFinal, rotation, final.size(), 0, cv::BORDER_TRANSPARENT);
-		warpAffine(regtest, rotatedRegion, rotation, final.size(), 0, cv::BORDER_TRANSPARENT);
 
-		//getting bounding box for region
-		int box[4] = { 0 };
-		getBox(rotatedRegion, central, box);
-		getRatio(rotatedRegion, central, box, mu);
+	for (;;) {
 
-		//assigning points from calculated bounding box
-		cv::Point topleft(box[0], box[2]);
-		cv::Point botright(box[1], box[3]);
+		//see if there is a keystroke
+		char key = cv::waitKey(1);
+		if (key == 'q') {
+			break;
+		}
 
-		//drawing Oriented Bounding Box
-		cv::cvtColor(rotatedFinal, final, cv::COLOR_GRAY2BGR);
-		objCenter(final, moments);
-		cv::rectangle(final, topleft, botright, cv::Scalar(0, 0, 255), 1);
+		//clean-up dilation radius can be tuned while running
+		if (key == 's') {
+			overlay = !overlay;
+		}
+		else if (key == '+' || key == '=') {
+			settings.radius++;
+			printf("Dilation radius %d\n", settings.radius.load());
+		}
+		else if (key == '-' && settings.radius > 0) {
+			settings.radius--;
+			printf("Dilation radius %d\n", settings.radius.load());
+		}
 
-		//showing regions and post cleanup binary image
-		cv::imshow("Regions", tester);
+		//Feature are written to database by pressing n key
+		//name of the object must then be entered into console
+		if (key == 'n' && shown.seq >= 0) {
+			char input[256];
 
+			std::cin >> input;
 
-	
-		//processing distance to already classified objects
-		char result[256];
+			//recognized from the next frame on, written to the database file in the background
+			catalog.enroll(shown.mu, input);
 
-		if (knn == true) { //if k parameter provided, use k-nearest neighbors
-			kNearest(mu, devs, objData, objNames, result, k);
 		}
-		else {  //otherwise use nearest neighbor
-			nearestNeighb(mu, devs, objData, objNames, result);
-		}
-		
-		
 
-		//making strings for live feature display
-		std::string feature = "fill %: " +  std::to_string(mu[6]);
-		std::string feature2 = "h/w ratio: " + std::to_string(mu[7]);
+		if (pipeline.finished()) {
+			printf("frame is empty\n");
+			break;
+		}
 
-		//adding text overlays to final frame
-		cv::putText(final,result,cv::Point(40,final.rows - 40),1,5,cv::Scalar(255,0,0));
-		cv::putText(final, feature, cv::Point(final.cols - 350, 30), 2, 1, cv::Scalar(0, 0, 255));
-		cv::putText(final, feature2, cv::Point(final.cols - 350, 70), 2, 1, cv::Scalar(0, 0, 255));
+		//frames of each stream come out in capture order
+		for (int s = 0; s < streams; s++) {
 
-		cv::imshow("OBB/Center", final);	 //displaying final processed frame
+			FrameResult res;
+			if (!pipeline.next(s, res)) {
+				continue;
+			}
 
-	
-		//Feature are written to database by pressing n key
-		//name of the object must then be entered into console
-		if (key == 'n') {
-			char input[256];
+			reporter.poll(stats);
+			if (overlay) {
+				reporter.drawOverlay(res.frame);
+			}
 
-			std::cin >> input;
+			cv::imshow("Video" + suffix[s], res.frame);
+			cv::imshow("Binary/Threshold" + suffix[s], res.binary);
+			cv::imshow("Clean-up" + suffix[s], res.clean);
 
-			//writing regTest to store feature vector with object name
-			char fname[] = "object_database";
+			//showing regions and post cleanup binary image
+			cv::imshow("Regions" + suffix[s], res.regionView);
 
-			append_image_data_csv(fname, input, mu, false);
+			cv::imshow("OBB/Center" + suffix[s], res.obbView);	 //displaying final processed frame
 
+			writer.write(res);
+			shown = res;
 		}
-		
-
 	}
 
+	pipeline.stop();
+	reporter.writeTotals(stats);
+	if (perf) {
+		writePerfTotals(stdout, stats);
+	}
+	for (int s = 0; s < streams; s++) {
+		delete sources[s];
+	}
 	
 	return 0;
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,167 @@
+/*
+	James Marcel
+
+	Hardware performance counters through Linux perf_event_open
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include "perf.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+
+const char* perfEventName(int e) {
+
+	static const char* names[PERF_EVENT_COUNT] = { "cycles", "instructions", "cache_misses", "branch_misses" };
+	return (e >= 0 && e < PERF_EVENT_COUNT) ? names[e] : "?";
+}
+
+
+#ifdef __linux__
+
+//starts counting user space events of the calling thread
+//cycles leads the group so all four are read together with one read call
+int PerfCounters::open() {
+
+	close();
+
+	const uint64_t configs[PERF_EVENT_COUNT] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+
+	for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = configs[e];
+		attr.disabled = (e == 0) ? 1 : 0; //the whole group starts when the leader is enabled
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		//pid 0 and cpu -1 is this thread on whichever cpu it runs
+		long fd = syscall(SYS_perf_event_open, &attr, 0, -1, (e == 0) ? -1 : fds[0], 0);
+		if (fd < 0) {
+			close();
+			return -1;
+		}
+		fds[e] = static_cast<int>(fd);
+	}
+
+	ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+	return 0;
+}
+
+
+void PerfCounters::close() {
+
+	for (int e = PERF_EVENT_COUNT - 1; e >= 0; e--) {
+		if (fds[e] >= 0) {
+			::close(fds[e]);
+			fds[e] = -1;
+		}
+	}
+}
+
+
+//reads the running totals of the group
+int PerfCounters::read(PerfSample& now) {
+
+	if (!available()) {
+		return -1;
+	}
+
+	//layout for PERF_FORMAT_GROUP with both times: nr, time enabled, time running, then one value per event
+	uint64_t buf[3 + PERF_EVENT_COUNT];
+	if (::read(fds[0], buf, sizeof(buf)) != static_cast<ssize_t>(sizeof(buf))) {
+		return -1;
+	}
+
+	now.enabled = buf[1];
+	now.running = buf[2];
+	for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+		now.count[e] = buf[3 + e];
+	}
+
+	return 0;
+}
+
+#else
+
+int PerfCounters::open() {
+	return -1;
+}
+
+void PerfCounters::close() {
+}
+
+int PerfCounters::read(PerfSample& now) {
+	(void)now;
+	return -1;
+}
+
+#endif
+
+
+//counts between two reads, scaled up if the group was only counting part of the time
+void PerfCounters::difference(const PerfSample& start, const PerfSample& end, PerfSample& out) {
+
+	out.enabled = end.enabled - start.enabled;
+	out.running = end.running - start.running;
+
+	double scale = 1.0;
+	if (out.running > 0 && out.running < out.enabled) {
+		scale = static_cast<double>(out.enabled) / out.running;
+	}
+
+	for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+		out.count[e] = static_cast<uint64_t>((end.count[e] - start.count[e]) * scale + 0.5);
+	}
+}
+
+
+//the calling thread's counters, opened the first time each thread asks
+PerfCounters* threadPerfCounters() {
+
+	static thread_local PerfCounters counters;
+	static thread_local bool tried = false;
+	static std::atomic<bool> warned{ false };
+
+	if (!tried) {
+		tried = true;
+		if (counters.open() != 0 && !warned.exchange(true)) {
+			printf("Hardware performance counters are not available on this system\n");
+		}
+	}
+
+	return counters.available() ? &counters : NULL;
+}
+
+
+PerfScope::PerfScope(PerfCounters* counters, PerfSample* out) : counters(counters), out(out) {
+
+	if (counters != NULL && counters->read(start) != 0) {
+		this->counters = NULL;
+	}
+}
+
+
+PerfScope::~PerfScope() {
+
+	PerfSample end;
+	if (counters == NULL || out == NULL || counters->read(end) != 0) {
+		return;
+	}
+	PerfCounters::difference(start, end, *out);
+}
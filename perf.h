@@ -0,0 +1,71 @@
+/*
+	James Marcel
+
+	header for hardware performance counters (Linux perf_event_open)
+	counts cycles, instructions, cache misses and branch misses for the calling thread only,
+	so each worker opens its own group; on other systems nothing is counted
+*/
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <cstdio>
+#include <cstdint>
+
+
+enum PerfEvent {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES, //last level cache
+	PERF_BRANCH_MISSES,
+	PERF_EVENT_COUNT
+};
+
+//counter values, either running totals read from a group or the difference between two reads
+struct PerfSample {
+	uint64_t count[PERF_EVENT_COUNT] = { 0 };
+	uint64_t enabled = 0; //ns the group was enabled, for scaling when the kernel multiplexes counters
+	uint64_t running = 0; //ns the group was actually counting
+};
+
+//one group of counters for the thread that opened it
+class PerfCounters {
+public:
+	~PerfCounters() { close(); }
+
+	//starts counting user space events of the calling thread
+	//returns -1 if the kernel won't give us the counters (no PMU, perf_event_paranoid, not Linux)
+	int open();
+	void close();
+	bool available() const { return fds[0] >= 0; }
+
+	//reads the running totals, returns -1 if not available
+	int read(PerfSample& now);
+
+	//counts between two reads, scaled up if the group was only counting part of the time
+	static void difference(const PerfSample& start, const PerfSample& end, PerfSample& out);
+
+private:
+	int fds[PERF_EVENT_COUNT] = { -1, -1, -1, -1 };
+};
+
+//the calling thread's counters, opened the first time each thread asks
+//returns NULL if they can't be opened
+PerfCounters* threadPerfCounters();
+
+//counts what happens during its lifetime into out (if counters isn't NULL)
+class PerfScope {
+public:
+	PerfScope(PerfCounters* counters, PerfSample* out);
+	~PerfScope();
+
+private:
+	PerfCounters* counters;
+	PerfSample* out;
+	PerfSample start;
+};
+
+//short name of an event for reports
+const char* perfEventName(int e);
+
+#endif
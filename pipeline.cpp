@@ -0,0 +1,1264 @@
+/*
+	James Marcel
+
+	Threaded frame pipeline: capture thread, processing workers and in order
+	hand off to the display thread
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <dirent.h>
+#include <atomic>
+#include <thread>
+#include <opencv2/opencv.hpp>
+#include "recog.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "perf.h"
+#include "catalog.h"
+
+
+//waits a little longer each time a ring is full or empty
+//spins first, then yields, then sleeps so idle stages don't hold a core
+static void backoff(int& spins) {
+
+	spins++;
+	if (spins < 64) {
+		return;
+	}
+	else if (spins < 128) {
+		std::this_thread::yield();
+	}
+	else {
+		std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+}
+
+
+bool VideoSource::read(cv::Mat& frame, std::string& name) {
+
+	*capdev >> frame;
+	name.clear();
+	return !frame.empty();
+}
+
+
+bool ImageListSource::read(cv::Mat& frame, std::string& name) {
+
+	while (nextFile < files.size()) {
+
+		name = files[nextFile++];
+		frame = cv::imread(name, cv::IMREAD_COLOR);
+		if (!frame.empty()) {
+			return true;
+		}
+		printf("Unable to read %s\n", name.c_str());
+	}
+
+	return false;
+}
+
+
+//lists image files (jpg, png, bmp, tif) in a directory, sorted by name
+int listImages(const char* dir, std::vector<std::string>& files) {
+
+	DIR* dirp = opendir(dir);
+	if (dirp == NULL) {
+		return -1;
+	}
+
+	const char* exts[] = { ".jpg", ".jpeg", ".png", ".bmp", ".tif", ".tiff" };
+
+	struct dirent* dp;
+	while ((dp = readdir(dirp)) != NULL) {
+
+		std::string fname(dp->d_name);
+		size_t dot = fname.rfind('.');
+		if (dot == std::string::npos) {
+			continue;
+		}
+
+		std::string ext = fname.substr(dot);
+		std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+		for (const char* e : exts) {
+			if (ext == e) {
+				files.push_back(std::string(dir) + "/" + fname);
+				break;
+			}
+		}
+	}
+
+	closedir(dirp);
+	std::sort(files.begin(), files.end());
+
+	return 0;
+}
+
+
+//opens input as a camera index, a directory of images, an image glob or a video file/stream
+FrameSource* openSource(const char* input) {
+
+	std::vector<std::string> files;
+
+	if (input[0] != '\0' && strspn(input, "0123456789") == strlen(input)) {
+		cv::VideoCapture* capdev = new cv::VideoCapture(atoi(input));
+		if (!capdev->isOpened()) {
+			delete capdev;
+			return NULL;
+		}
+		return new VideoSource(capdev);
+	}
+
+	if (strchr(input, '*') != NULL || strchr(input, '?') != NULL) {
+		std::vector<cv::String> found;
+		cv::glob(input, found, false);
+		files.assign(found.begin(), found.end());
+		std::sort(files.begin(), files.end());
+		return new ImageListSource(files);
+	}
+
+	if (listImages(input, files) == 0) {
+		return new ImageListSource(files);
+	}
+
+	cv::VideoCapture* capdev = new cv::VideoCapture(input);
+	if (!capdev->isOpened()) {
+		delete capdev;
+		return NULL;
+	}
+	return new VideoSource(capdev);
+}
+
+
+//histogram for stage s, or NULL when stats aren't being kept
+static LatencyHistogram* statHist(PipelineSettings& settings, int s) {
+
+	return settings.stats != NULL ? &settings.stats->hist[s] : NULL;
+}
+
+
+//short name of a Stage or StatExtra for reports
+const char* statName(int s) {
+
+	static const char* names[STAT_COUNT] = { "cleanup", "labeling", "features", "classify", "render",
+		"capture", "process", "latency" };
+	return (s >= 0 && s < STAT_COUNT) ? names[s] : "?";
+}
+
+
+static void renderViews(FrameResult& res, FrameWorkspace& ws, cv::Mat& regtest);
+static void renderObjects(FrameResult& res, FrameWorkspace& ws);
+
+
+//rows and columns of the frame outside a window that can change the clean up inside it:
+//erosion looks level - 1 pixels away and dilation radius pixels after that
+static int trackReach(PipelineSettings& settings) {
+
+	return std::max(1, std::min(settings.level, 255)) - 1 + std::max(settings.radius.load(std::memory_order_relaxed), 0) + 1;
+}
+
+
+//adds res's counters for the stages before end to the pipeline totals
+static void addPerfTotals(FrameResult& res, PipelineSettings& settings, int end) {
+
+	if (!res.hasPerf || settings.stats == NULL) {
+		return;
+	}
+	for (int s = 0; s < end; s++) {
+		settings.stats->addPerf(s, res.perf[s]);
+	}
+}
+
+
+//adds one frame's counters for stage s
+void PipelineStats::addPerf(int s, const PerfSample& sample) {
+
+	for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+		perfTotals[s][e].fetch_add(sample.count[e], std::memory_order_relaxed);
+	}
+	perfFrames[s].fetch_add(1, std::memory_order_relaxed);
+}
+
+
+//writes hardware counters per frame (and IPC, misses per 1000 instructions) for each stage
+void writePerfTotals(FILE* fp, PipelineStats& stats) {
+
+	fprintf(fp, "stage,frames,cycles,instructions,cache_misses,branch_misses,ipc,cache_mpki,branch_mpki\n");
+
+	for (int s = 0; s < STAGE_COUNT; s++) {
+
+		uint64_t frames = stats.perfFrames[s].load();
+		if (frames == 0) {
+			continue;
+		}
+
+		double per[PERF_EVENT_COUNT];
+		for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+			per[e] = static_cast<double>(stats.perfTotals[s][e].load()) / frames;
+		}
+		double kinstr = std::max(per[PERF_INSTRUCTIONS] / 1000, 1e-9);
+
+		fprintf(fp, "%s,%llu,%.0f,%.0f,%.0f,%.0f,%.3f,%.3f,%.3f\n", statName(s), static_cast<unsigned long long>(frames),
+			per[PERF_CYCLES], per[PERF_INSTRUCTIONS], per[PERF_CACHE_MISSES], per[PERF_BRANCH_MISSES],
+			per[PERF_INSTRUCTIONS] / std::max(per[PERF_CYCLES], 1.0), per[PERF_CACHE_MISSES] / kinstr,
+			per[PERF_BRANCH_MISSES] / kinstr);
+	}
+	fflush(fp);
+}
+
+
+//features of every region that passes the filter from one pass over the runs,
+//then all of them classified in one call
+static void multiObjects(FrameResult& res, FrameWorkspace& ws, RunImage& regtest, PipelineSettings& settings,
+	PerfCounters* counters) {
+
+	std::vector<RegionInfo>& table = ws.table;
+	std::vector<int>& selected = ws.selected;
+	std::vector<RegionStats>& stats = ws.stats;
+	std::vector<double>& features = ws.features;
+	std::vector<char*>& results = ws.results;
+
+	{
+		ScopedTimer timer(statHist(settings, STAGE_FEATURES), &res.stageMs[STAGE_FEATURES]);
+		PerfScope perf(counters, &res.perf[STAGE_FEATURES]);
+
+		selectRegions(regtest.size(), table, settings.filter, selected);
+		regionStatsAll(regtest, table, selected, stats);
+
+		res.objects.resize(selected.size());
+		features.resize(selected.size() * FEAT_COUNT);
+		for (size_t o = 0; o < selected.size(); o++) {
+			FrameObject& obj = res.objects[o];
+			obj.region = selected[o];
+			obj.stats = stats[o];
+			statFeatures(obj.stats, obj.moments, obj.mu);
+			memcpy(&features[o * FEAT_COUNT], obj.mu, sizeof(obj.mu));
+		}
+	}
+
+	{
+		ScopedTimer timer(statHist(settings, STAGE_CLASSIFY), &res.stageMs[STAGE_CLASSIFY]);
+		PerfScope perf(counters, &res.perf[STAGE_CLASSIFY]);
+
+		results.resize(res.objects.size());
+		for (size_t o = 0; o < res.objects.size(); o++) {
+			results[o] = res.objects[o].result;
+		}
+		settings.catalog->classify(features.data(), static_cast<int>(res.objects.size()), settings.knn, settings.k, results.data());
+	}
+
+	//largest object also goes in the single object fields, for enrollment and anything reading those
+	if (res.objects.empty()) {
+		res.central = 0;
+		res.stats = RegionStats();
+		statFeatures(res.stats, res.moments, res.mu);
+		res.result[0] = '\0';
+	}
+	else {
+		FrameObject& largest = res.objects[0];
+		res.central = largest.region;
+		res.stats = largest.stats;
+		memcpy(res.moments, largest.moments, sizeof(res.moments));
+		memcpy(res.mu, largest.mu, sizeof(res.mu));
+		strcpy(res.result, largest.result);
+	}
+}
+
+
+//threshold, erosion, dilation and labelling of res.area of the frame into runs and ws.table
+//regtest is pointed at the runs, which like the table are in the area's coordinates
+static int cleanArea(FrameResult& res, FrameWorkspace& ws, PipelineSettings& settings, PerfCounters* counters,
+	RunImage*& regtest) {
+
+	bool window = res.area.width != res.frame.cols || res.area.height != res.frame.rows;
+	cv::Mat frame = window ? res.frame(res.area) : res.frame;
+	CleanupStream& cleanup = ws.cleanup;
+
+	//threshold, erosion, dilation and the first labelling pass in one pass down the frame
+	int status;
+	{
+		ScopedTimer timer(statHist(settings, STAGE_CLEANUP), &res.stageMs[STAGE_CLEANUP]);
+		PerfScope perf(counters, &res.perf[STAGE_CLEANUP]);
+
+		//pyramid mode cleans the frame shrunk by res.scale (cropped to a multiple of it first)
+		//with the erosion level and dilation radius scaled down to match
+		if (res.scale > 1) {
+			int f = res.scale;
+			cv::Mat whole = res.frame(cv::Rect(0, 0, res.frame.cols / f * f, res.frame.rows / f * f));
+			cv::resize(whole, ws.small, cv::Size(res.frame.cols / f, res.frame.rows / f), 0, 0, cv::INTER_AREA);
+			frame = ws.small;
+			cleanup.level = 1 + (std::max(settings.level, 1) - 1 + f / 2) / f;
+			cleanup.radius = (std::max(settings.radius.load(std::memory_order_relaxed), 0) + f / 2) / f;
+		}
+
+		//the shrunk pass keeps its own runs, the window it's refined in is labelled after it
+		regtest = res.scale > 1 ? &ws.smallRuns : &ws.runs;
+
+		//the shrunk pass only finds the region, the views come from the full resolution pass after it
+		if (!settings.views || res.scale > 1) {
+			status = cleanup.stream(frame, *regtest);
+		}
+		else {
+			//display images are taken from the ones earlier frames have finished with
+			res.binary.release();
+			res.clean.release();
+			res.binary = reuseMat(ws.views, res.frame.size(), CV_8UC1);
+			res.clean = reuseMat(ws.views, res.frame.size(), CV_8UC1);
+			if (!window) {
+				status = cleanup.stream(frame, *regtest, &res.binary, &res.clean);
+			}
+			else {
+				//frame sized, white outside the window
+				res.binary.setTo(cv::Scalar(255));
+				res.clean.setTo(cv::Scalar(255));
+				cv::Mat binWindow = res.binary(res.area);
+				cv::Mat cleanWindow = res.clean(res.area);
+				status = cleanup.stream(frame, *regtest, &binWindow, &cleanWindow);
+			}
+		}
+	}
+	if (status != 0) {
+		return -1;
+	}
+
+	{
+		ScopedTimer timer(statHist(settings, STAGE_LABELING), &res.stageMs[STAGE_LABELING]);
+		PerfScope perf(counters, &res.perf[STAGE_LABELING]);
+		res.regnum = cleanup.finish(ws.table);
+	}
+
+	return 0;
+}
+
+
+//true if box (in res.area's coordinates) is within reach of an edge of res.area that's inside the frame
+static bool nearWindowEdge(FrameResult& res, int* box, int reach) {
+
+	cv::Rect& a = res.area;
+	return (a.x > 0 && box[0] < reach) || (a.y > 0 && box[2] < reach)
+		|| (a.x + a.width < res.frame.cols && box[1] >= a.width - reach)
+		|| (a.y + a.height < res.frame.rows && box[3] >= a.height - reach);
+}
+
+
+//measures region of a window pass and moves its stats into frame coordinates
+static void measureWindow(FrameResult& res, RunImage& regtest, std::vector<RegionInfo>& table, int region) {
+
+	res.central = region;
+	regionStats(regtest, region, table[region], res.stats);
+	shiftStats(res.stats, res.area.x, res.area.y);
+	statFeatures(res.stats, res.moments, res.mu);
+}
+
+
+//cleans res.area again at res.scale after a pass that couldn't be used, which still counts towards the frame's time
+static int redoPass(FrameResult& res, FrameWorkspace& ws, PipelineSettings& settings, PerfCounters* counters,
+	RunImage*& regtest) {
+
+	double firstMs[STAGE_COUNT];
+	PerfSample firstPerf[STAGE_COUNT];
+	for (int st = 0; st < STAGE_COUNT; st++) {
+		firstMs[st] = res.stageMs[st];
+		firstPerf[st] = res.perf[st];
+	}
+
+	ws.cleanup.level = settings.level;
+	ws.cleanup.radius = settings.radius.load(std::memory_order_relaxed);
+	if (cleanArea(res, ws, settings, counters, regtest) != 0) {
+		return -1;
+	}
+
+	for (int st = 0; st < STAGE_COUNT; st++) {
+		res.stageMs[st] += firstMs[st];
+		for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+			res.perf[st].count[e] += firstPerf[st].count[e];
+		}
+		res.perf[st].enabled += firstPerf[st].enabled;
+		res.perf[st].running += firstPerf[st].running;
+	}
+
+	return 0;
+}
+
+
+//pyramid mode: the central region of the shrunk pass, scaled back up and widened by the clean up's reach,
+//is cleaned and labelled again at full resolution and the label lying most under it is measured
+//returns false if a full frame pass is needed (nothing in the middle, or the object runs into the window's edge)
+static bool refinePyramid(FrameResult& res, FrameWorkspace& ws, PipelineSettings& settings, PerfCounters* counters,
+	RunImage*& regtest) {
+
+	std::vector<RegionInfo>& table = ws.table;
+	int f = res.scale;
+	int region;
+	{
+		ScopedTimer timer(statHist(settings, STAGE_FEATURES), &res.stageMs[STAGE_FEATURES]);
+		PerfScope perf(counters, &res.perf[STAGE_FEATURES]);
+		region = centralRegion(*regtest, table);
+	}
+	if (region == 0) {
+		return false;
+	}
+
+	//the region's box in full resolution pixels, widened so the clean up inside it matches a full frame pass
+	RunImage& small = *regtest; //shrunk runs, the window is labelled into another buffer
+	int reach = trackReach(settings) + f;
+	int* box = table[region].box;
+	int x0 = std::max(box[0] * f - reach, 0);
+	int y0 = std::max(box[2] * f - reach, 0);
+	int x1 = std::min((box[1] + 1) * f + reach, res.frame.cols);
+	int y1 = std::min((box[3] + 1) * f + reach, res.frame.rows);
+	res.area = cv::Rect(x0, y0, x1 - x0, y1 - y0);
+	res.scale = 1;
+
+	double firstMs = res.stageMs[STAGE_FEATURES];
+	PerfSample firstPerf = res.perf[STAGE_FEATURES];
+	if (redoPass(res, ws, settings, counters, regtest) != 0) {
+		return false;
+	}
+
+	bool measured = false;
+	{
+		ScopedTimer timer(statHist(settings, STAGE_FEATURES), &res.stageMs[STAGE_FEATURES]);
+		PerfScope perf(counters, &res.perf[STAGE_FEATURES]);
+
+		int pick = overlapRegion(*regtest, static_cast<int>(table.size()), small, region, f, res.area.tl());
+		if (pick != 0 && !nearWindowEdge(res, table[pick].box, trackReach(settings))) {
+			measureWindow(res, *regtest, table, pick);
+			measured = true;
+		}
+	}
+
+	//the central region search counts with the measuring
+	res.stageMs[STAGE_FEATURES] += firstMs;
+	for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+		res.perf[STAGE_FEATURES].count[e] += firstPerf.count[e];
+	}
+	res.perf[STAGE_FEATURES].enabled += firstPerf.enabled;
+	res.perf[STAGE_FEATURES].running += firstPerf.running;
+
+	res.scale = measured ? f : 1;
+	return measured;
+}
+
+
+//picks the tracked object in a window: the biggest region, as long as it isn't within the clean up's
+//reach of a window edge that's inside the frame (there it could be cut off or cleaned differently)
+//fills in res and moves everything into frame coordinates, returns false if a full frame pass is needed
+static bool trackWindow(FrameResult& res, RunImage& regtest, std::vector<RegionInfo>& table, PipelineSettings& settings,
+	PerfCounters* counters) {
+
+	ScopedTimer timer(statHist(settings, STAGE_FEATURES), &res.stageMs[STAGE_FEATURES]);
+	PerfScope perf(counters, &res.perf[STAGE_FEATURES]);
+
+	int region = 0;
+	for (int x = 1; x < static_cast<int>(table.size()); x++) {
+		if (table[x].area > table[region].area || (region == 0 && table[x].area > 0)) {
+			region = x;
+		}
+	}
+	if (region == 0) {
+		return false; //lost
+	}
+
+	if (nearWindowEdge(res, table[region].box, trackReach(settings))) {
+		return false;
+	}
+
+	measureWindow(res, regtest, table, region);
+	return true;
+}
+
+
+//distance from res.mu to already classified objects
+static void classifyCentral(FrameResult& res, PipelineSettings& settings, PerfCounters* counters) {
+
+	ScopedTimer timer(statHist(settings, STAGE_CLASSIFY), &res.stageMs[STAGE_CLASSIFY]);
+	PerfScope perf(counters, &res.perf[STAGE_CLASSIFY]);
+	settings.catalog->classify(res.mu, settings.knn, settings.k, res.result);
+}
+
+
+//window for the next frame: the object's box widened by the margin and the clean up's reach
+static void updateTracker(RoiTracker& tracker, FrameResult& res, PipelineSettings& settings) {
+
+	bool fullPass = res.area.width == res.frame.cols && res.area.height == res.frame.rows;
+	tracker.sinceFull = fullPass ? 0 : tracker.sinceFull + 1;
+
+	if (res.central == 0 || res.stats.m00 == 0) {
+		tracker.window = cv::Rect();
+		return;
+	}
+
+	int* box = res.stats.box;
+	int pad = static_cast<int>(std::max(box[1] - box[0] + 1, box[3] - box[2] + 1) * settings.trackMargin)
+		+ 2 * trackReach(settings);
+	int x0 = std::max(box[0] - pad, 0);
+	int y0 = std::max(box[2] - pad, 0);
+	int x1 = std::min(box[1] + pad + 1, res.frame.cols);
+	int y1 = std::min(box[3] + pad + 1, res.frame.rows);
+	tracker.window = cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+
+//references to m's buffer, other threads drop theirs with atomic adds so it's read the same way
+static inline int matRefs(const cv::Mat& m) {
+
+	return CV_XADD(&m.u->refcount, 0);
+}
+
+
+//a Mat from pool that only the pool still holds, of the right size and type
+cv::Mat reuseMat(std::vector<cv::Mat>& pool, cv::Size size, int type) {
+
+	//a frame on its way out (or the display) still holding a Mat keeps its refcount above 1
+	for (size_t x = 0; x < pool.size(); x++) {
+		cv::Mat& m = pool[x];
+		if (m.u != NULL && matRefs(m) == 1 && m.size() == size && m.type() == type) {
+			return m;
+		}
+	}
+
+	//unused ones of another size are left from before the resolution changed
+	for (size_t x = pool.size(); x-- > 0;) {
+		cv::Mat& m = pool[x];
+		if (m.u == NULL || (matRefs(m) == 1 && (m.size() != size || m.type() != type))) {
+			pool.erase(pool.begin() + x);
+		}
+	}
+
+	pool.push_back(cv::Mat(size, type));
+	return pool.back();
+}
+
+
+//cleans, labels, measures and classifies res.frame, filling in the rest of res
+int processFrame(FrameResult& res, FrameWorkspace& ws, PipelineSettings& settings) {
+
+	ScopedTimer total(statHist(settings, STAT_PROCESS), &res.totalMs);
+
+	//stages that don't run this frame show 0, and a window pass that's redone is added in
+	for (int st = 0; st < STAGE_COUNT; st++) {
+		res.stageMs[st] = 0;
+		res.perf[st] = PerfSample();
+	}
+
+	//NULL unless profiling, then every stage also counts into res.perf
+	PerfCounters* counters = settings.perf ? threadPerfCounters() : NULL;
+	res.hasPerf = counters != NULL;
+
+	ws.cleanup.thresh = settings.thresh;
+	ws.cleanup.level = settings.level;
+	ws.cleanup.radius = settings.radius.load(std::memory_order_relaxed);
+
+	RunImage* regtest = NULL; //labelled runs of the last pass, one of ws's buffers
+	std::vector<RegionInfo>& table = ws.table; //area/box/centroid sums for each region
+	RoiTracker& tracker = ws.tracker;
+
+	cv::Rect full(0, 0, res.frame.cols, res.frame.rows);
+	bool tracking = settings.track && !settings.multi;
+	res.area = full;
+
+	//pyramid mode needs a shrunk frame big enough to clean up
+	bool pyramid = settings.pyramid > 1 && !settings.multi && !tracking
+		&& res.frame.cols / settings.pyramid >= 16 && res.frame.rows / settings.pyramid >= 16;
+	res.scale = pyramid ? settings.pyramid : 1;
+	if (tracking && !tracker.window.empty() && tracker.sinceFull < settings.trackRefresh) {
+		res.area = tracker.window & full; //the frame size could have changed
+		if (res.area.empty()) {
+			res.area = full;
+		}
+	}
+
+	if (cleanArea(res, ws, settings, counters, regtest) != 0) {
+		return -1;
+	}
+
+	//in a window the tracked object is the biggest region, unless it's gone or near enough to the
+	//window's edge that the clean up could differ from a full frame pass, then the whole frame is done again
+	//the same goes for the window a pyramid pass is refined in
+	bool measured = false;
+	if (res.scale > 1 || res.area != full) {
+		measured = res.scale > 1 ? refinePyramid(res, ws, settings, counters, regtest)
+			: trackWindow(res, *regtest, table, settings, counters);
+		if (!measured) {
+			res.area = full;
+			res.scale = 1;
+			if (redoPass(res, ws, settings, counters, regtest) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	if (settings.multi) {
+		multiObjects(res, ws, *regtest, settings, counters);
+	}
+	else if (measured) {
+		res.objects.clear();
+		classifyCentral(res, settings, counters);
+	}
+	else {
+		res.objects.clear();
+		{
+			ScopedTimer timer(statHist(settings, STAGE_FEATURES), &res.stageMs[STAGE_FEATURES]);
+			PerfScope perf(counters, &res.perf[STAGE_FEATURES]);
+
+			//finding majority region in center of image
+			res.central = centralRegion(*regtest, table);
+
+			//one pass over the runs in the region's box for moments, angles, mu22 and the oriented box
+			regionStats(*regtest, res.central, table[res.central], res.stats);
+			statFeatures(res.stats, res.moments, res.mu);
+		}
+
+		classifyCentral(res, settings, counters);
+	}
+
+	if (tracking) {
+		updateTracker(tracker, res, settings);
+	}
+
+	if (!settings.views) {
+		addPerfTotals(res, settings, STAGE_RENDER);
+		return 0;
+	}
+
+	ScopedTimer timer(statHist(settings, STAGE_RENDER), &res.stageMs[STAGE_RENDER]);
+	{
+		PerfScope perf(counters, &res.perf[STAGE_RENDER]);
+
+		//the region map is only drawn from the runs for display, frame sized even if a window pass only labelled the window
+		ws.labels.create(res.frame.size(), CV_32S);
+		if (res.area != full) {
+			ws.labels.setTo(cv::Scalar(0));
+			cv::Mat inside = ws.labels(res.area);
+			regtest->paint(inside);
+		}
+		else {
+			regtest->paint(ws.labels);
+		}
+		renderViews(res, ws, ws.labels);
+	}
+	addPerfTotals(res, settings, STAGE_COUNT);
+
+	return 0;
+}
+
+
+//draws the region, oriented box and label images for display
+static void renderViews(FrameResult& res, FrameWorkspace& ws, cv::Mat& regtest) {
+
+	//drawn into images earlier frames have finished with
+	res.regionView.release();
+	res.obbView.release();
+	res.regionView = reuseMat(ws.views, res.frame.size(), CV_8UC3);
+	res.obbView = reuseMat(ws.views, res.frame.size(), CV_8UC3);
+
+	//gives each region a different color
+	regColor(regtest, res.regionView, res.regnum);
+
+	if (!res.objects.empty()) {
+		renderObjects(res, ws);
+		return;
+	}
+
+	//adds littl red cross to center of object
+	objCenter(res.regionView, res.moments);
+
+	//corners of the oriented box, already rotated back into the frame
+	cv::Point corners[4];
+	obbCorners(res.stats, corners);
+
+	//drawing Oriented Bounding Box
+	cv::cvtColor(res.clean, res.obbView, cv::COLOR_GRAY2BGR);
+	objCenter(res.obbView, res.moments);
+	for (int c = 0; c < 4; c++) {
+		cv::line(res.obbView, corners[c], corners[(c + 1) % 4], cv::Scalar(0, 0, 255), 1);
+	}
+
+	//window the frame was measured in when tracking or in pyramid mode
+	if (res.area.width != res.frame.cols || res.area.height != res.frame.rows) {
+		cv::rectangle(res.obbView, res.area, cv::Scalar(0, 255, 0), 1);
+	}
+
+	//adding text overlays to final frame, through one string that keeps its buffer
+	char feature[64];
+	ws.text = res.result;
+	cv::putText(res.obbView, ws.text, cv::Point(40, res.obbView.rows - 40), 1, 5, cv::Scalar(255, 0, 0));
+	snprintf(feature, sizeof(feature), "fill %%: %f", res.mu[FEAT_FILL]);
+	ws.text = feature;
+	cv::putText(res.obbView, ws.text, cv::Point(res.obbView.cols - 350, 30), 2, 1, cv::Scalar(0, 0, 255));
+	snprintf(feature, sizeof(feature), "h/w ratio: %f", res.mu[FEAT_RATIO]);
+	ws.text = feature;
+	cv::putText(res.obbView, ws.text, cv::Point(res.obbView.cols - 350, 70), 2, 1, cv::Scalar(0, 0, 255));
+}
+
+
+//oriented box, center and label of every object in multi-object mode
+static void renderObjects(FrameResult& res, FrameWorkspace& ws) {
+
+	cv::cvtColor(res.clean, res.obbView, cv::COLOR_GRAY2BGR);
+
+	for (size_t o = 0; o < res.objects.size(); o++) {
+
+		FrameObject& obj = res.objects[o];
+		objCenter(res.regionView, obj.moments);
+		objCenter(res.obbView, obj.moments);
+
+		cv::Point corners[4];
+		obbCorners(obj.stats, corners);
+		for (int c = 0; c < 4; c++) {
+			cv::line(res.obbView, corners[c], corners[(c + 1) % 4], cv::Scalar(0, 0, 255), 1);
+		}
+
+		//label just above the top of the region's box
+		cv::Point at(obj.stats.box[0], std::max(obj.stats.box[2] - 8, 20));
+		ws.text = obj.result;
+		cv::putText(res.obbView, ws.text, at, 1, 2, cv::Scalar(255, 0, 0), 2);
+	}
+
+	char count[64];
+	snprintf(count, sizeof(count), "objects: %d", static_cast<int>(res.objects.size()));
+	ws.text = count;
+	cv::putText(res.obbView, ws.text, cv::Point(res.obbView.cols - 350, 30), 2, 1, cv::Scalar(0, 0, 255));
+}
+
+
+//json lines if the file name ends in .jsonl or .json, otherwise csv
+int ResultWriter::open(const char* path, bool perf, bool streams) {
+
+	close();
+	this->perf = perf;
+	this->streams = streams;
+
+	if (path == NULL || strcmp(path, "-") == 0) {
+		fp = stdout;
+	}
+	else {
+		fp = fopen(path, "w");
+		if (fp == NULL) {
+			printf("Unable to open %s\n", path);
+			return -1;
+		}
+		std::string p(path);
+		json = (p.size() > 6 && p.compare(p.size() - 6, 6, ".jsonl") == 0)
+			|| (p.size() > 5 && p.compare(p.size() - 5, 5, ".json") == 0);
+	}
+
+	if (!json) {
+		if (streams) {
+			fprintf(fp, "stream,");
+		}
+		fprintf(fp, "frame,source,label,region,pixels,");
+		for (int s = 0; s < StoredFeatures::size; s++) {
+			fprintf(fp, "%s,", featureName(StoredFeatures::id(s)));
+		}
+		fprintf(fp, "cleanup_ms,labeling_ms,features_ms,classify_ms,render_ms,total_ms");
+		//one column per stage and counter, like cleanup_cycles
+		for (int st = 0; perf && st < STAGE_COUNT; st++) {
+			for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+				fprintf(fp, ",%s_%s", statName(st), perfEventName(e));
+			}
+		}
+		fprintf(fp, "\n");
+	}
+
+	return 0;
+}
+
+
+//writes one line for res, or one per object for csv in multi-object mode
+int ResultWriter::write(FrameResult& res) {
+
+	if (fp == NULL) {
+		return -1;
+	}
+
+	if (json) {
+		fprintf(fp, "{");
+		if (streams) {
+			fprintf(fp, "\"stream\":%d,", res.stream);
+		}
+		fprintf(fp, "\"frame\":%lld,\"source\":", static_cast<long long>(res.seq));
+		writeString(res.name.c_str());
+		fprintf(fp, ",\"label\":");
+		writeString(res.result);
+		fprintf(fp, ",\"region\":%d,\"pixels\":%d,\"features\":[", res.central, res.moments[2]);
+		writeFeatures(res.mu);
+		fprintf(fp, "],\"ms\":{\"cleanup\":%.3f,\"labeling\":%.3f,\"features\":%.3f,\"classify\":%.3f,\"render\":%.3f,\"total\":%.3f}",
+			res.stageMs[STAGE_CLEANUP], res.stageMs[STAGE_LABELING], res.stageMs[STAGE_FEATURES], res.stageMs[STAGE_CLASSIFY],
+			res.stageMs[STAGE_RENDER], res.totalMs);
+
+		if (!res.objects.empty()) {
+			fprintf(fp, ",\"objects\":[");
+			for (size_t o = 0; o < res.objects.size(); o++) {
+				FrameObject& obj = res.objects[o];
+				fprintf(fp, "%s{\"label\":", o > 0 ? "," : "");
+				writeString(obj.result);
+				fprintf(fp, ",\"region\":%d,\"pixels\":%d,\"center\":[%d,%d],\"features\":[",
+					obj.region, obj.moments[2], obj.moments[0], obj.moments[1]);
+				writeFeatures(obj.mu);
+				fprintf(fp, "]}");
+			}
+			fprintf(fp, "]");
+		}
+
+		writePerf(res);
+		fprintf(fp, "}\n");
+		return 0;
+	}
+
+	//the frame's own fields when there are no objects
+	size_t lines = std::max<size_t>(res.objects.size(), 1);
+	for (size_t o = 0; o < lines; o++) {
+
+		const char* label = res.result;
+		int region = res.central;
+		int pixels = res.moments[2];
+		double* mu = res.mu;
+		if (!res.objects.empty()) {
+			label = res.objects[o].result;
+			region = res.objects[o].region;
+			pixels = res.objects[o].moments[2];
+			mu = res.objects[o].mu;
+		}
+
+		if (streams) {
+			fprintf(fp, "%d,", res.stream);
+		}
+		fprintf(fp, "%lld,", static_cast<long long>(res.seq));
+		writeString(res.name.c_str());
+		fprintf(fp, ",");
+		writeString(label);
+		fprintf(fp, ",%d,%d,", region, pixels);
+		writeFeatures(mu);
+		fprintf(fp, ",%.3f,%.3f,%.3f,%.3f,%.3f,%.3f",
+			res.stageMs[STAGE_CLEANUP], res.stageMs[STAGE_LABELING], res.stageMs[STAGE_FEATURES], res.stageMs[STAGE_CLASSIFY],
+			res.stageMs[STAGE_RENDER], res.totalMs);
+
+		writePerf(res);
+		fprintf(fp, "\n");
+	}
+
+	return 0;
+}
+
+
+//json strings are always quoted, with quotes, backslashes and control characters escaped
+//csv fields are quoted only if they hold a comma, quote or line break, with quotes doubled inside
+void ResultWriter::writeString(const char* s) {
+
+	if (json) {
+		fputc('"', fp);
+		for (const unsigned char* c = reinterpret_cast<const unsigned char*>(s); *c != 0; c++) {
+			switch (*c) {
+			case '"': fputs("\\\"", fp); break;
+			case '\\': fputs("\\\\", fp); break;
+			case '\n': fputs("\\n", fp); break;
+			case '\r': fputs("\\r", fp); break;
+			case '\t': fputs("\\t", fp); break;
+			default:
+				if (*c < 0x20) {
+					fprintf(fp, "\\u%04x", *c);
+				}
+				else {
+					fputc(*c, fp);
+				}
+			}
+		}
+		fputc('"', fp);
+		return;
+	}
+
+	if (strpbrk(s, ",\"\r\n") == NULL) {
+		fputs(s, fp);
+		return;
+	}
+	fputc('"', fp);
+	for (const char* c = s; *c != 0; c++) {
+		if (*c == '"') {
+			fputc('"', fp);
+		}
+		fputc(*c, fp);
+	}
+	fputc('"', fp);
+}
+
+
+//the stored features of a feature vector, comma separated in StoredFeatures order
+void ResultWriter::writeFeatures(const double* mu) {
+
+	for (int s = 0; s < StoredFeatures::size; s++) {
+		fprintf(fp, "%s%f", s > 0 ? "," : "", mu[StoredFeatures::id(s)]);
+	}
+}
+
+
+//counters are written as 0 for frames that weren't profiled
+void ResultWriter::writePerf(FrameResult& res) {
+
+	if (perf && json) {
+		fprintf(fp, ",\"perf\":{");
+		for (int st = 0; st < STAGE_COUNT; st++) {
+			fprintf(fp, "%s\"%s\":{", st > 0 ? "," : "", statName(st));
+			for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+				fprintf(fp, "%s\"%s\":%llu", e > 0 ? "," : "", perfEventName(e),
+					static_cast<unsigned long long>(res.hasPerf ? res.perf[st].count[e] : 0));
+			}
+			fprintf(fp, "}");
+		}
+		fprintf(fp, "}");
+	}
+	else if (perf) {
+		for (int st = 0; st < STAGE_COUNT; st++) {
+			for (int e = 0; e < PERF_EVENT_COUNT; e++) {
+				fprintf(fp, ",%llu", static_cast<unsigned long long>(res.hasPerf ? res.perf[st].count[e] : 0));
+			}
+		}
+	}
+}
+
+
+void ResultWriter::close() {
+
+	if (fp != NULL && fp != stdout) {
+		fclose(fp);
+	}
+	else if (fp == stdout) {
+		fflush(fp);
+	}
+	fp = NULL;
+}
+
+
+//NULL or "-" writes to stdout
+int StatsReporter::open(const char* path) {
+
+	close();
+
+	if (path == NULL || strcmp(path, "-") == 0) {
+		fp = stdout;
+	}
+	else {
+		fp = fopen(path, "w");
+		if (fp == NULL) {
+			printf("Unable to open %s\n", path);
+			return -1;
+		}
+	}
+
+	fprintf(fp, "elapsed_s,window,stage,count,mean_ms,p50_ms,p90_ms,p99_ms,max_ms\n");
+	return 0;
+}
+
+
+//once interval has passed, reports what was recorded since the last report
+bool StatsReporter::poll(PipelineStats& stats) {
+
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if (!started) {
+		started = true;
+		begin = last = now;
+		return false;
+	}
+	if (std::chrono::duration<double>(now - last).count() < interval) {
+		return false;
+	}
+	last = now;
+
+	for (int s = 0; s < STAT_COUNT; s++) {
+		HistogramSnapshot snap;
+		stats.hist[s].snapshot(snap);
+		recent[s] = snap;
+		recent[s].subtract(previous[s]);
+		previous[s] = snap;
+	}
+
+	writeRows("interval", recent);
+	return true;
+}
+
+
+//reports everything recorded since the start
+void StatsReporter::writeTotals(PipelineStats& stats) {
+
+	HistogramSnapshot totals[STAT_COUNT];
+	for (int s = 0; s < STAT_COUNT; s++) {
+		stats.hist[s].snapshot(totals[s]);
+	}
+	writeRows("total", totals);
+}
+
+
+//one row per stage that has samples
+void StatsReporter::writeRows(const char* window, HistogramSnapshot* snaps) {
+
+	if (fp == NULL) {
+		return;
+	}
+
+	double elapsed = started ? std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count() : 0;
+	for (int s = 0; s < STAT_COUNT; s++) {
+		if (snaps[s].count == 0) {
+			continue;
+		}
+		fprintf(fp, "%.1f,%s,%s,%llu,%.3f,%.3f,%.3f,%.3f,%.3f\n", elapsed, window, statName(s),
+			static_cast<unsigned long long>(snaps[s].count), snaps[s].meanMs(), snaps[s].percentileMs(0.5),
+			snaps[s].percentileMs(0.9), snaps[s].percentileMs(0.99), snaps[s].maxMs());
+	}
+	fflush(fp);
+}
+
+
+//draws p50/p99 of the last interval in the top left corner of img
+void StatsReporter::drawOverlay(cv::Mat& img) {
+
+	int y = 20;
+	for (int s = 0; s < STAT_COUNT; s++) {
+		if (recent[s].count == 0) {
+			continue;
+		}
+		char line[96];
+		snprintf(line, sizeof(line), "%-9s p50 %7.2f  p99 %7.2f ms", statName(s),
+			recent[s].percentileMs(0.5), recent[s].percentileMs(0.99));
+		cv::putText(img, line, cv::Point(10, y), cv::FONT_HERSHEY_PLAIN, 1, cv::Scalar(0, 255, 0));
+		y += 16;
+	}
+}
+
+
+void StatsReporter::close() {
+
+	if (fp != NULL && fp != stdout) {
+		fclose(fp);
+	}
+	else if (fp == stdout) {
+		fflush(fp);
+	}
+	fp = NULL;
+}
+
+
+FramePipeline::FramePipeline(PipelineSettings& settings, int workers, size_t depth)
+	: settings(settings), workerCount(std::max(1, workers)), depth(depth) {
+
+	window = static_cast<int64_t>(std::max<size_t>(1, depth)) * workerCount;
+}
+
+
+FramePipeline::~FramePipeline() {
+
+	stop();
+
+	for (size_t s = 0; s < inputs.size(); s++) {
+		delete inputs[s];
+	}
+	delete work;
+}
+
+
+//starts a capture thread for each source and the workers that serve all of them
+int FramePipeline::start(const std::vector<FrameSource*>& sources) {
+
+	if (sources.empty() || !inputs.empty()) {
+		return -1;
+	}
+
+	for (size_t s = 0; s < sources.size(); s++) {
+		Stream* stream = new Stream();
+		stream->outSlots = std::vector<OutSlot>(window);
+		inputs.push_back(stream);
+	}
+	//room for every stream's whole window, so a frame that has a slot always fits
+	work = new MpmcRing<FrameResult>(window * sources.size());
+
+	for (int w = 0; w < workerCount; w++) {
+		workThreads.emplace_back(&FramePipeline::workerLoop, this);
+	}
+	for (size_t s = 0; s < sources.size(); s++) {
+		inputs[s]->capThread = std::thread(&FramePipeline::captureLoop, this, static_cast<int>(s), sources[s]);
+	}
+
+	return 0;
+}
+
+
+int FramePipeline::start(FrameSource* source) {
+
+	return start(std::vector<FrameSource*>(1, source));
+}
+
+
+//reads frames of stream s onto the shared queue, each once its output slot is free
+void FramePipeline::captureLoop(int s, FrameSource* source) {
+
+	Stream* stream = inputs[s];
+	int64_t seq = 0;
+	std::vector<cv::Mat> frames; //captured frames, read into again once nothing holds them
+	cv::Size lastSize;
+	int lastType = CV_8UC3;
+
+	while (!stopping.load()) {
+
+		//this frame's slot is free once frame seq - window has been read
+		int spins = 0;
+		while (seq - stream->nextSeq.load(std::memory_order_acquire) >= window) {
+			if (stopping.load()) {
+				return;
+			}
+			backoff(spins);
+		}
+
+		FrameResult res;
+		//a Mat queued frames don't hold any more, so a camera or video reads into it without allocating
+		if (lastSize.area() > 0) {
+			res.frame = reuseMat(frames, lastSize, lastType);
+		}
+		bool got;
+		{
+			ScopedTimer timer(statHist(settings, STAT_CAPTURE));
+			got = source->read(res.frame, res.name);
+		}
+		if (!got) {
+			break;
+		}
+		lastSize = res.frame.size();
+		lastType = res.frame.type();
+		res.seq = seq;
+		res.stream = s;
+		res.readTime = std::chrono::steady_clock::now();
+
+		//the queue has room for every stream's window, this only waits on a worker part way through a pop
+		spins = 0;
+		while (!work->push(res)) {
+			if (stopping.load()) {
+				return;
+			}
+			backoff(spins);
+		}
+
+		seq++;
+		stream->captured.store(seq);
+	}
+
+	stream->captureDone.store(true);
+}
+
+
+//takes the next frame of any stream off the shared queue and puts it in its stream's output slot
+//each stream gets its own clean-up buffers, the tracking window comes from the stream
+void FramePipeline::workerLoop() {
+
+	std::vector<FrameWorkspace> ws(inputs.size());
+
+	int spins = 0;
+	while (!stopping.load()) {
+
+		FrameResult res;
+		if (!work->pop(res)) {
+			bool done = true;
+			for (size_t s = 0; s < inputs.size(); s++) {
+				done = done && inputs[s]->captureDone.load();
+			}
+			if (!done) {
+				backoff(spins);
+				continue;
+			}
+			//every capture thread pushes its last frame before saying it's done, so this gets any left
+			if (!work->pop(res)) {
+				return;
+			}
+		}
+		spins = 0;
+
+		Stream* st = inputs[res.stream];
+		FrameWorkspace& fws = ws[res.stream];
+		int64_t seq = res.seq;
+
+		if (settings.track) {
+			std::lock_guard<std::mutex> guard(st->trackLock);
+			fws.tracker = st->tracker;
+		}
+
+		processFrame(res, fws, settings);
+
+		//a frame finishing after a later one of its stream doesn't move the window back
+		if (settings.track) {
+			std::lock_guard<std::mutex> guard(st->trackLock);
+			if (seq > st->trackSeq) {
+				st->tracker = fws.tracker;
+				st->trackSeq = seq;
+			}
+		}
+
+		//capture waited for this slot to be read before reading the frame, so it's free
+		OutSlot& slot = st->outSlots[seq % window];
+		slot.res = std::move(res);
+		slot.ready.store(seq, std::memory_order_release);
+	}
+}
+
+
+//gets the next processed frame of stream in capture order without waiting
+bool FramePipeline::next(int stream, FrameResult& res) {
+
+	Stream* st = inputs[stream];
+	int64_t seq = st->nextSeq.load(std::memory_order_relaxed);
+	OutSlot& slot = st->outSlots[seq % window];
+	if (slot.ready.load(std::memory_order_acquire) != seq) {
+		return false;
+	}
+	res = std::move(slot.res);
+
+	if (settings.stats != NULL) {
+		settings.stats->hist[STAT_LATENCY].record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - res.readTime).count());
+	}
+
+	//frees the slot for frame seq + window
+	st->nextSeq.store(seq + 1, std::memory_order_release);
+	return true;
+}
+
+
+//true once capture of stream has ended and every frame has been handed out
+bool FramePipeline::finished(int stream) {
+
+	Stream* st = inputs[stream];
+	return st->captureDone.load() && st->nextSeq.load() >= st->captured.load();
+}
+
+
+//true once every stream is finished
+bool FramePipeline::finished() {
+
+	for (size_t s = 0; s < inputs.size(); s++) {
+		if (!finished(static_cast<int>(s))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+//stops and joins every thread
+void FramePipeline::stop() {
+
+	stopping.store(true);
+
+	for (size_t s = 0; s < inputs.size(); s++) {
+		if (inputs[s]->capThread.joinable()) {
+			inputs[s]->capThread.join();
+		}
+	}
+	for (size_t w = 0; w < workThreads.size(); w++) {
+		if (workThreads[w].joinable()) {
+			workThreads[w].join();
+		}
+	}
+	workThreads.clear();
+}
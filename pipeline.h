@@ -0,0 +1,431 @@
+/*
+	James Marcel
+
+	header for the threaded frame pipeline
+	a capture thread per camera or stream, processing workers shared by all of them and the
+	display (calling) thread are joined by bounded single producer/single consumer rings
+*/
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <opencv2/opencv.hpp>
+#include "recog.h"
+#include "stats.h"
+#include "perf.h"
+#include "catalog.h"
+
+
+//bounded lock free ring for any number of producer and consumer threads
+//each slot carries the turn it's on, so a thread claims a slot with one compare and swap and
+//the slot isn't readable until its item has been moved in (Vyukov's bounded queue)
+//capacity is rounded up to a power of 2
+template <typename T>
+class MpmcRing {
+public:
+	explicit MpmcRing(size_t capacity) : slots(roundUp(capacity)) {
+		mask = slots.size() - 1;
+		for (size_t i = 0; i < slots.size(); i++) {
+			slots[i].turn.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	//moves item into the ring, returns false if full
+	bool push(T& item) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		Slot* slot;
+		while (true) {
+			slot = &slots[t & mask];
+			intptr_t diff = static_cast<intptr_t>(slot->turn.load(std::memory_order_acquire)) - static_cast<intptr_t>(t);
+			if (diff == 0 && tail.compare_exchange_weak(t, t + 1, std::memory_order_relaxed)) {
+				break;
+			}
+			if (diff < 0) {
+				return false;
+			}
+			if (diff > 0) {
+				t = tail.load(std::memory_order_relaxed);
+			}
+		}
+		slot->item = std::move(item);
+		slot->turn.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	//moves the oldest item out of the ring, returns false if empty
+	bool pop(T& item) {
+		size_t h = head.load(std::memory_order_relaxed);
+		Slot* slot;
+		while (true) {
+			slot = &slots[h & mask];
+			intptr_t diff = static_cast<intptr_t>(slot->turn.load(std::memory_order_acquire)) - static_cast<intptr_t>(h + 1);
+			if (diff == 0 && head.compare_exchange_weak(h, h + 1, std::memory_order_relaxed)) {
+				break;
+			}
+			if (diff < 0) {
+				return false;
+			}
+			if (diff > 0) {
+				h = head.load(std::memory_order_relaxed);
+			}
+		}
+		item = std::move(slot->item);
+		slot->turn.store(h + mask + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	struct Slot {
+		std::atomic<size_t> turn{ 0 }; //position that can write it next, or that position + 1 once written
+		T item;
+	};
+
+	static size_t roundUp(size_t capacity) {
+		size_t size = 1;
+		while (size < capacity) {
+			size *= 2;
+		}
+		return size;
+	}
+
+	std::vector<Slot> slots;
+	size_t mask = 0;
+	alignas(64) std::atomic<size_t> head{ 0 }; //next position to read
+	alignas(64) std::atomic<size_t> tail{ 0 }; //next position to write
+};
+
+
+//timed parts of each frame
+enum Stage {
+	STAGE_CLEANUP, //threshold, erosion, dilation and first labelling pass
+	STAGE_LABELING, //label resolution and region table
+	STAGE_FEATURES, //central region and region stats
+	STAGE_CLASSIFY, //distance to database objects
+	STAGE_RENDER, //display images
+	STAGE_COUNT
+};
+
+//histograms kept besides the per-stage ones
+enum StatExtra {
+	STAT_CAPTURE = STAGE_COUNT, //reading a frame from the source
+	STAT_PROCESS, //all of processFrame
+	STAT_LATENCY, //frame read to handed out in order by FramePipeline::next
+	STAT_COUNT
+};
+
+//latency histograms shared by every thread of a pipeline, indexed by Stage or StatExtra
+//and hardware counter totals for each stage when profiling
+struct PipelineStats {
+	LatencyHistogram hist[STAT_COUNT];
+
+	std::atomic<uint64_t> perfTotals[STAGE_COUNT][PERF_EVENT_COUNT] = {};
+	std::atomic<uint64_t> perfFrames[STAGE_COUNT] = {};
+
+	//adds one frame's counters for stage s
+	void addPerf(int s, const PerfSample& sample);
+};
+
+//writes hardware counters per frame (and IPC, misses per 1000 instructions) for each stage
+void writePerfTotals(FILE* fp, PipelineStats& stats);
+
+//short name of a Stage or StatExtra for reports
+const char* statName(int s);
+
+
+//settings every worker reads for each frame
+//radius can be changed from the display thread while running
+struct PipelineSettings {
+	int thresh = 120; //binary threshold
+	int level = 2; //erosion level
+	std::atomic<int> radius{ 6 }; //dilation radius
+
+	bool knn = false; //k-nearest neighbors instead of nearest neighbor
+	int k = 3;
+
+	//database, index and deviations, objects can be enrolled while the pipeline runs
+	ObjectCatalog* catalog = NULL;
+
+	//classify every region that passes filter instead of only the one in the middle of the frame
+	bool multi = false;
+	RegionFilter filter;
+
+	//only process a window around the object found in the last frame (single object mode)
+	//trackMargin widens the window by that fraction of the object's size on every side
+	//and every trackRefresh frames in a window there's a full frame pass to pick up new objects
+	bool track = false;
+	double trackMargin = 0.5;
+	int trackRefresh = 30;
+
+	//pyramid mode: clean up and label the frame shrunk by this factor to find the central region, then
+	//clean up and measure only a window around it at full resolution (single object mode without tracking), 1 for off
+	int pyramid = 1;
+
+	bool views = true; //draw the display images for each frame
+
+	PipelineStats* stats = NULL; //stage histograms are recorded here if not NULL
+	bool perf = false; //count cycles, instructions, cache and branch misses for each stage (Linux)
+};
+
+//where frames come from: a camera or video file, or a list of image files
+class FrameSource {
+public:
+	virtual ~FrameSource() {}
+
+	//reads the next frame into frame and its file name (if any) into name
+	//returns false at the end of the input
+	virtual bool read(cv::Mat& frame, std::string& name) = 0;
+};
+
+//camera, video file or stream read through cv::VideoCapture (deleted with the source)
+class VideoSource : public FrameSource {
+public:
+	explicit VideoSource(cv::VideoCapture* capdev) : capdev(capdev) {}
+	~VideoSource() { delete capdev; }
+	bool read(cv::Mat& frame, std::string& name);
+
+private:
+	cv::VideoCapture* capdev;
+};
+
+//list of image files read in order, unreadable files are skipped
+class ImageListSource : public FrameSource {
+public:
+	explicit ImageListSource(const std::vector<std::string>& files) : files(files) {}
+	bool read(cv::Mat& frame, std::string& name);
+
+private:
+	std::vector<std::string> files;
+	size_t nextFile = 0;
+};
+
+//lists image files (jpg, png, bmp, tif) in a directory, sorted by name
+int listImages(const char* dir, std::vector<std::string>& files);
+
+//opens input as a camera index (all digits), a directory of images, an image glob (has * or ?) or a video file/stream
+//returns NULL if it can't be opened
+FrameSource* openSource(const char* input);
+
+
+//tracking mode state carried from frame to frame, one per stream
+//a frame starts from the state left by the latest frame of its stream that has finished, with several
+//workers that can be a few frames back, so the margin has to cover that many frames of movement
+struct RoiTracker {
+	cv::Rect window; //part of the next frame to process, empty for a full frame pass
+	int sinceFull = 0; //frames processed in a window since the last full frame pass
+};
+
+//one region classified in multi-object mode
+struct FrameObject {
+	int region = 0; //label in the region map
+	RegionStats stats;
+	int moments[3] = { 0 }; //center x, center y, total pix
+	double mu[FEAT_COUNT] = { 0 }; //feature vector like FrameResult::mu
+	char result[256] = { 0 }; //name of closest database object
+};
+
+//one frame and everything worked out from it
+struct FrameResult {
+	int64_t seq = -1; //capture order within the stream
+	int stream = 0; //which of the pipeline's sources the frame came from
+	std::string name; //image file name, empty for video
+	std::chrono::steady_clock::time_point readTime; //when capture finished reading the frame
+
+	cv::Mat frame; //captured image
+	cv::Mat binary; //thresholded image (views only)
+	cv::Mat clean; //cleaned up binary image (views only)
+	cv::Mat regionView; //color coded regions with center cross (views only)
+	cv::Mat obbView; //cleaned image with oriented box, center and label (views only)
+
+	cv::Rect area; //part of the frame that was measured, a window around the object when tracking or in pyramid mode
+	int scale = 1; //the central region was found on the frame shrunk by this factor, then measured in area (pyramid mode)
+	int regnum = 0; //number of labels including background
+	int central = 0; //label of chosen region (0 if none)
+	RegionStats stats;
+	int moments[3] = { 0 }; //center x, center y, total pix
+	double mu[FEAT_COUNT] = { 0 }; //feature vector by Feature (featureset.h), the features that aren't stored stay 0
+	char result[256] = { 0 }; //name of closest database object
+
+	//every region classified in multi-object mode, largest first
+	//the central fields above then hold the largest one
+	std::vector<FrameObject> objects;
+
+	double stageMs[STAGE_COUNT] = { 0 }; //time spent in each stage
+	double totalMs = 0; //time in processFrame
+
+	bool hasPerf = false; //perf holds counters for this frame
+	PerfSample perf[STAGE_COUNT]; //hardware counters for each stage
+};
+
+//everything processFrame keeps from one frame to the next, one per thread processing frames (and stream)
+//buffers are sized by the first frames at a resolution and only reused after that, so
+//once frames keep coming at the same size processFrame doesn't allocate
+struct FrameWorkspace {
+	CleanupStream cleanup; //row buffers of the clean up and labelling
+	RoiTracker tracker; //window for the next frame with settings.track
+
+	RunImage runs; //labelled runs of the cleaned frame or window
+	RunImage smallRuns; //labelled runs of the shrunk frame in pyramid mode
+	cv::Mat small; //frame shrunk for pyramid mode
+	cv::Mat labels; //frame sized region map drawn from the runs for display
+	std::vector<RegionInfo> table; //area/box/centroid sums for each region
+
+	//multi-object mode
+	std::vector<int> selected;
+	std::vector<RegionStats> stats;
+	std::vector<double> features;
+	std::vector<char*> results;
+
+	//display images go out with the frames, each is drawn into again once nothing else holds it
+	std::vector<cv::Mat> views;
+	std::string text; //feature values drawn on the oriented box view
+};
+
+//cleans, labels, measures and classifies res.frame, filling in the rest of res
+//ws has to be kept by the thread calling this, the tracking window in it is used with settings.track
+int processFrame(FrameResult& res, FrameWorkspace& ws, PipelineSettings& settings);
+
+//a Mat of size and type from pool that nothing outside the pool holds any more, so it can be written into again
+//pool grows until it covers every Mat still in use, and drops unused ones of another size
+cv::Mat reuseMat(std::vector<cv::Mat>& pool, cv::Size size, int type);
+
+
+//writes one line per frame (label, features and timings) as csv or json lines
+//in multi-object mode csv gets one line per object and json lines get an objects list
+class ResultWriter {
+public:
+	//json lines if the file name ends in .jsonl or .json, otherwise csv
+	//a NULL or "-" path writes to stdout
+	//perf adds the hardware counters of each stage to every line, streams adds which source each frame came from
+	int open(const char* path, bool perf = false, bool streams = false);
+	int write(FrameResult& res);
+	void close();
+	~ResultWriter() { close(); }
+
+private:
+	//a string field (file name or label), quoted and escaped for json or csv
+	void writeString(const char* s);
+	//the stored features of mu, in StoredFeatures order
+	void writeFeatures(const double* mu);
+	//hardware counter fields of res, if perf is set
+	void writePerf(FrameResult& res);
+
+	FILE* fp = NULL;
+	bool json = false;
+	bool perf = false;
+	bool streams = false;
+};
+
+
+//writes interval percentiles from a PipelineStats every few seconds and draws them over a frame
+class StatsReporter {
+public:
+	double interval = 5; //seconds between reports
+
+	//NULL or "-" writes to stdout
+	int open(const char* path);
+
+	//once interval has passed since the last report, reports what was recorded since then
+	//call often from one thread, returns true when it reported
+	bool poll(PipelineStats& stats);
+
+	//reports everything recorded since the start
+	void writeTotals(PipelineStats& stats);
+
+	//draws p50/p99 of the last interval in the top left corner of img
+	void drawOverlay(cv::Mat& img);
+
+	void close();
+	~StatsReporter() { close(); }
+
+private:
+	void writeRows(const char* window, HistogramSnapshot* snaps);
+
+	FILE* fp = NULL;
+	bool started = false;
+	std::chrono::steady_clock::time_point begin;
+	std::chrono::steady_clock::time_point last;
+	HistogramSnapshot previous[STAT_COUNT]; //totals at the last report
+	HistogramSnapshot recent[STAT_COUNT]; //interval before the last report
+};
+
+
+//capture -> workers -> display, for one or more sources at once
+//every capture thread puts its frames on one shared queue and whichever worker is free takes the next
+//one, so the work spreads over the workers however uneven the streams are
+//each stream has a window of output slots, frame i goes in slot i % window and the display side reads
+//them in order, so each stream's frames come out in capture order
+//a frame is only read once its slot is free, so a worker never waits to hand a frame out
+//and a stream that isn't read stops capturing instead of holding up the workers
+class FramePipeline {
+public:
+	//depth is the ring size between each pair of stages
+	FramePipeline(PipelineSettings& settings, int workers, size_t depth = 4);
+	~FramePipeline();
+
+	//starts one capture thread per source and the worker threads, each source is read only by its capture thread
+	//frames of sources[s] come out of next(s, res)
+	int start(const std::vector<FrameSource*>& sources);
+	int start(FrameSource* source);
+
+	//gets the next processed frame of stream in capture order without waiting
+	//returns false if it isn't ready yet
+	//capture of a stream pauses while its window of frames hasn't been read
+	bool next(int stream, FrameResult& res);
+	bool next(FrameResult& res) { return next(0, res); }
+
+	//true once capture of stream has ended and every frame has been handed out by next
+	bool finished(int stream);
+
+	//true once every stream is finished
+	bool finished();
+
+	//number of sources given to start
+	int streams() const { return static_cast<int>(inputs.size()); }
+
+	//stops and joins every thread
+	void stop();
+
+private:
+	//one processed frame waiting for the display side
+	struct OutSlot {
+		FrameResult res;
+		std::atomic<int64_t> ready{ -1 }; //seq of the frame in res once it's been written
+	};
+
+	//output slots and progress of one source
+	struct Stream {
+		std::vector<OutSlot> outSlots; //worker -> display, frame i in slot i % window
+		std::thread capThread;
+		std::atomic<bool> captureDone{ false };
+		std::atomic<int64_t> captured{ 0 }; //frames read so far
+		std::atomic<int64_t> nextSeq{ 0 }; //next frame the display side expects, only written by it
+
+		std::mutex trackLock;
+		RoiTracker tracker; //tracking state after frame trackSeq
+		int64_t trackSeq = -1;
+	};
+
+	void captureLoop(int s, FrameSource* source);
+	void workerLoop();
+
+	PipelineSettings& settings;
+	int workerCount;
+	size_t depth;
+	int64_t window; //frames of a stream that can be captured and not yet read, depth per worker
+	std::vector<Stream*> inputs;
+	MpmcRing<FrameResult>* work = NULL; //capture -> workers, every stream
+
+	std::vector<std::thread> workThreads;
+
+	std::atomic<bool> stopping{ false };
+};
+
+#endif
@@ -11,13 +11,29 @@
 #include <dirent.h>
 #include <vector>
 #include <tuple>
+#include <algorithm>
+#include <limits>
 #include <opencv2/opencv.hpp>
 #include "recog.h"
+#include "morph.h"
+
+//x86 kernels are compiled with per-function target attributes and picked at runtime,
+//so the rest of the file doesn't need -mavx2
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RECOG_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define RECOG_TARGET(arch) __attribute__((target(arch)))
+#else
+#define RECOG_TARGET(arch)
+#endif
 
 
 //calculates which object is closest to the target based on 
 //the sum of distances from the k-nearest neigbors of each object class to the target
-int kNearest(double* target, float* dev, std::vector<std::vector<float>> data, std::vector<char*> objNames, char* result, int k) {
+int kNearest(double* target, float* dev, const FeatureDatabase& db, char* result, int k) {
 	if (k > 4) { //I only captured 4 different sets of features for each object
 		k = 4;
 	}
@@ -25,71 +41,53 @@ int kNearest(double* target, float* dev, std::vector<std::vector<float>> data, s
 		k = 1;
 	}
 
-	std::map<std::string, std::vector<std::vector<float>>> objList; //map to store vectors based on object
-
-	float distFill = 0;
-	float distShape = 0;
-	float sum = 0;
-
-	//adding each feature vector to a map with its name as a key
-	for (int i = 0; i < data.size(); i++) {
-		std::string name(objNames[i]);
-
-		if (!objList.count(objNames[i])) {
-
-			std::vector<std::vector<float>> temp;
-			objList[name] = temp;
-
-		}
-		objList[name].push_back(data[i]);
+	result[0] = '\0';
 
+	const float* cols[MATCH_FEATURES];
+	for (int d = 0; d < MATCH_FEATURES; d++) {
+		cols[d] = db.column(MatchFeatures::id(d));
 	}
 
+	//distances for one object at a time, only grows so there's no allocation after the first frames
+	static thread_local std::vector<float> objDist;
 
 	float topScore = 99999;
-	std::string topObj;
-	std::vector<float> objDist;
 
-	for (const auto& x : objList) {  //for each element x of objList map
+	for (int c = 0; c < db.classes(); c++) {  //objects come in name order
 
-		objDist.clear();
+		int begin = db.classBegin(c);
+		int n = db.classEnd(c) - begin;
+		if (n == 0) {
+			continue;
+		}
+		objDist.resize(n);
 
 		//calculating all distances for each object
-		for (int j = 0; j < x.second.size(); j++) {
-
-			float fill = x.second[j][6];
-			float shape = x.second[j][7];
-
-			distFill = ((target[6] - fill) / dev[0]) * ((target[6] - fill) / dev[0]);
-			distShape = ((target[7] - shape) / dev[1]) * ((target[7] - shape) / dev[1]);
-			sum = distFill + distShape; //distance from this object to target
-
-			objDist.push_back(sum); //adding this distance to object's distances
-
+		for (int j = 0; j < n; j++) {
+			objDist[j] = matchDistance(target, cols, begin + j, dev); //distance from this object to target
 		}
-		
-		//finding the k closest by sorting and summing top k distances
-		//distSort(objDist);
 
-		sort(objDist.begin(), objDist.end());
+		//finding the k closest, only those k need to be in order
+		int kc = std::min(k, n);
+		std::nth_element(objDist.begin(), objDist.begin() + (kc - 1), objDist.begin() + n);
+		std::sort(objDist.begin(), objDist.begin() + kc);
 
 		float score = 0;
-		for (int z = 0; z < k; z++) {
+		for (int z = 0; z < kc; z++) {
 			score += objDist[z];
 		}
+		//objects with fewer than k entries are scored as if the rest were as far as their average
+		if (kc < k) {
+			score = score * k / kc;
+		}
 
 		//update best option if this is best option
 		if (score < topScore) {
 			topScore = score;
-			topObj = x.first;
-
+			strcpy(result, db.className(c));
 		}
-
 	}
 
-	strcpy(result, topObj.c_str());
-
-
 	return 0;
 }
 
@@ -98,253 +96,296 @@ int kNearest(double* target, float* dev, std::vector<std::vector<float>> data, s
 
 //calculates distance between database features and target.
 //Returns name of lowest distance object
-int nearestNeighb(double* target, float* dev, std::vector<std::vector<float>> data, std::vector<char*> objNames, char* result) {
+int nearestNeighb(double* target, float* dev, const FeatureDatabase& db, char* result) {
 
-	int lowestPlace = 0;
-	float lowestVal = 99999;
+	if (db.rows() == 0) {
+		result[0] = '\0';
+		return -1;
+	}
 
-	float distFill = 0;
-	float distShape = 0;
-	float sum = 0;
+	const float* cols[MATCH_FEATURES];
+	for (int d = 0; d < MATCH_FEATURES; d++) {
+		cols[d] = db.column(MatchFeatures::id(d));
+	}
+
+	int lowestPlace = -1;
+	int lowestSeq = 0;
+	float lowestVal = 99999;
 
-	for (int i = 0; i < data.size(); i++) {
+	for (int i = 0; i < db.rows(); i++) {
 
 		//calculate distance from target to db feature
-		distFill = ((target[6] - data[i][6]) / dev[0]) * ((target[6] - data[i][6]) / dev[0]);
-		distShape = ((target[7] - data[i][7]) / dev[1]) * ((target[7] - data[i][7]) / dev[1]);
-
-		sum = distFill + distShape;
+		float sum = matchDistance(target, cols, i, dev);
 
-		if (sum < lowestVal) { //save nearest neighbor position/value
+		//save nearest neighbor position/value, ties go to the entry added first
+		if (sum < lowestVal || (sum == lowestVal && lowestPlace >= 0 && db.rowSeq(i) < lowestSeq)) {
 			lowestVal = sum;
 			lowestPlace = i;
+			lowestSeq = db.rowSeq(i);
 		}
 
 	}
 
-	strcpy(result, objNames[lowestPlace]);
+	//nothing closer than the starting distance, the first entry is used
+	if (lowestPlace < 0) {
+		for (int i = 0; i < db.rows(); i++) {
+			if (db.rowSeq(i) == 0) {
+				lowestPlace = i;
+			}
+		}
+		lowestPlace = std::max(lowestPlace, 0);
+	}
+
+	strcpy(result, db.className(db.rowClass(lowestPlace)));
 
 	return 0;
 }
 
 
 //calculates stddev for invariant features (fill ratio and h/w ratio)
-int deviation(std::vector<std::vector<float>> data, float* result) {
+//sums are kept in double so the order rows are stored in doesn't matter
+int deviation(const FeatureDatabase& db, float* result) {
 
-	float sumFill = 0;
-	float sumShape = 0;
-	float fillAvg = 0;
-	float shapeAvg = 0;
-
-	//iterate through each object in db for averages
-	for (int i = 0; i < data.size(); i++) {
+	const int D = MATCH_FEATURES;
+	const float* cols[D];
+	for (int d = 0; d < D; d++) {
+		cols[d] = db.column(MatchFeatures::id(d));
+	}
+	int n = db.rows();
 
-		sumFill += data[i][6]; //position of each OBB fill percentage
-		sumShape += data[i][7]; //pos of each height/width ratio
+	double sum[D] = { 0 };
 
+	//iterate through each object in db for averages
+	for (int i = 0; i < n; i++) {
+		for (int d = 0; d < D; d++) {
+			sum[d] += cols[d][i];
+		}
 	}
 
-	fillAvg = sumFill / data.size();
-	shapeAvg = sumShape / data.size();
+	double avg[D];
+	for (int d = 0; d < D; d++) {
+		avg[d] = sum[d] / n;
+	}
 
-	float sseFill = 0;
-	float sseShape = 0;
+	double sse[D] = { 0 };
 
-	for (int i = 0; i < data.size(); i++) {
+	for (int i = 0; i < n; i++) {
 		//sum squared difference
-		sseFill += (data[i][6] - fillAvg) * (data[i][6] - fillAvg); 
-		sseShape += (data[i][7] - shapeAvg) * (data[i][7] - shapeAvg);
-
+		for (int d = 0; d < D; d++) {
+			sse[d] += (cols[d][i] - avg[d]) * (cols[d][i] - avg[d]);
+		}
 	}
 
-
-	result[0] = sqrt(sseFill / data.size());
-	result[1] = sqrt(sseShape / data.size());
-
+	for (int d = 0; d < D; d++) {
+		result[d] = static_cast<float>(sqrt(sse[d] / n));
+	}
 
 	return 0;
 }
 
 
 
+//rows scaled per block, the match columns of this many rows fit in L1 so every query in a batch reuses them
+//kept a multiple of 8 so every column of the block starts 32 byte aligned for the AVX2 loads
+static constexpr int blockRows(int features) {
+	return (4096 / features) & ~7;
+}
+static const int batchBlock = blockRows(MATCH_FEATURES);
 
-
-
-
-//Adds both h/w ratio and fill percentage to feature vector
-int getRatio(cv::Mat& src,int region, int* obb, double* feature) {
-
-	//iterate only through bounding box
-	int rstart = obb[2];
-	int rend = obb[3];
-	int cstart = obb[0];
-	int cend = obb[1];
-
-	double count = 0;
-	double inRegion = 0;
-	int test = 0;
-
-	//counting empty and full pixels
-	for (int i = rstart; i <= rend; i++) {
-
-		uchar* rptr = src.ptr<uchar>(i);
-
-		for (int j = cstart; j <= cend; j++) {
-			
-			count += 1;
-
-			if (rptr[j] == region) {
-				inRegion += 1;
-			}
+//checked for every feature count, not only the one MatchFeatures has now
+static constexpr bool blockRowsAligned() {
+	for (int d = 1; d <= FEAT_COUNT; d++) {
+		if (blockRows(d) % 8 != 0 || blockRows(d) == 0) {
+			return false;
 		}
 	}
+	return true;
+}
+static_assert(blockRowsAligned(), "batch block columns have to stay 32 byte aligned");
 
+//puts row into the k closest of one query (best holds n, sorted by distance then order added)
+static inline void topKInsert(Neighbor* best, int& n, int k, float dist, int row, const FeatureDatabase& db) {
 
-	//calculate fill percentage
-	double fill = inRegion / count;
-	feature[6] = fill;
-
-	double height = obb[3] - obb[2];
-	double width = obb[1] - obb[0];
-
-	//this h/w ratio calculation always divides by longer dimension
-	if (width > height) {
-		feature[7] = height / width;
+	int seq = db.rowSeq(row);
+	if (n == k && !(dist < best[k - 1].dist || (dist == best[k - 1].dist && seq < db.rowSeq(best[k - 1].row)))) {
+		return;
 	}
-	else {
-		feature[7] = width / height;
+
+	int pos = (n < k) ? n++ : k - 1;
+	while (pos > 0 && (dist < best[pos - 1].dist || (dist == best[pos - 1].dist && seq < db.rowSeq(best[pos - 1].row)))) {
+		best[pos] = best[pos - 1];
+		pos--;
 	}
-	
+	best[pos].dist = dist;
+	best[pos].row = row;
+}
+
+//squared distance between a scaled query and row j of the scaled block, one term per match feature
+template <size_t... I>
+static inline float blockDist(const float* const* cols, int j, const float* q, std::index_sequence<I...>) {
 
-	//printf("the fill percentage is %f and the h/w ratio is %f\n", feature[6], feature[7]);
+	return (0.0f + ... + ((q[I] - cols[I][j]) * (q[I] - cols[I][j])));
+}
 
+//distances from one scaled query q to rows begin up to begin + n, whose scaled match features are in cols
+static void distBlockScalar(const float* const* cols, int begin, int n, const float* q,
+	const FeatureDatabase& db, Neighbor* best, int& found, int k) {
 
-	return 0;
+	for (int j = 0; j < n; j++) {
+		float dist = blockDist(cols, j, q, MatchFeatures::Index());
+		if (found < k || dist <= best[k - 1].dist) {
+			topKInsert(best, found, k, dist, begin + j, db);
+		}
+	}
 }
 
+#ifdef RECOG_X86
 
+//adds (q - col)^2 of 8 rows to acc
+RECOG_TARGET("avx2,fma")
+static inline __m256 sqAcc(__m256 acc, __m256 q, const float* col) {
 
+	__m256 d = _mm256_sub_ps(q, _mm256_load_ps(col));
+	return _mm256_fmadd_ps(d, d, acc);
+}
 
-//returns 4 coordinates that bound object
-//takes a mat with region values and an array to fill up
-int getBox(cv::Mat& src, int region, int* box ) {
+//squared distances of 8 rows from j on, the first feature's square and then one fma per feature after it
+template <size_t... I>
+RECOG_TARGET("avx2,fma")
+static inline __m256 blockDist8(const float* const* cols, int j, const __m256* q, std::index_sequence<I...>) {
 
-	box[0] = src.cols;  //x min
-	box[1] = 0; //x max
-	box[2] = src.rows;  //y min
-	box[3] = 0; //y max
+	__m256 d0 = _mm256_sub_ps(q[0], _mm256_load_ps(cols[0] + j));
+	__m256 acc = _mm256_mul_ps(d0, d0);
+	((acc = sqAcc(acc, q[I + 1], cols[I + 1] + j)), ...);
+	return acc;
+}
 
+//8 rows at a time, only rows that can make the k closest leave the registers
+RECOG_TARGET("avx2,fma")
+static void distBlockAVX2(const float* const* cols, int begin, int n, const float* q,
+	const FeatureDatabase& db, Neighbor* best, int& found, int k) {
 
-	for (int i = 0; i < src.rows; i++) {
+	__m256 qv[MATCH_FEATURES];
+	for (int d = 0; d < MATCH_FEATURES; d++) {
+		qv[d] = _mm256_set1_ps(q[d]);
+	}
+	__m256 worst = _mm256_set1_ps((found < k) ? std::numeric_limits<float>::infinity() : best[k - 1].dist);
+	int j = 0;
 
-		uchar* rptr = src.ptr<uchar>(i);
+	for (; j + 8 <= n; j += 8) {
 
-		for (int j = 0; j < src.cols; j++) {
+		__m256 dist = blockDist8(cols, j, qv, std::make_index_sequence<MATCH_FEATURES - 1>());
 
-			if (rptr[j] == region){
+		//ties with the current kth still go through, the order added decides them
+		int mask = _mm256_movemask_ps(_mm256_cmp_ps(dist, worst, _CMP_LE_OQ));
+		if (mask == 0) {
+			continue;
+		}
 
-				if (j < box[0]) { //if x is more left than current x min
-					box[0] = j;
-				}
-				if (j > box[1]) { //if x is more right than current x max
-					box[1] = j;
-				}
-				if (i < box[2]) { //if y is higher than current y min
-					box[2] = i;
-				}
-				if (i > box[3]) { //if y is lower than current y max
-					box[3] = i;
-				}
+		alignas(32) float lanes[8];
+		_mm256_store_ps(lanes, dist);
+		for (int b = 0; b < 8; b++) {
+			if (mask & (1 << b)) {
+				topKInsert(best, found, k, lanes[b], begin + j + b, db);
 			}
 		}
+		if (found == k) {
+			worst = _mm256_set1_ps(best[k - 1].dist);
+		}
 	}
 
-	//printf("Coordinates are %d,%d, %d and %d\n", box[0], box[1], box[2], box[3]);
-
-	return 0;
+	const float* rest[MATCH_FEATURES];
+	for (int d = 0; d < MATCH_FEATURES; d++) {
+		rest[d] = cols[d] + j;
+	}
+	distBlockScalar(rest, begin + j, n - j, q, db, best, found, k);
 }
 
+#endif
 
+typedef void (*DistBlockFunc)(const float* const* cols, int begin, int n, const float* q,
+	const FeatureDatabase& db, Neighbor* best, int& found, int k);
 
+//picks the distance kernel this cpu supports, checked once
+static DistBlockFunc distBlockFunc() {
 
-//Extension 3: Invariant Moments Calculation
-//calculates mu22 of the given region based on previously calculated moments
-int invarMoment(cv::Mat& src, int region, int* moments, double* mumoments) {
-
-	double cosB = cos(mumoments[4]);//constants for formula
-	double sinB = sin(mumoments[4]);
-
-	for (int i = 0; i < src.rows; i++) {
-
-		uchar* rptr = src.ptr<uchar>(i);
-
-		for (int j = 0; j < src.cols; j++) {
-
-			if (rptr[j] == region) {
-				//mu22 formula
-				mumoments[5] += (((i - moments[1]) * cosB) + ((j - moments[0]) * sinB))
-					* (((i - moments[1]) * cosB) + ((j - moments[0]) * sinB)); 
-
-			}
+	static const DistBlockFunc func = []() -> DistBlockFunc {
+#ifdef RECOG_X86
+		if (cv::checkHardwareSupport(CV_CPU_AVX2) && cv::checkHardwareSupport(CV_CPU_FMA3)) {
+			return distBlockAVX2;
 		}
-	}
-
-	//normalizing to number of pixels
-	double totalPix = 1 / static_cast<double>(moments[2]);
-	double temp = mumoments[5];
-	mumoments[5] = temp * totalPix;
+#endif
+		return distBlockScalar;
+	}();
 
+	return func;
+}
 
-	return 0;
 
-}
+//k closest database rows to each of m queries
+//the database is scaled by the inverse deviations one block at a time and every query runs over the block
+//before the next one, so the M x N distances are worked out without a pass over the database per query
+int nearestBatch(const double* queries, int m, const float* dev, const FeatureDatabase& db, int k, Neighbor* out) {
 
+	if (m < 0 || k < 1) {
+		return -1;
+	}
 
-//calculates mu20 mu02 and mu11 in order to get angle alpha
-int angleAlpha(cv::Mat& src,int region, int* moments, double* mumoments) {
-	
+	for (int i = 0; i < m * k; i++) {
+		out[i] = Neighbor();
+	}
 
-	for (int i = 0; i < src.rows; i++) {
+	const int D = MATCH_FEATURES;
 
-		uchar* rptr = src.ptr<uchar>(i);
+	//scaled match columns of the current block, aligned for whole vector loads
+	alignas(32) static thread_local float scaled[D][batchBlock];
+	static thread_local std::vector<int> found;
+	found.assign(m, 0);
 
-		for (int j = 0; j < src.cols; j++) {
+	const float* cols[D];
+	float inv[D];
+	for (int d = 0; d < D; d++) {
+		cols[d] = scaled[d];
+		inv[d] = 1.0f / dev[d];
+	}
+	DistBlockFunc distBlock = distBlockFunc();
 
-			if (rptr[j] == region) {
+	for (int begin = 0; begin < db.rows(); begin += batchBlock) {
 
-				mumoments[0] += (j - moments[0]) * (j - moments[0]); //mu20 (x)
-				mumoments[1] += (i - moments[1]) * (i - moments[1]); //mu02 (y)
-				mumoments[2] += (j - moments[0]) * (i - moments[1]); //mu11 (x and y)
+		int n = std::min(batchBlock, db.rows() - begin);
+		for (int d = 0; d < D; d++) {
+			const float* col = db.column(MatchFeatures::id(d)) + begin;
+			for (int j = 0; j < n; j++) {
+				scaled[d][j] = col[j] * inv[d];
+			}
+		}
 
+		for (int q = 0; q < m; q++) {
+			float qs[D];
+			for (int d = 0; d < D; d++) {
+				qs[d] = static_cast<float>(queries[q * FEAT_COUNT + MatchFeatures::id(d)]) * inv[d];
 			}
+			distBlock(cols, begin, n, qs, db, out + q * k, found[q], k);
 		}
 	}
 
-	//printf("pre-normalized m20 is %f, m02 is %f, m11 is %f\n", mumoments[0], mumoments[1], mumoments[2]);
-
-	double temp = 0;
-	double normal = 1 / static_cast<double>(moments[2]);
-	for (int x = 0; x < 3; x++) {
-		temp = mumoments[x];
-		mumoments[x] = temp * normal;
-	}
+	return 0;
+}
 
-	const double pi2 = 1.57079632679489661923;
-	double angle = 0.5 * atan(2 * mumoments[2] / (mumoments[0] - mumoments[1]));
-	mumoments[3] = angle;
-	mumoments[4] = angle + pi2;
 
-	//printf("m20 is %f, m02 is %f, m11 is %f, alpha angle is %f, beta is %f\n", mumoments[0], mumoments[1], mumoments[2], mumoments[3], mumoments[4]);
 
-	return 0;
 
-}
 
 
 
 //places red cross at center of central region ( takes color src )
 int objCenter(cv::Mat &src, int* moments) {
 
+	//cross is 5 pix wide so center has to be 2 pix away from every edge
+	if (moments[0] < 2 || moments[1] < 2 || moments[0] > src.cols - 3 || moments[1] > src.rows - 3) {
+		return -1;
+	}
+
 	cv::Vec3b* row = src.ptr<cv::Vec3b>(moments[1]);//ptr to row (y) of center
 	cv::Vec3b* top = src.ptr<cv::Vec3b>(moments[1] - 1); //above and below
 	cv::Vec3b* top2 = src.ptr<cv::Vec3b>(moments[1] - 2);
@@ -376,386 +417,1571 @@ int objCenter(cv::Mat &src, int* moments) {
 }
 
 
-//calculate raw moments for this region (M10 avg x, M01 avg y, M00 total pix)
-//accepts pointer to an 3 element int array
-int* rawMoments(cv::Mat& src, int region, int* moments) {
+static int regionShape(RegionStats& stats, const int* ends, int endsY);
 
-	//static int moments[3] = { 0 };
+//third order sums (m30, m21, m12, m03 and their central moments) are only accumulated
+//when a stored feature is worked out from them, otherwise they stay 0
+static constexpr bool thirdOrder = StoredFeatures::order() >= 3;
 
-	for (int i = 0; i < src.rows; i++) {
+//each derivation in regionShape is only done when a stored feature comes from it
+//the oriented box (and the row ends it is found from) only feeds fill and h/w ratio,
+//the angles feed mu22 and the box, and the second order central moments feed the angles
+static constexpr bool needBox = StoredFeatures::has(FEAT_FILL) || StoredFeatures::has(FEAT_RATIO);
+static constexpr bool needMu22 = StoredFeatures::has(FEAT_MU22);
+static constexpr bool needAngle = needBox || needMu22 || StoredFeatures::has(FEAT_ALPHA) || StoredFeatures::has(FEAT_BETA);
+static constexpr bool needCentral = needAngle || StoredFeatures::has(FEAT_MU20) || StoredFeatures::has(FEAT_MU02)
+	|| StoredFeatures::has(FEAT_MU11);
 
-		uchar* rptr = src.ptr<uchar>(i);
 
-		for (int j = 0; j < src.cols; j++) {
+//sums of x, x * x and x * x * x over x from start to end - 1
+//closed forms of the series 1 + 2 + ... + m, 1 + 4 + ... + m^2 and 1 + 8 + ... + m^3 taken at both ends,
+//so a run costs the same whatever its length
+static inline void runSums(int64_t start, int64_t end, int64_t& sx, int64_t& sxx, int64_t& sxxx) {
 
-			if (rptr[j] == region){
+	int64_t a = start - 1;
+	int64_t b = end - 1;
+	int64_t ta = a * (a + 1) / 2;
+	int64_t tb = b * (b + 1) / 2;
 
-				moments[0] += j; //summing all x values
-				moments[1] += i; //summing all y values
-				moments[2] += 1; //count of all pixels in region
-				
-			}
-		}
+	sx = tb - ta;
+	sxx = (b * (b + 1) * (2 * b + 1) - a * (a + 1) * (2 * a + 1)) / 6;
+	sxxx = thirdOrder ? tb * tb - ta * ta : 0;
+}
+
+
+//adds the run from start to end - 1 on row y to the raw moments and box in st
+//rowEnds is the row's first and last x, runs of a row come left to right so the first one sets the first x
+static inline void addRun(RegionStats& st, int* rowEnds, int y, int start, int end) {
+
+	int64_t sx, sxx, sxxx;
+	runSums(start, end, sx, sxx, sxxx);
+
+	//y terms are multiplied in once per run
+	int64_t n = end - start;
+	int64_t yy = y;
+	st.m00 += n;
+	st.m10 += sx;
+	st.m01 += yy * n;
+	st.m20 += sxx;
+	st.m11 += yy * sx;
+	st.m02 += yy * yy * n;
+	if constexpr (thirdOrder) {
+		st.m30 += sxxx;
+		st.m21 += yy * sxx;
+		st.m12 += yy * yy * sx;
+		st.m03 += yy * yy * yy * n;
 	}
 
-	int tempx = moments[0];
-	int tempy = moments[1];
-	moments[0] = tempx / moments[2]; //sets average x value
-	moments[1] = tempy / moments[2]; //sets average y value
+	if (rowEnds[0] < 0) {
+		rowEnds[0] = start;
+	}
+	rowEnds[1] = end - 1;
 
-	//printf("x center is %d, y center is %d and total pix is %d\n",moments[0],moments[1],moments[2]);
-	return moments;
+	st.box[0] = std::min(st.box[0], start);
+	st.box[1] = std::max(st.box[1], end - 1);
+	st.box[2] = std::min(st.box[2], y);
+	st.box[3] = y;
 }
 
 
+//Extension 3: single pass region statistics
+//accumulates raw moments, bounding box and each row's leftmost/rightmost pixel of region
+//over the given window of src, then derives central moments, angles, mu22 and the
+//oriented box (with its fill and h/w ratio) from them
+//returns -1 if region has no pixels
+static int regionStatsIn(cv::Mat& src, int region, cv::Rect area, RegionStats& stats) {
 
-//only iterate through central third of given Mat
-//to find majority region within center of image
-//returns the integer value given to that region in the region map
-int centralRegion(cv::Mat &src) {
-	int region = 0;
+	stats = RegionStats();
 
-	std::map<int, int> regCount; //stores pix quantity of each region found
+	int xmin = src.cols;
+	int xmax = -1;
+	int ymin = src.rows;
+	int ymax = -1;
 
-	//only iterate through central third of given Mat
-	//to find majority region in this zone
-	int rstart = src.rows / 3;
-	int rend = src.rows - (src.rows / 3);
-	int cstart = src.cols / 3;
-	int cend = src.cols - (src.cols / 3);
+	//first and last x of region on each row of the window (-1 for none), kept per thread
+	static thread_local std::vector<int> ends;
+	if constexpr (needBox) {
+		ends.assign(2 * static_cast<size_t>(area.height), -1);
+	}
 
-	for (int i = rstart; i < rend; i++) {
+	for (int i = area.y; i < area.y + area.height; i++) {
 
-		uchar* rptr = src.ptr<uchar>(i);
+		int* rptr = src.ptr<int>(i);
 
-		for (int j = cstart; j < cend; j++) {
+		//sums for this row only, y terms are multiplied in once per row
+		int64_t n = 0;
+		int64_t sx = 0;
+		int64_t sxx = 0;
+		int64_t sxxx = 0;
+		int first = -1;
+		int last = -1;
 
-			if (rptr[j] != 0) {
+		for (int j = area.x; j < area.x + area.width; j++) {
 
-				regCount[rptr[j]] += 1; //add this value to map structure and increment
+			if (rptr[j] == region) {
+				int64_t x = j;
+				n += 1;
+				sx += x;
+				sxx += x * x;
+				if constexpr (thirdOrder) {
+					sxxx += x * x * x;
+				}
+				if (first < 0) {
+					first = j;
+				}
+				last = j;
 			}
+		}
 
+		if (n == 0) {
+			continue;
 		}
-	}
 
-	//iterate through all region counts to find max
-	int maxReg = 0;
-	for (const auto& x : regCount) {
-		//printf("Region %d has %d pixels\n", x.first, x.second);
-		if (x.second > maxReg){
-			maxReg = x.second;
-			region = x.first;
+		if constexpr (needBox) {
+			ends[2 * (i - area.y)] = first;
+			ends[2 * (i - area.y) + 1] = last;
+		}
+
+		int64_t y = i;
+		stats.m00 += n;
+		stats.m10 += sx;
+		stats.m01 += y * n;
+		stats.m20 += sxx;
+		stats.m11 += y * sx;
+		stats.m02 += y * y * n;
+		if constexpr (thirdOrder) {
+			stats.m30 += sxxx;
+			stats.m21 += y * sxx;
+			stats.m12 += y * y * sx;
+			stats.m03 += y * y * y * n;
 		}
+
+		xmin = std::min(xmin, first);
+		xmax = std::max(xmax, last);
+		ymin = std::min(ymin, i);
+		ymax = i;
 	}
 
+	if (stats.m00 == 0) {
+		return -1;
+	}
 
-	return region;
+	stats.box[0] = xmin;
+	stats.box[1] = xmax;
+	stats.box[2] = ymin;
+	stats.box[3] = ymax;
+
+	return regionShape(stats, ends.data(), area.y);
 }
 
 
+//derives central moments, angles, mu22 and the oriented box (with its fill and h/w ratio)
+//from the raw moments and box in stats, skipping whatever no stored feature needs
+//ends holds the first and last x of the region on each row from endsY on (-1 for none)
+static int regionShape(RegionStats& stats, const int* ends, int endsY) {
+
+	int ymin = stats.box[2];
+	int ymax = stats.box[3];
+
+	//normalized raw moments
+	double n = static_cast<double>(stats.m00);
+	double cx = stats.m10 / n;
+	double cy = stats.m01 / n;
+	double m20 = stats.m20 / n;
+	double m02 = stats.m02 / n;
+	double m11 = stats.m11 / n;
+	stats.cx = cx;
+	stats.cy = cy;
+
+	//central moments from raw moments
+	if constexpr (needCentral) {
+		stats.mu20 = m20 - cx * cx;
+		stats.mu02 = m02 - cy * cy;
+		stats.mu11 = m11 - cx * cy;
+	}
+	if constexpr (thirdOrder) {
+		stats.mu30 = stats.m30 / n - 3 * cx * m20 + 2 * cx * cx * cx;
+		stats.mu21 = stats.m21 / n - 2 * cx * m11 - cy * m20 + 2 * cx * cx * cy;
+		stats.mu12 = stats.m12 / n - 2 * cy * m11 - cx * m02 + 2 * cx * cy * cy;
+		stats.mu03 = stats.m03 / n - 3 * cy * m02 + 2 * cy * cy * cy;
+	}
 
-//creates a color coded image from connected region map 
-int regColor(cv::Mat& src, cv::Mat& dst, int regCount) {
+	//the mu are already divided by n, so the scale normalized third order moments are mu / n^(3/2)
+	if constexpr (StoredFeatures::has(FEAT_HU3)) {
+		double s = 1.0 / (n * sqrt(n));
+		double a = (stats.mu30 - 3 * stats.mu12) * s;
+		double b = (3 * stats.mu21 - stats.mu03) * s;
+		stats.hu3 = a * a + b * b;
+	}
 
-	dst = cv::Mat::zeros(src.rows, src.cols, CV_8UC3);
+	if constexpr (!needAngle) {
+		return 0;
+	}
 
-	//map to store color values
-	std::map<int, std::tuple<int, int, int>> color;
-	//assigning as many random values as regions
-	for (int x = 0; x < regCount; x++) {
+	const double pi2 = 1.57079632679489661923;
+	stats.alpha = 0.5 * atan(2 * stats.mu11 / (stats.mu20 - stats.mu02));
+	stats.beta = stats.alpha + pi2;
+
+	//mu22 is the second moment about the beta axis, which expands to
+	//cos^2 mu02 + 2 sin cos mu11 + sin^2 mu20
+	double cosB = cos(stats.beta);
+	double sinB = sin(stats.beta);
+	if constexpr (needMu22) {
+		stats.mu22 = cosB * cosB * stats.mu02 + 2 * sinB * cosB * stats.mu11 + sinB * sinB * stats.mu20;
+	}
 
-		int b = (255 / regCount) * x;
-		int g = 255 - (255 / regCount) * x;
-		int r = rand() % 255;
-		color[x] = std::make_tuple(b, g, r);
+	if constexpr (!needBox) {
+		return 0;
+	}
 
+	//oriented box: every pixel is projected onto the beta axis (u) and the axis across it (v)
+	//this is the same frame the image would be in after rotating by beta around the centroid
+	//both projections are linear along a row, so each row's extremes are at its end pixels
+	double umin = 1e30, umax = -1e30, vmin = 1e30, vmax = -1e30;
+	for (int i = ymin; i <= ymax; i++) {
 
-		//printf("color for region %d is %d\n", x, color[x]);
+		int first = ends[2 * (i - endsY)];
+		if (first < 0) {
+			continue;
+		}
+		int last = ends[2 * (i - endsY) + 1];
+
+		double dy = i - cy;
+		double dx[2] = { first - cx, last - cx };
+		for (int x = 0; x < 2; x++) {
+			double u = cosB * dx[x] + sinB * dy;
+			double v = -sinB * dx[x] + cosB * dy;
+			umin = std::min(umin, u);
+			umax = std::max(umax, u);
+			vmin = std::min(vmin, v);
+			vmax = std::max(vmax, v);
+		}
 	}
-	
-
-	for (int i = 0; i < src.rows; i++) {
 
-		uchar* rptr = src.ptr<uchar>(i);
-		cv::Vec3b* dptr = dst.ptr<cv::Vec3b>(i);
+	stats.obb[0] = umin;
+	stats.obb[1] = umax;
+	stats.obb[2] = vmin;
+	stats.obb[3] = vmax;
 
-		for (int j = 0; j < src.cols; j++) {
+	//every region pixel is inside its own box so fill is just area over box area
+	double width = umax - umin;
+	double height = vmax - vmin;
+	stats.fill = n / ((width + 1) * (height + 1));
 
-			if (rptr[j] == 0) {
-				dptr[j][0] = 255;
-				dptr[j][1] = 255;
-				dptr[j][2] = 255;
-			}
-			else { //otherwise set destination color to map value for this region
-				int value = static_cast<int>(rptr[j]);
-				dptr[j][0] = std::get<0>(color[value]);
-				dptr[j][1] = std::get<1>(color[value]);
-				dptr[j][2] = std::get<2>(color[value]);
-			}
-		}
+	//this h/w ratio calculation always divides by longer dimension
+	if (width > height) {
+		stats.ratio = height / width;
+	}
+	else {
+		stats.ratio = width / height;
 	}
 
 	return 0;
 }
 
 
+//calculates stats for region by scanning the whole region map
+int regionStats(cv::Mat& src, int region, RegionStats& stats) {
 
+	return regionStatsIn(src, region, cv::Rect(0, 0, src.cols, src.rows), stats);
+}
 
-//Extension 2: Region Growing Function
-//fills destination mat with 0s for background and #s to indicate 
-//connected regions for foreground pixels
-//returns number of regions counted
-int regions(cv::Mat& src, cv::Mat&dst) {
 
-	dst = cv::Mat::zeros(src.size(), CV_8UC1);
+//calculates stats for region by scanning only the box stored in its table entry
+int regionStats(cv::Mat& src, int region, RegionInfo& info, RegionStats& stats) {
 
-	//stack is vector of tuples. Each one holds row/col coordinates
-	std::vector<std::tuple<int, int>> stack; 
-	std::tuple<int, int> pixel;
+	if (info.area == 0) {
+		stats = RegionStats();
+		return -1;
+	}
 
-	int region = 1; //init region IDs
+	cv::Rect area(info.box[0], info.box[2], info.box[1] - info.box[0] + 1, info.box[3] - info.box[2] + 1);
+	return regionStatsIn(src, region, area, stats);
+}
 
-	//loop looking for 'seed' pixels
-	for (int i = 0; i < src.rows; i++) {
 
-		uchar* rptr = src.ptr<uchar>(i);
-		uchar* dptr = dst.ptr<uchar>(i);
+//calculates stats for region from its runs on the rows of the box in its table entry
+int regionStats(RunImage& runs, int region, RegionInfo& info, RegionStats& stats) {
 
-		for (int j = 0; j < src.cols; j++) {
+	stats = RegionStats();
+	if (info.area == 0) {
+		return -1;
+	}
 
-			//if this pixel is in fg and region unassigned
-			if ((rptr[j] == 0) && (dptr[j] == 0)) {
-				dptr[j] = region;
-				
-				//make tuple from coords
-				std::tuple<int, int> temp;
-				temp = std::make_tuple(i, j);
-				stack.push_back(temp); //add it to stack
-
-				while (stack.size() > 0) { //scan region until complete
-					//pop last-in pixel
-					pixel = stack.back();
-					stack.pop_back();
-					//getting coordinates from tuple
-					int x = std::get<0>(pixel);
-					int y = std::get<1>(pixel);
-
-					//pointers for checking src and dest neighbors
-					uchar* rptr2 = src.ptr<uchar>(x);
-					uchar* dptr2 = dst.ptr<uchar>(x);
-					uchar* rtptr2 = src.ptr<uchar>(x-1);
-					uchar* dtptr2 = dst.ptr<uchar>(x-1);
-					uchar* rbptr2 = src.ptr<uchar>(x+1);
-					uchar* dbptr2 = dst.ptr<uchar>(x+1);
-
-					//check boundary before each neighbor check
-					if (y != 0) {//left
-						
-						//each neighbor needs to be in foreground and region unlabelled
-
-						if ((rptr2[y - 1] == 0) && (dptr2[y - 1] == 0)) {
-							//printf("then got to comparison\n");
-							dptr2[y - 1] = region;
-							stack.push_back({ x, y - 1});
-						}
-					}
-					if (y != src.cols - 1) { //right
+	//box is worked out again from the runs, like from the pixels
+	cv::Size size = runs.size();
+	stats.box[0] = size.width;
+	stats.box[1] = -1;
+	stats.box[2] = size.height;
+	stats.box[3] = -1;
 
-						if ((rptr2[y + 1] == 0) && (dptr2[y + 1] == 0)) {
-							dptr2[y + 1] = region;
-							stack.push_back({ x, y + 1 });
-						}
-					}
-					if (x != 0) { //top
+	//first and last x of region on each row of the box (-1 for none), kept per thread
+	static thread_local std::vector<int> ends;
+	ends.assign(2 * static_cast<size_t>(info.box[3] - info.box[2] + 1), -1);
 
-						if ((rtptr2[y] == 0) && (dtptr2[y] == 0)) {
-							dtptr2[y] = region;
-							stack.push_back({ x - 1, y});
-						}
-					}
-					if (x != src.rows - 1) { //bottom
+	for (int i = info.box[2]; i <= info.box[3]; i++) {
 
-						if ((rbptr2[y] == 0) && (dbptr2[y] == 0)) {
-							dbptr2[y] = region;
-							stack.push_back({ x + 1, y  });
-						}
-					}
-				}
-				region++;
+		const Run* row = runs.row(i);
+		int n = runs.rowRuns(i);
+
+		for (int k = 0; k < n; k++) {
+			if (row[k].label == region) {
+				addRun(stats, &ends[2 * (i - info.box[2])], i, row[k].start, row[k].end);
 			}
 		}
 	}
 
-	//printf("ended with %d regions\n", region);
+	if (stats.m00 == 0) {
+		stats = RegionStats();
+		return -1;
+	}
 
-	return region;
+	return regionShape(stats, ends.data(), info.box[2]);
 }
 
 
+//labels of regions worth classifying, largest first
+int selectRegions(cv::Size size, std::vector<RegionInfo>& table, const RegionFilter& filter, std::vector<int>& selected) {
 
-//Extension 1: Dilation function from scratch
-//grows pixels with 8-connected pattern
-int dilate(cv::Mat& src, cv::Mat& dst) {
-
-	//fills destination with white pixels
-	dst = cv::Mat::ones(src.size(), CV_8UC1)*255;
-
+	selected.clear();
 
-	for (int i = 0; i < src.rows; i++) {
+	for (int x = 1; x < static_cast<int>(table.size()); x++) {
 
-		uchar* rptr = src.ptr<uchar>(i); //source pointer
-		uchar* dptr = dst.ptr<uchar>(i); //destination pointer
-		uchar* tptr = src.ptr<uchar>(i);
-		uchar* bptr = src.ptr<uchar>(i);
-		uchar* dtptr = dst.ptr<uchar>(i);
-		uchar* dbptr = dst.ptr<uchar>(i);
-		if (i > 0) { //only get these pointers if they're valid locations
-			tptr = src.ptr<uchar>(i-1);//src row above
-			uchar* dtptr = dst.ptr<uchar>(i-1); //destination row above
+		RegionInfo& info = table[x];
+		if (info.area == 0 || info.area < filter.minArea) {
+			continue;
 		}
-		if (i < src.rows - 1) {
-			bptr = src.ptr<uchar>(i+1);//src row below
-			uchar* dbptr = dst.ptr<uchar>(i+1); //destination row below
+		//parts cut off by the frame edge would get the wrong shape features
+		if (filter.dropBorder && (info.box[0] == 0 || info.box[2] == 0 || info.box[1] == size.width - 1 || info.box[3] == size.height - 1)) {
+			continue;
 		}
-		
-
-		for (int j = 0; j < src.cols; j++) {
+		selected.push_back(x);
+	}
 
-			//don't need to operate on src background pixels
-			if (rptr[j] == 255) {  //if already filled, ignore
+	std::sort(selected.begin(), selected.end(), [&table](int a, int b) {
+		return table[a].area > table[b].area || (table[a].area == table[b].area && a < b);
+	});
+	if (filter.maxRegions > 0 && static_cast<int>(selected.size()) > filter.maxRegions) {
+		selected.resize(filter.maxRegions);
+	}
 
-			}
-			//dilating every black pixel from here on
-			else if (j == 0) { //left edge
+	return static_cast<int>(selected.size());
+}
 
-				dtptr[j] = 0;
-				dtptr[j + 1] = 0;
-				dptr[j + 1] = 0;
-				dbptr[j] = 0;
-				dbptr[j + 1] = 0;
-			}
-			else if (j == src.cols - 1) { //right edge
-				dtptr[j - 1] = 0;
-				dtptr[j] = 0;
-				dptr[j - 1] = 0;
-				dbptr[j - 1] = 0;
-				dbptr[j] = 0;
 
-			}
-			else { //assign 8 surrounding pixels
+//regionStatsAll's setup: stats for every region in regions, with boxes emptied so they're worked out again
+//from the pixels like regionStats does, the slot of each label in regions (-1 if not wanted) and where
+//its row ends start in ends
+//span gets the x and y range the wanted regions' boxes cover (x start, x end, y start, y end)
+static void statSlots(cv::Size size, std::vector<RegionInfo>& table, const std::vector<int>& regions, std::vector<RegionStats>& stats,
+	std::vector<int>& slot, std::vector<int>& endsStart, std::vector<int>& ends, int* span) {
 
+	stats.assign(regions.size(), RegionStats());
+	slot.assign(table.size(), -1);
+	endsStart.resize(regions.size());
 
-				dtptr[j - 1] = 0;
-				dtptr[j] = 0;
-				dtptr[j + 1] = 0;
-				dptr[j - 1] = 0;
-				dptr[j + 1] = 0;
-				dbptr[j - 1] = 0;
-				dbptr[j] = 0;
-				dbptr[j + 1] = 0;
+	int total = 0;
+	span[0] = size.width;
+	span[1] = -1;
+	span[2] = size.height;
+	span[3] = -1;
+	for (int r = 0; r < static_cast<int>(regions.size()); r++) {
 
-			}
+		RegionInfo& info = table[regions[r]];
+		if (info.area == 0) {
+			continue;
 		}
+		slot[regions[r]] = r;
+		endsStart[r] = total;
+		total += 2 * (info.box[3] - info.box[2] + 1);
+		span[0] = std::min(span[0], info.box[0]);
+		span[1] = std::max(span[1], info.box[1]);
+		span[2] = std::min(span[2], info.box[2]);
+		span[3] = std::max(span[3], info.box[3]);
+
+		stats[r].box[0] = size.width;
+		stats[r].box[1] = -1;
+		stats[r].box[2] = size.height;
+		stats[r].box[3] = -1;
 	}
-
-	return 0;
+	ends.assign(total, -1);
 }
 
 
+//regionStatsAll's last step, the shape of every region from its sums and row ends
+static void statShapes(std::vector<RegionInfo>& table, const std::vector<int>& regions, std::vector<RegionStats>& stats,
+	std::vector<int>& slot, std::vector<int>& endsStart, std::vector<int>& ends) {
 
-//Extension 1: Grassfire Algorithm
-//grassfire algorithm to calculate distances from background for each pixel
-//fills out a matrix of int values with manhattan dist of each pix to background
-int grassfire(cv::Mat& src, cv::Mat& distance) {
+	for (int r = 0; r < static_cast<int>(regions.size()); r++) {
+		if (slot[regions[r]] == r && stats[r].m00 > 0) {
+			regionShape(stats[r], &ends[endsStart[r]], table[regions[r]].box[2]);
+		}
+		else {
+			stats[r] = RegionStats();
+		}
+	}
+}
 
-	//everything starts with distance 0
-	distance = cv::Mat::zeros(src.size(), CV_8UC1);
 
-	std::vector<std::vector<int>> dist(src.rows, std::vector<int>(src.cols,0)); //zeroing a vector of ints the same size as src image
+//stats for every region in regions from one pass over the part of the map their boxes cover
+//each row is walked as runs of equal labels, so a pixel is read once whatever the number of regions
+int regionStatsAll(cv::Mat& src, std::vector<RegionInfo>& table, const std::vector<int>& regions, std::vector<RegionStats>& stats) {
 
-	int countbg = 0;
-	int countfg = 0;
-	//first pass of grassfire algo
-	for (int i = 0; i < src.rows; i++) {
+	//kept per thread
+	static thread_local std::vector<int> slot;
+	static thread_local std::vector<int> endsStart;
+	static thread_local std::vector<int> ends;
+	int span[4];
+	statSlots(src.size(), table, regions, stats, slot, endsStart, ends, span);
 
-		uchar* rptr = src.ptr<uchar>(i);  //row pointer for binary src image
-		//uchar* dptr = distance.ptr<uchar>(i);  //row pointer for distance matrix
-		//uchar* dptr2 = distance.ptr<uchar>(i);  //row pointer for distance matrix
+	int labelCount = static_cast<int>(table.size());
 
+	for (int i = span[2]; i <= span[3]; i++) {
 
-		for (int j = 0; j < src.cols; j++) {
+		int* rptr = src.ptr<int>(i);
+		int j = span[0];
 
-			if (rptr[j] == 255) {  //keep bg values as 0
-				//dptr[j] = 0;
-				dist[i][j] = 0;
-				countbg++;
+		while (j <= span[1]) {
+
+			int label = rptr[j];
+			int first = j;
+			while (j <= span[1] && rptr[j] == label) {
+				j++;
 			}
-			else { //otherwise use minimum of up or left pixels + 1
-				if (i == 0) { //first row gets all 1s for foreground
-					//dptr[j] = 1;
-					dist[i][j] = 1;
-				}
-				else if (j == 0) { //first col gets all 1s for foreground
-					//dptr[j] = 1;
-					dist[i][j] = 1;
-				}
-				
-				else {
-					countfg++;
-					if (dist[i][j - 1] > dist[i-1][j]) {
-						dist[i][j] = dist[i-1][j] + 1;
-						
-					}
-					else {
-						dist[i][j] = dist[i][j-1] + 1;
-						
-					}
 
-				}
+			if (label <= 0 || label >= labelCount || slot[label] < 0) {
+				continue;
 			}
+
+			int r = slot[label];
+			addRun(stats[r], &ends[endsStart[r] + 2 * (i - table[label].box[2])], i, first, j);
 		}
 	}
-	
-	//2nd pass starts from bottom right to top left
-	for (int i = distance.rows - 1; i >= 0; i--) {
 
+	statShapes(table, regions, stats, slot, endsStart, ends);
 
-		uchar* dptr = distance.ptr<uchar>(i);  //row pointer for distance matrix
+	return 0;
+}
 
-		for (int j = distance.cols - 1; j >= 0; j--) {
-			
-			if (dist[i][j] != 0) {  //for all foreground pixels
-				//right and bottom edge cases
-				if ((j == distance.cols - 1) || (i == distance.rows - 1)) {
-					dist[i][j] = 1;
-				}
-				else {
 
-					//if up neighbors + 1 are min and less than current value
-					if ((dist[i][j + 1] > dist[i + 1][j]) && (dist[i + 1][j] + 1 < dist[i][j])) {
-						dist[i][j] = dist[i + 1][j] + 1;
-					}
-					//if right neighbors +1 are min and less than current value
-					else if (dist[i][j + 1] + 1 < dist[i][j]) {
-						dist[i][j] = dist[i][j + 1] + 1;
-					}
-				}
+//same from the runs of the rows the boxes cover, so the cost is the number of runs and not of pixels
+int regionStatsAll(RunImage& runs, std::vector<RegionInfo>& table, const std::vector<int>& regions, std::vector<RegionStats>& stats) {
 
-			}
+	static thread_local std::vector<int> slot;
+	static thread_local std::vector<int> endsStart;
+	static thread_local std::vector<int> ends;
+	int span[4];
+	statSlots(runs.size(), table, regions, stats, slot, endsStart, ends, span);
 
-			//copying result to mat format
-			if (dist[i][j] > 255) {
-				dptr[j] = 255;
-			}
-			else {
-				dptr[j] = dist[i][j];
+	int labelCount = static_cast<int>(table.size());
+
+	for (int i = span[2]; i <= span[3]; i++) {
+
+		const Run* row = runs.row(i);
+		int n = runs.rowRuns(i);
+
+		for (int k = 0; k < n; k++) {
+
+			int label = row[k].label;
+			if (label <= 0 || label >= labelCount || slot[label] < 0) {
+				continue;
+			}
+
+			int r = slot[label];
+			addRun(stats[r], &ends[endsStart[r] + 2 * (i - table[label].box[2])], i, row[k].start, row[k].end);
+		}
+	}
+
+	statShapes(table, regions, stats, slot, endsStart, ends);
+
+	return 0;
+}
+
+
+//moves stats into the coordinates of the image the window at (dx, dy) was taken from
+//raw sums are expanded with x -> x + dx and y -> y + dy so they match a scan of the whole image
+int shiftStats(RegionStats& stats, int dx, int dy) {
+
+	if (stats.m00 == 0) {
+		return -1;
+	}
+
+	RegionStats s = stats;
+	int64_t x = dx;
+	int64_t y = dy;
+
+	stats.m10 = s.m10 + x * s.m00;
+	stats.m01 = s.m01 + y * s.m00;
+	stats.m20 = s.m20 + 2 * x * s.m10 + x * x * s.m00;
+	stats.m02 = s.m02 + 2 * y * s.m01 + y * y * s.m00;
+	stats.m11 = s.m11 + x * s.m01 + y * s.m10 + x * y * s.m00;
+	if constexpr (thirdOrder) {
+		stats.m30 = s.m30 + 3 * x * s.m20 + 3 * x * x * s.m10 + x * x * x * s.m00;
+		stats.m03 = s.m03 + 3 * y * s.m02 + 3 * y * y * s.m01 + y * y * y * s.m00;
+		stats.m21 = s.m21 + y * s.m20 + 2 * x * s.m11 + 2 * x * y * s.m10 + x * x * s.m01 + x * x * y * s.m00;
+		stats.m12 = s.m12 + x * s.m02 + 2 * y * s.m11 + 2 * x * y * s.m01 + y * y * s.m10 + x * y * y * s.m00;
+	}
+
+	stats.cx = s.cx + dx;
+	stats.cy = s.cy + dy;
+
+	stats.box[0] += dx;
+	stats.box[1] += dx;
+	stats.box[2] += dy;
+	stats.box[3] += dy;
+
+	return 0;
+}
+
+
+//label in labels, a window of a frame whose top left corner is at offset, with the most pixels under region in small,
+//a label map of the same frame shrunk by factor
+int overlapRegion(cv::Mat& labels, int labelCount, cv::Mat& small, int region, int factor, cv::Point offset) {
+
+	//pixels of each label under region, kept per thread
+	static thread_local std::vector<int> count;
+	count.assign(labelCount, 0);
+
+	for (int i = 0; i < labels.rows; i++) {
+
+		const int* sptr = small.ptr<int>(std::min((i + offset.y) / factor, small.rows - 1));
+		const int* lptr = labels.ptr<int>(i);
+
+		for (int j = 0; j < labels.cols; j++) {
+			int label = lptr[j];
+			if (label > 0 && label < labelCount && sptr[std::min((j + offset.x) / factor, small.cols - 1)] == region) {
+				count[label]++;
+			}
+		}
+	}
+
+	int best = 0;
+	for (int x = 1; x < labelCount; x++) {
+		if (count[x] > count[best]) {
+			best = x;
+		}
+	}
+
+	return best;
+}
+
+
+//same on runs, each run of labels is intersected with the runs of region on the shrunk row under it
+//a shrunk run covers factor full resolution pixels per pixel, and the last column also covers
+//whatever the shrinking cropped off the right edge
+int overlapRegion(RunImage& labels, int labelCount, RunImage& small, int region, int factor, cv::Point offset) {
+
+	static thread_local std::vector<int> count;
+	count.assign(labelCount, 0);
+
+	cv::Size size = labels.size();
+	int smallCols = small.size().width;
+	int smallRows = small.size().height;
+
+	for (int i = 0; i < size.height; i++) {
+
+		int sy = std::min((i + offset.y) / factor, smallRows - 1);
+		const Run* srow = small.row(sy);
+		int sn = small.rowRuns(sy);
+		const Run* row = labels.row(i);
+		int n = labels.rowRuns(i);
+
+		for (int s = 0; s < sn; s++) {
+
+			if (srow[s].label != region) {
+				continue;
+			}
+
+			//the shrunk run in this window's x
+			int x0 = srow[s].start * factor - offset.x;
+			int x1 = (srow[s].end == smallCols) ? size.width : srow[s].end * factor - offset.x;
+
+			for (int k = 0; k < n; k++) {
+				int label = row[k].label;
+				int inside = std::min(row[k].end, x1) - std::max(row[k].start, x0);
+				if (inside > 0 && label > 0 && label < labelCount) {
+					count[label] += inside;
+				}
+			}
+		}
+	}
+
+	int best = 0;
+	for (int x = 1; x < labelCount; x++) {
+		if (count[x] > count[best]) {
+			best = x;
+		}
+	}
+
+	return best;
+}
+
+
+//gets the 4 corners of the oriented box in image coordinates, in drawing order
+int obbCorners(RegionStats& stats, cv::Point* corners) {
+
+	double cosB = cos(stats.beta);
+	double sinB = sin(stats.beta);
+
+	//box corners in (u, v), rotated back by beta
+	double u[4] = { stats.obb[0], stats.obb[1], stats.obb[1], stats.obb[0] };
+	double v[4] = { stats.obb[2], stats.obb[2], stats.obb[3], stats.obb[3] };
+
+	for (int x = 0; x < 4; x++) {
+		corners[x].x = cvRound(stats.cx + cosB * u[x] - sinB * v[x]);
+		corners[x].y = cvRound(stats.cy + sinB * u[x] + cosB * v[x]);
+	}
+
+	return 0;
+}
+
+
+//copies stats into the int center/count array used for drawing (x, y, total pix)
+//and the feature vector, one value per Feature (featureset.h), 0 for the ones that aren't stored
+int statFeatures(RegionStats& stats, int* moments, double* mu) {
+
+	moments[0] = static_cast<int>(stats.cx);
+	moments[1] = static_cast<int>(stats.cy);
+	moments[2] = static_cast<int>(stats.m00);
+
+	mu[FEAT_MU20] = stats.mu20;
+	mu[FEAT_MU02] = stats.mu02;
+	mu[FEAT_MU11] = stats.mu11;
+	mu[FEAT_ALPHA] = stats.alpha;
+	mu[FEAT_BETA] = stats.beta;
+	mu[FEAT_MU22] = stats.mu22;
+	mu[FEAT_FILL] = stats.fill;
+	mu[FEAT_RATIO] = stats.ratio;
+	mu[FEAT_HU3] = stats.hu3;
+
+	return 0;
+}
+
+
+
+//only iterate through central third of given Mat
+//to find majority region within center of image
+//returns the integer value given to that region in the region map
+int centralRegion(cv::Mat &src) {
+	int region = 0;
+
+	std::map<int, int> regCount; //stores pix quantity of each region found
+
+	//only iterate through central third of given Mat
+	//to find majority region in this zone
+	int rstart = src.rows / 3;
+	int rend = src.rows - (src.rows / 3);
+	int cstart = src.cols / 3;
+	int cend = src.cols - (src.cols / 3);
+
+	for (int i = rstart; i < rend; i++) {
+
+		int* rptr = src.ptr<int>(i);
+
+		for (int j = cstart; j < cend; j++) {
+
+			if (rptr[j] != 0) {
+
+				regCount[rptr[j]] += 1; //add this value to map structure and increment
+			}
+
+		}
+	}
+
+	//iterate through all region counts to find max
+	int maxReg = 0;
+	for (const auto& x : regCount) {
+		//printf("Region %d has %d pixels\n", x.first, x.second);
+		if (x.second > maxReg){
+			maxReg = x.second;
+			region = x.first;
+		}
+	}
+
+
+	return region;
+}
+
+
+//same as above, but uses the region table so that only regions whose box
+//crosses the edge of the central third need their pixels counted
+int centralRegion(cv::Mat& src, std::vector<RegionInfo>& table) {
+
+	int rstart = src.rows / 3;
+	int rend = src.rows - (src.rows / 3);
+	int cstart = src.cols / 3;
+	int cend = src.cols - (src.cols / 3);
+
+	//kept per thread so a frame doesn't allocate once they've grown
+	static thread_local std::vector<int> regCount;
+	static thread_local std::vector<char> partial;
+	regCount.assign(table.size(), 0);
+	partial.assign(table.size(), 0);
+	bool scan = false;
+
+	for (int x = 1; x < static_cast<int>(table.size()); x++) {
+
+		int* box = table[x].box;
+
+		if (table[x].area == 0 || box[1] < cstart || box[0] >= cend || box[3] < rstart || box[2] >= rend) {
+			continue; //no pixels in the central third
+		}
+
+		if (box[0] >= cstart && box[1] < cend && box[2] >= rstart && box[3] < rend) {
+			regCount[x] = table[x].area; //whole region is inside
+		}
+		else {
+			partial[x] = 1;
+			scan = true;
+		}
+	}
+
+	//count pixels only for regions that straddle the edge
+	if (scan) {
+		for (int i = rstart; i < rend; i++) {
+
+			int* rptr = src.ptr<int>(i);
+
+			for (int j = cstart; j < cend; j++) {
+
+				if (partial[rptr[j]]) {
+					regCount[rptr[j]] += 1;
+				}
+			}
+		}
+	}
+
+	int region = 0;
+	int maxReg = 0;
+	for (int x = 1; x < static_cast<int>(regCount.size()); x++) {
+		if (regCount[x] > maxReg) {
+			maxReg = regCount[x];
+			region = x;
+		}
+	}
+
+	return region;
+}
+
+
+//same as above, regions that straddle the edge get the part of each run inside the central third
+int centralRegion(RunImage& runs, std::vector<RegionInfo>& table) {
+
+	cv::Size size = runs.size();
+	int rstart = size.height / 3;
+	int rend = size.height - (size.height / 3);
+	int cstart = size.width / 3;
+	int cend = size.width - (size.width / 3);
+
+	static thread_local std::vector<int> regCount;
+	static thread_local std::vector<char> partial;
+	regCount.assign(table.size(), 0);
+	partial.assign(table.size(), 0);
+	bool scan = false;
+
+	for (int x = 1; x < static_cast<int>(table.size()); x++) {
+
+		int* box = table[x].box;
+
+		if (table[x].area == 0 || box[1] < cstart || box[0] >= cend || box[3] < rstart || box[2] >= rend) {
+			continue;
+		}
+
+		if (box[0] >= cstart && box[1] < cend && box[2] >= rstart && box[3] < rend) {
+			regCount[x] = table[x].area;
+		}
+		else {
+			partial[x] = 1;
+			scan = true;
+		}
+	}
+
+	if (scan) {
+		for (int i = rstart; i < rend; i++) {
+
+			const Run* row = runs.row(i);
+			int n = runs.rowRuns(i);
+
+			for (int k = 0; k < n; k++) {
+				int inside = std::min(row[k].end, cend) - std::max(row[k].start, cstart);
+				if (inside > 0 && partial[row[k].label]) {
+					regCount[row[k].label] += inside;
+				}
+			}
+		}
+	}
+
+	int region = 0;
+	int maxReg = 0;
+	for (int x = 1; x < static_cast<int>(regCount.size()); x++) {
+		if (regCount[x] > maxReg) {
+			maxReg = regCount[x];
+			region = x;
+		}
+	}
+
+	return region;
+}
+
+
+
+//creates a color coded image from connected region map 
+int regColor(cv::Mat& src, cv::Mat& dst, int regCount) {
+
+	//every pixel is written below, so dst is only allocated when its size changes
+	dst.create(src.rows, src.cols, CV_8UC3);
+
+	//color values indexed by region, kept per thread
+	static thread_local std::vector<cv::Vec3b> color;
+	color.resize(std::max(regCount, 1));
+	//assigning as many random values as regions
+	for (int x = 0; x < regCount; x++) {
+
+		int b = (255 / regCount) * x;
+		int g = 255 - (255 / regCount) * x;
+		int r = rand() % 255;
+		color[x][0] = static_cast<uchar>(b);
+		color[x][1] = static_cast<uchar>(g);
+		color[x][2] = static_cast<uchar>(r);
+
+
+		//printf("color for region %d is %d\n", x, color[x]);
+	}
+	
+
+	for (int i = 0; i < src.rows; i++) {
+
+		int* rptr = src.ptr<int>(i);
+		cv::Vec3b* dptr = dst.ptr<cv::Vec3b>(i);
+
+		for (int j = 0; j < src.cols; j++) {
+
+			if (rptr[j] == 0) {
+				dptr[j][0] = 255;
+				dptr[j][1] = 255;
+				dptr[j][2] = 255;
+			}
+			else if (rptr[j] < regCount) { //otherwise set destination color to the value for this region
+				dptr[j] = color[rptr[j]];
+			}
+			else {
+				dptr[j][0] = 0;
+				dptr[j][1] = 0;
+				dptr[j][2] = 0;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+
+
+//union-find helpers for region labelling
+//a parent always has a smaller label than its child, so roots are the
+//lowest label in their set and labels can be resolved in one forward sweep
+static int findRoot(int* parent, int x) {
+
+	while (parent[x] != x) {
+		parent[x] = parent[parent[x]]; //path halving
+		x = parent[x];
+	}
+	return x;
+}
+
+static int unite(int* parent, int a, int b) {
+
+	a = findRoot(parent, a);
+	b = findRoot(parent, b);
+
+	if (a < b) {
+		parent[b] = a;
+		return a;
+	}
+	parent[a] = b;
+	return b;
+}
+
+
+//first labelling pass for one row
+//rptr/dptr are the binary and label rows, tptr/dtptr the row above (NULL on a strip's first row)
+//labels are provisional and taken from next
+//returns one past the last label used
+static int labelRow(const uchar* rptr, const uchar* tptr, int* dptr, const int* dtptr, int cols, int* parent, int next) {
+
+	for (int j = 0; j < cols; j++) {
+
+		if (rptr[j] != 0) { //background stays 0
+			dptr[j] = 0;
+			continue;
+		}
+
+		int left = (j > 0 && rptr[j - 1] == 0) ? dptr[j - 1] : 0;
+		int up = (tptr != NULL && tptr[j] == 0) ? dtptr[j] : 0;
+
+		if (left == 0 && up == 0) { //new provisional label
+			parent[next] = next;
+			dptr[j] = next;
+			next++;
+		}
+		else if (up == 0 || up == left) {
+			dptr[j] = left;
+		}
+		else if (left == 0) {
+			dptr[j] = up;
+		}
+		else { //both neighbors labelled, join their sets
+			dptr[j] = left;
+			unite(parent, left, up);
+		}
+	}
+
+	return next;
+}
+
+
+//first labelling pass over rows [rstart, rend) of src
+//the row above is only used when it belongs to this strip
+static int labelStrip(cv::Mat& src, cv::Mat& dst, int* parent, int rstart, int rend, int next) {
+
+	for (int i = rstart; i < rend; i++) {
+
+		uchar* tptr = (i > rstart) ? src.ptr<uchar>(i - 1) : NULL;
+		int* dtptr = (i > rstart) ? dst.ptr<int>(i - 1) : NULL;
+		next = labelRow(src.ptr<uchar>(i), tptr, dst.ptr<int>(i), dtptr, src.cols, parent, next);
+	}
+
+	return next;
+}
+
+
+//swaps every provisional label in [lstart, lend) for its final label
+//ranges have to be given in increasing order, count is the number of final labels so far
+//returns the new count
+static int resolveLabels(int* parent, int lstart, int lend, int count) {
+
+	for (int l = lstart; l < lend; l++) {
+		if (parent[l] == l) {
+			count++;
+			parent[l] = count;
+		}
+		else {
+			parent[l] = parent[parent[l]];
+		}
+	}
+
+	return count;
+}
+
+
+//final labelling pass over rows [rstart, rend) of dst
+//swaps provisional labels for final ones and adds each run of pixels to table
+static void relabelStrip(cv::Mat& dst, int* parent, int rstart, int rend, std::vector<RegionInfo>& table) {
+
+	for (int i = rstart; i < rend; i++) {
+
+		int* dptr = dst.ptr<int>(i);
+
+		int j = 0;
+		while (j < dst.cols) {
+
+			if (dptr[j] == 0) {
+				j++;
+				continue;
+			}
+
+			//a run of pixels all share one provisional label
+			int label = dptr[j];
+			int final = parent[label];
+			int start = j;
+			while (j < dst.cols && dptr[j] == label) {
+				dptr[j] = final;
+				j++;
+			}
+			int end = j - 1;
+			int64_t len = j - start;
+
+			RegionInfo& info = table[final];
+			if (info.area == 0) {
+				info.box[0] = start;
+				info.box[1] = end;
+				info.box[2] = i;
+				info.box[3] = i;
+			}
+			info.area += static_cast<int>(len);
+			info.sumx += (static_cast<int64_t>(start) + end) * len / 2;
+			info.sumy += static_cast<int64_t>(i) * len;
+			info.box[0] = std::min(info.box[0], start);
+			info.box[1] = std::max(info.box[1], end);
+			info.box[2] = std::min(info.box[2], i);
+			info.box[3] = std::max(info.box[3], i);
+		}
+	}
+}
+
+
+//adds one region table entry into another
+static void mergeInfo(RegionInfo& info, RegionInfo& part) {
+
+	if (part.area == 0) {
+		return;
+	}
+	if (info.area == 0) {
+		info = part;
+		return;
+	}
+	info.area += part.area;
+	info.sumx += part.sumx;
+	info.sumy += part.sumy;
+	info.box[0] = std::min(info.box[0], part.box[0]);
+	info.box[1] = std::max(info.box[1], part.box[1]);
+	info.box[2] = std::min(info.box[2], part.box[2]);
+	info.box[3] = std::max(info.box[3], part.box[3]);
+}
+
+
+//relabelStrip on each strip of dst into the strip's own table
+class RelabelStrips : public cv::ParallelLoopBody {
+public:
+	RelabelStrips(cv::Mat& dst, int* parent, int count, int strips, std::vector<std::vector<RegionInfo>>& tables)
+		: dst(dst), parent(parent), count(count), strips(strips), tables(tables) {}
+
+	void operator()(const cv::Range& range) const {
+		for (int s = range.start; s < range.end; s++) {
+			int rstart = static_cast<int>(static_cast<int64_t>(dst.rows) * s / strips);
+			int rend = static_cast<int>(static_cast<int64_t>(dst.rows) * (s + 1) / strips);
+			tables[s].assign(count + 1, RegionInfo());
+			relabelStrip(dst, parent, rstart, rend, tables[s]);
+		}
+	}
+
+private:
+	cv::Mat& dst;
+	int* parent;
+	int count;
+	int strips;
+	std::vector<std::vector<RegionInfo>>& tables;
+};
+
+
+//second labelling pass over all of dst, in parallel strips that each fill their
+//own table, then the tables are added up into table
+//stripTables is scratch the caller keeps, so neither it nor table is reallocated once they've grown
+//the body is a ParallelLoopBody rather than a lambda so starting the pass doesn't allocate
+static void relabel(cv::Mat& dst, int* parent, int count, std::vector<RegionInfo>& table,
+	std::vector<std::vector<RegionInfo>>& stripTables) {
+
+	int strips = std::max(1, std::min(cv::getNumThreads(), dst.rows / 32));
+	if (static_cast<int>(stripTables.size()) < strips) {
+		stripTables.resize(strips);
+	}
+
+	cv::parallel_for_(cv::Range(0, strips), RelabelStrips(dst, parent, count, strips, stripTables));
+
+	table.assign(stripTables[0].begin(), stripTables[0].begin() + count + 1);
+	for (int s = 1; s < strips; s++) {
+		for (int x = 1; x <= count; x++) {
+			mergeInfo(table[x], stripTables[s][x]);
+		}
+	}
+}
+
+
+//Extension 2: Region Labelling Function
+//fills destination CV_32S mat with 0s for background and #s to indicate 
+//4-connected regions for foreground pixels
+//two pass union-find labelling: the first pass runs on horizontal strips in parallel
+//and the strips are joined at their seams before labels are resolved
+//table gets area, box and centroid sums for each label (entry 0 is unused)
+//returns number of labels including background
+int regions(cv::Mat& src, cv::Mat& dst, std::vector<RegionInfo>& table) {
+
+	dst.create(src.size(), CV_32S);
+
+	//with 4-connectivity a row can start at most one new label every other pixel
+	int perRow = (src.cols + 1) / 2;
+	std::vector<int> parent(static_cast<size_t>(src.rows) * perRow + 1);
+
+	//strips are at least 32 rows tall so seams stay cheap
+	int strips = std::max(1, std::min(cv::getNumThreads(), src.rows / 32));
+	std::vector<int> rowStart(strips + 1);
+	std::vector<int> labelEnd(strips);
+	for (int s = 0; s <= strips; s++) {
+		rowStart[s] = static_cast<int>(static_cast<int64_t>(src.rows) * s / strips);
+	}
+
+	//first pass, each strip uses labels starting after every label the strips above could use
+	cv::parallel_for_(cv::Range(0, strips), [&](const cv::Range& range) {
+		for (int s = range.start; s < range.end; s++) {
+			labelEnd[s] = labelStrip(src, dst, parent.data(), rowStart[s], rowStart[s + 1], rowStart[s] * perRow + 1);
+		}
+	});
+
+	//joining regions that cross from one strip into the next
+	for (int s = 1; s < strips; s++) {
+
+		int i = rowStart[s];
+		uchar* rptr = src.ptr<uchar>(i);
+		uchar* tptr = src.ptr<uchar>(i - 1);
+		int* dptr = dst.ptr<int>(i);
+		int* dtptr = dst.ptr<int>(i - 1);
+
+		for (int j = 0; j < src.cols; j++) {
+			if (rptr[j] == 0 && tptr[j] == 0) {
+				unite(parent.data(), dptr[j], dtptr[j]);
+			}
+		}
+	}
+
+	//resolving to consecutive final labels in order of first appearance
+	int count = 0;
+	for (int s = 0; s < strips; s++) {
+		count = resolveLabels(parent.data(), rowStart[s] * perRow + 1, labelEnd[s], count);
+	}
+
+	static thread_local std::vector<std::vector<RegionInfo>> stripTables;
+	relabel(dst, parent.data(), count, table, stripTables);
+
+	//printf("ended with %d regions\n", count);
+
+	return count + 1;
+}
+
+
+//starts labelling a new image of the given size into dst
+int RowLabeler::begin(cv::Mat& dst, cv::Size size) {
+
+	dst.create(size, CV_32S);
+	labels = dst;
+
+	parent.resize(static_cast<size_t>(size.height) * ((size.width + 1) / 2) + 1);
+	prevRow.resize(size.width);
+	row = 0;
+	next = 1;
+
+	return 0;
+}
+
+
+//first pass on the next row of the binary image
+int RowLabeler::push(const uchar* src) {
+
+	int* dptr = labels.ptr<int>(row);
+	int* dtptr = (row > 0) ? labels.ptr<int>(row - 1) : NULL;
+	const uchar* tptr = (row > 0) ? prevRow.data() : NULL;
+
+	next = labelRow(src, tptr, dptr, dtptr, labels.cols, parent.data(), next);
+
+	memcpy(prevRow.data(), src, labels.cols);
+	row++;
+
+	return 0;
+}
+
+
+//resolves labels and runs the second pass once every row has been pushed
+//returns number of labels including background
+int RowLabeler::finish(std::vector<RegionInfo>& table) {
+
+	int count = resolveLabels(parent.data(), 1, next, 0);
+	relabel(labels, parent.data(), count, table, stripTables);
+
+	return count + 1;
+}
+
+
+//labels regions when the table isn't needed
+int regions(cv::Mat& src, cv::Mat& dst) {
+
+	std::vector<RegionInfo> table;
+	return regions(src, dst, table);
+}
+
+
+//starts a new image of the given size, keeping the buffers
+int RunImage::begin(cv::Size size) {
+
+	imgSize = size;
+	runs.clear();
+	rowStart.clear();
+	rowStart.push_back(0);
+
+	return 0;
+}
+
+
+//appends the runs of one binary row
+//memchr skips background to the next foreground pixel, which is fast on mostly white rows
+int RunImage::push(const uchar* src) {
+
+	const uchar* p = src;
+	const uchar* end = src + imgSize.width;
+
+	while (p < end) {
+
+		const uchar* fg = static_cast<const uchar*>(memchr(p, 0, end - p));
+		if (fg == NULL) {
+			break;
+		}
+		const uchar* q = fg + 1;
+		while (q < end && *q == 0) {
+			q++;
+		}
+
+		Run run;
+		run.start = static_cast<int>(fg - src);
+		run.end = static_cast<int>(q - src);
+		runs.push_back(run);
+		p = q;
+	}
+
+	rowStart.push_back(static_cast<int>(runs.size()));
+
+	return 0;
+}
+
+
+//encodes a whole binary image
+int RunImage::encode(cv::Mat& src) {
+
+	begin(src.size());
+	for (int i = 0; i < src.rows; i++) {
+		push(src.ptr<uchar>(i));
+	}
+
+	return 0;
+}
+
+
+//union-find over runs: each run is joined to the runs on the row above that share a column with it
+//runs are provisional labels in raster order and roots are the lowest label in their set,
+//so final labels are in order of first appearance like regions gives
+int RunImage::finish(std::vector<RegionInfo>& table) {
+
+	int n = static_cast<int>(runs.size());
+	parent.resize(static_cast<size_t>(n) + 1);
+	for (int k = 0; k <= n; k++) {
+		parent[k] = k;
+	}
+
+	int height = static_cast<int>(rowStart.size()) - 1;
+	for (int y = 1; y < height; y++) {
+
+		//runs of both rows are sorted, so the first run above that could overlap only moves right
+		int a = rowStart[y - 1];
+		int aend = rowStart[y];
+		for (int c = rowStart[y]; c < rowStart[y + 1]; c++) {
+
+			while (a < aend && runs[a].end <= runs[c].start) {
+				a++;
+			}
+			for (int k = a; k < aend && runs[k].start < runs[c].end; k++) {
+				unite(parent.data(), k + 1, c + 1);
+			}
+		}
+	}
+
+	int labelCount = resolveLabels(parent.data(), 1, n + 1, 0);
+
+	//area, box and centroid sums a run at a time
+	table.assign(static_cast<size_t>(labelCount) + 1, RegionInfo());
+	for (int y = 0; y < height; y++) {
+		for (int k = rowStart[y]; k < rowStart[y + 1]; k++) {
+
+			Run& run = runs[k];
+			run.label = parent[k + 1];
+
+			int last = run.end - 1;
+			int64_t len = run.end - run.start;
+
+			RegionInfo& info = table[run.label];
+			if (info.area == 0) {
+				info.box[0] = run.start;
+				info.box[1] = last;
+				info.box[2] = y;
+				info.box[3] = y;
+			}
+			info.area += static_cast<int>(len);
+			info.sumx += (static_cast<int64_t>(run.start) + last) * len / 2;
+			info.sumy += static_cast<int64_t>(y) * len;
+			info.box[0] = std::min(info.box[0], run.start);
+			info.box[1] = std::max(info.box[1], last);
+			info.box[3] = y;
+		}
+	}
+
+	return labelCount + 1;
+}
+
+
+//fills dst row by row, background between the runs and each run's label over it
+int RunImage::paint(cv::Mat& dst) const {
+
+	dst.create(imgSize, CV_32S);
+
+	int height = static_cast<int>(rowStart.size()) - 1;
+	for (int y = 0; y < dst.rows; y++) {
+
+		int* dptr = dst.ptr<int>(y);
+		int x = 0;
+		if (y < height) {
+			for (int k = rowStart[y]; k < rowStart[y + 1]; k++) {
+				const Run& run = runs[k];
+				std::fill(dptr + x, dptr + run.start, 0);
+				std::fill(dptr + run.start, dptr + run.end, run.label);
+				x = run.end;
 			}
-			
 		}
+		std::fill(dptr + x, dptr + dst.cols, 0);
 	}
 
+	return 0;
+}
+
+
+
+//van Herk/Gil-Werman running minimum along one row
+//x holds the row padded with r background pixels on each side (n + 2r values)
+//and is cut into blocks of w = 2r + 1. g is the min from each block's start and
+//h the min to each block's end, so any window of w values is min(h[start], g[end])
+//and the cost per pixel is the same for every radius
+static void rowMin(const uchar* x, int n, int r, uchar* g, uchar* h, uchar* dst) {
+
+	int w = 2 * r + 1;
+	int len = n + 2 * r;
+
+	for (int p = 0; p < len; p++) {
+		g[p] = (p % w == 0) ? x[p] : std::min(g[p - 1], x[p]);
+	}
+	for (int p = len - 1; p >= 0; p--) {
+		h[p] = (p % w == w - 1 || p == len - 1) ? x[p] : std::min(h[p + 1], x[p]);
+	}
+	for (int j = 0; j < n; j++) {
+		dst[j] = std::min(h[j], g[j + 2 * r]);
+	}
+}
+
+
+//Extension 1: Dilation function from scratch
+//grows foreground (0) pixels over a (2 * radius + 1) square
+//the square is split into a row pass and a column pass, each a van Herk/Gil-Werman
+//running min, so cost per pixel doesn't depend on radius
+//the row pass writes into dst and the column pass runs in place on dst,
+//so src and dst can be the same Mat
+int dilate(cv::Mat& src, cv::Mat& dst, int radius) {
+
+	dst.create(src.size(), CV_8UC1);
+
+	if (radius < 1) {
+		if (dst.data != src.data) {
+			src.copyTo(dst);
+		}
+		return 0;
+	}
+
+	//small radii go to the morphology templates (morph.h), whose fixed windows beat the running min's blocks
+	switch (radius) {
+	case 1: return Morphology<BallElement<8, 1>>::dilate(src, dst);
+	case 2: return Morphology<BallElement<8, 2>>::dilate(src, dst);
+	case 3: return Morphology<BallElement<8, 3>>::dilate(src, dst);
+	case 4: return Morphology<BallElement<8, 4>>::dilate(src, dst);
+	case 5: return Morphology<BallElement<8, 5>>::dilate(src, dst);
+	case 6: return Morphology<BallElement<8, 6>>::dilate(src, dst);
+	case 7: return Morphology<BallElement<8, 7>>::dilate(src, dst);
+	case 8: return Morphology<BallElement<8, 8>>::dilate(src, dst);
+	default: break;
+	}
+
+	int rows = src.rows;
+	int cols = src.cols;
+	int r = radius;
+
+	//row pass, scratch is kept per thread so it's only allocated when a row gets longer
+	cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range& range) {
+
+		static thread_local std::vector<uchar> scratch;
+		size_t len = static_cast<size_t>(cols) + 2 * r;
+		if (scratch.size() < 3 * len) {
+			scratch.resize(3 * len);
+		}
+		uchar* x = scratch.data();
+		uchar* g = x + len;
+		uchar* h = g + len;
+
+		//padding is background
+		memset(x, 255, r);
+		memset(x + r + cols, 255, r);
+
+		for (int i = range.start; i < range.end; i++) {
+			memcpy(x + r, src.ptr<uchar>(i), cols);
+			rowMin(x, cols, r, g, h, dst.ptr<uchar>(i));
+		}
+	});
+
+	//column pass runs the same blocks down the rows, a strip of columns at a time
+	//so the inner loops work across whole rows of the strip and vectorize
+	const int stripW = 256;
+	int strips = (cols + stripW - 1) / stripW;
+
+	cv::parallel_for_(cv::Range(0, strips), [&](const cv::Range& range) {
+
+		int w = 2 * r + 1;
+		int len = rows + 2 * r;
+
+		static thread_local std::vector<uchar> scratch;
+		size_t need = (2 * static_cast<size_t>(len) + 1) * stripW;
+		if (scratch.size() < need) {
+			scratch.resize(need);
+		}
+
+		//padding rows above and below the image are background
+		uchar* pad = scratch.data() + 2 * static_cast<size_t>(len) * stripW;
+		memset(pad, 255, stripW);
+
+		for (int s = range.start; s < range.end; s++) {
 
-	//printf("%d in foreground, %d in background\n", countfg, countbg);
+			int cstart = s * stripW;
+			int n = std::min(stripW, cols - cstart);
+
+			//g and h rows for padded row p
+			uchar* g = scratch.data();
+			uchar* h = g + static_cast<size_t>(len) * stripW;
+
+			for (int p = 0; p < len; p++) {
+
+				int i = p - r;
+				uchar* x = (i < 0 || i >= rows) ? pad : dst.ptr<uchar>(i) + cstart;
+				uchar* gp = g + static_cast<size_t>(p) * stripW;
+
+				if (p % w == 0) {
+					memcpy(gp, x, n);
+				}
+				else {
+					uchar* gprev = gp - stripW;
+					for (int j = 0; j < n; j++) {
+						gp[j] = std::min(gprev[j], x[j]);
+					}
+				}
+			}
+
+			for (int p = len - 1; p >= 0; p--) {
+
+				int i = p - r;
+				uchar* x = (i < 0 || i >= rows) ? pad : dst.ptr<uchar>(i) + cstart;
+				uchar* hp = h + static_cast<size_t>(p) * stripW;
+
+				if (p % w == w - 1 || p == len - 1) {
+					memcpy(hp, x, n);
+				}
+				else {
+					uchar* hnext = hp + stripW;
+					for (int j = 0; j < n; j++) {
+						hp[j] = std::min(hnext[j], x[j]);
+					}
+				}
+			}
+
+			//window for row i covers padded rows i to i + 2r
+			for (int i = 0; i < rows; i++) {
+
+				uchar* hp = h + static_cast<size_t>(i) * stripW;
+				uchar* gp = g + static_cast<size_t>(i + 2 * r) * stripW;
+				uchar* dptr = dst.ptr<uchar>(i) + cstart;
+
+				for (int j = 0; j < n; j++) {
+					dptr[j] = std::min(hp[j], gp[j]);
+				}
+			}
+		}
+	});
+
+	return 0;
+}
+
+
+//grows pixels with 8-connected pattern (a 3x3 square)
+int dilate(cv::Mat& src, cv::Mat& dst) {
+
+	return Morphology<BallElement<8, 1>>::dilate(src, dst);
+}
+
+
+
+//Extension 1: Grassfire Algorithm
+//grassfire algorithm to calculate distances from background for each pixel
+//fills out a CV_8UC1 matrix with manhattan dist of each pix to background (saturating at 255)
+//pixels outside the image count as background
+//
+//manhattan distance is separable, so this runs as column passes (down then up) that
+//give the distance to background within each column, then row passes (right then left)
+//that combine them. The column passes are independent per column and the row passes
+//per row, so both run in parallel strips, and every step is a saturating byte min
+//written straight into distance, so no other buffer is needed
+int grassfire(cv::Mat& src, cv::Mat& distance) {
+
+	distance.create(src.size(), CV_8UC1);
+
+	int rows = src.rows;
+	int cols = src.cols;
+
+	//column strips are whole cache lines wide so threads don't share lines
+	int colStrips = std::max(1, std::min(cv::getNumThreads(), cols / 64));
+
+	cv::parallel_for_(cv::Range(0, colStrips), [&](const cv::Range& range) {
+		for (int s = range.start; s < range.end; s++) {
+
+			int cstart = (cols * s / colStrips) & ~63;
+			int cend = (s == colStrips - 1) ? cols : ((cols * (s + 1) / colStrips) & ~63);
+
+			//top to bottom, distance to background above (the row above the image is background)
+			for (int i = 0; i < rows; i++) {
+
+				uchar* rptr = src.ptr<uchar>(i);
+				uchar* dptr = distance.ptr<uchar>(i);
+				uchar* tptr = (i > 0) ? distance.ptr<uchar>(i - 1) : NULL;
+
+				for (int j = cstart; j < cend; j++) {
+					int up = tptr ? tptr[j] : 0;
+					int inc = up + (up < 255); //saturating + 1
+					dptr[j] = (rptr[j] == 255) ? 0 : static_cast<uchar>(inc);
+				}
+			}
+
+			//bottom to top, keeping the closer of above and below (the row below the image is background)
+			for (int i = rows - 1; i >= 0; i--) {
+
+				uchar* dptr = distance.ptr<uchar>(i);
+				uchar* bptr = (i < rows - 1) ? distance.ptr<uchar>(i + 1) : NULL;
+
+				for (int j = cstart; j < cend; j++) {
+					int below = bptr ? bptr[j] : 0;
+					int down = below + (below < 255);
+					dptr[j] = static_cast<uchar>(std::min<int>(dptr[j], down));
+				}
+			}
+		}
+	});
+
+	//left to right then right to left along each row
+	cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range& range) {
+		for (int i = range.start; i < range.end; i++) {
+
+			uchar* dptr = distance.ptr<uchar>(i);
+
+			int prev = 0; //column left of the image is background
+			for (int j = 0; j < cols; j++) {
+				prev = std::min<int>(dptr[j], prev + 1);
+				dptr[j] = static_cast<uchar>(prev);
+			}
+
+			prev = 0;
+			for (int j = cols - 1; j >= 0; j--) {
+				prev = std::min<int>(dptr[j], prev + 1);
+				dptr[j] = static_cast<uchar>(prev);
+			}
+		}
+	});
 
 	return 0;
 }
@@ -765,7 +1991,7 @@ int grassfire(cv::Mat& src, cv::Mat& distance) {
 //erodes src image to destination based on distances in distance matrix up to level
 int distErosion(cv::Mat &distance, cv::Mat & dst, int level) {
 
-	dst = cv::Mat::zeros(distance.size(), CV_8UC1);
+	dst.create(distance.size(), CV_8UC1);
 
 	for (int i = 0; i < distance.rows; i++) {
 
@@ -791,24 +2017,162 @@ int distErosion(cv::Mat &distance, cv::Mat & dst, int level) {
 
 
 
+//fixed point luma weights (BT.601, sum to 256) used by every threshold kernel
+//so that all of them give exactly the same binary image
+static const int lumaB = 29;
+static const int lumaG = 150;
+static const int lumaR = 77;
+
+//thresholds n interleaved BGR pixels straight to 0/255
+static void threshRowScalar(const uchar* src, uchar* dst, int n, int thresh) {
+
+	for (int j = 0; j < n; j++) {
+		int luma = (lumaB * src[3 * j] + lumaG * src[3 * j + 1] + lumaR * src[3 * j + 2] + 128) >> 8;
+		dst[j] = (luma > thresh) ? 255 : 0;
+	}
+}
+
+#ifdef RECOG_X86
+
+//splits 16 interleaved BGR pixels (48 bytes) into one register per channel
+RECOG_TARGET("sse4.1")
+static inline void splitBGR(const uchar* src, __m128i& b, __m128i& g, __m128i& r) {
+
+	__m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+	__m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+	__m128i p2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+
+	//each channel takes every third byte, spread across the three loads
+	b = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(p0, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(p1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(p2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+	g = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(p0, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(p1, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(p2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+	r = _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(p0, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(p1, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+		_mm_shuffle_epi8(p2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+}
+
+//8 lumas in 16 bit lanes, compared against thresh (0xFFFF where luma > thresh)
+RECOG_TARGET("sse4.1")
+static inline __m128i threshLanes(__m128i b, __m128i g, __m128i r, __m128i thresh) {
+
+	__m128i sum = _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(lumaB)), _mm_mullo_epi16(g, _mm_set1_epi16(lumaG)));
+	sum = _mm_add_epi16(sum, _mm_mullo_epi16(r, _mm_set1_epi16(lumaR)));
+	//sum is at most 255 * 256 + 128 so a logical shift keeps it exact
+	__m128i luma = _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(128)), 8);
+	return _mm_cmpgt_epi16(luma, thresh);
+}
+
+RECOG_TARGET("sse4.1")
+static void threshRowSSE41(const uchar* src, uchar* dst, int n, int thresh) {
+
+	__m128i t = _mm_set1_epi16(static_cast<short>(thresh));
+	int j = 0;
+
+	for (; j + 16 <= n; j += 16) {
+
+		__m128i b, g, r;
+		splitBGR(src + 3 * j, b, g, r);
+
+		__m128i zero = _mm_setzero_si128();
+		__m128i lo = threshLanes(_mm_cvtepu8_epi16(b), _mm_cvtepu8_epi16(g), _mm_cvtepu8_epi16(r), t);
+		__m128i hi = threshLanes(_mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(g, zero), _mm_unpackhi_epi8(r, zero), t);
+
+		//packing saturates 0xFFFF to 0xFF
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + j), _mm_packs_epi16(lo, hi));
+	}
+
+	threshRowScalar(src + 3 * j, dst + j, n - j, thresh);
+}
+
+//16 lumas in 16 bit lanes, compared against thresh
+RECOG_TARGET("avx2")
+static inline __m256i threshLanes(__m128i b, __m128i g, __m128i r, __m256i thresh) {
+
+	__m256i sum = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_cvtepu8_epi16(b), _mm256_set1_epi16(lumaB)),
+		_mm256_mullo_epi16(_mm256_cvtepu8_epi16(g), _mm256_set1_epi16(lumaG)));
+	sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(_mm256_cvtepu8_epi16(r), _mm256_set1_epi16(lumaR)));
+	__m256i luma = _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(128)), 8);
+	return _mm256_cmpgt_epi16(luma, thresh);
+}
+
+RECOG_TARGET("avx2")
+static void threshRowAVX2(const uchar* src, uchar* dst, int n, int thresh) {
+
+	__m256i t = _mm256_set1_epi16(static_cast<short>(thresh));
+	int j = 0;
+
+	for (; j + 32 <= n; j += 32) {
+
+		__m128i b0, g0, r0, b1, g1, r1;
+		splitBGR(src + 3 * j, b0, g0, r0);
+		splitBGR(src + 3 * j + 48, b1, g1, r1);
+
+		__m256i lo = threshLanes(b0, g0, r0, t);
+		__m256i hi = threshLanes(b1, g1, r1, t);
+
+		//packs works within 128 bit lanes, so the 64 bit quarters need reordering
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xD8);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + j), packed);
+	}
+
+	threshRowSSE41(src + 3 * j, dst + j, n - j, thresh);
+}
+
+#endif
+
+typedef void (*ThreshRowFunc)(const uchar* src, uchar* dst, int n, int thresh);
+
+//picks the widest threshold kernel this cpu supports, checked once
+static ThreshRowFunc threshRowFunc() {
+
+	static const ThreshRowFunc func = []() -> ThreshRowFunc {
+#ifdef RECOG_X86
+		if (cv::checkHardwareSupport(CV_CPU_AVX2)) {
+			return threshRowAVX2;
+		}
+		if (cv::checkHardwareSupport(CV_CPU_SSE4_1)) {
+			return threshRowSSE41;
+		}
+#endif
+		return threshRowScalar;
+	}();
+
+	return func;
+}
+
+
 //generates a binary image with values of 0 or 255 based on grayscale values hitting threshold (thresh)
+//color sources are converted to luma and thresholded in one step, without a grayscale copy
 int binaryImg(cv::Mat &src, cv::Mat &dst, int thresh) {
 
+	if (src.depth() != CV_8U || (src.channels() != 1 && src.channels() != 3)) {
+		return -1;
+	}
 
-	cv::Mat gray;
-	cv::cvtColor(src, gray, CV_16F);  //making grayscale copy of src to work with
+	//lumas are 0-255 so anything outside that range gives an all white or all black image
+	thresh = std::max(-1, std::min(thresh, 255));
 
-	dst = cv::Mat::zeros(src.rows, src.cols, CV_8UC1); //unsigned char datatype
+	dst.create(src.rows, src.cols, CV_8UC1); //unsigned char datatype
 
-	for (int i = 0; i < src.rows; i++) {
+	ThreshRowFunc threshRow = threshRowFunc();
 
-		uchar* rptr = gray.ptr<uchar>(i);  //row pointer for grayscale src image
-		uchar* dptr = dst.ptr<uchar>(i);  //row pointer for grayscale src image
+	for (int i = 0; i < src.rows; i++) {
 
-		for (int j = 0; j < src.cols; j++) {
+		uchar* rptr = src.ptr<uchar>(i);  //row pointer for src image
+		uchar* dptr = dst.ptr<uchar>(i);  //row pointer for binary image
 
-			if (rptr[j] > thresh) {   //any values over thresh are set to 255 for binary image
-				dptr[j] = 255;
+		if (src.channels() == 3) {
+			threshRow(rptr, dptr, src.cols, thresh);
+		}
+		else {
+			for (int j = 0; j < src.cols; j++) {
+				dptr[j] = (rptr[j] > thresh) ? 255 : 0; //any values over thresh are set to 255 for binary image
 			}
 		}
 	}
@@ -819,3 +2183,209 @@ int binaryImg(cv::Mat &src, cv::Mat &dst, int thresh) {
 
 
 
+//cleans and labels frame a row at a time
+//row t of the frame is thresholded, then row t - e is eroded (it needs binary rows up to t)
+//and row t - e - radius is dilated (it needs eroded rows up to t - e) and goes to the labeller
+int CleanupStream::run(cv::Mat& frame, cv::Mat& labels, std::vector<RegionInfo>& table, cv::Mat* binView, cv::Mat* cleanView) {
+
+	if (stream(frame, labels, binView, cleanView) != 0) {
+		return -1;
+	}
+	return finish(table);
+}
+
+
+//threshold, erosion, dilation and first labelling pass, one row at a time
+int CleanupStream::stream(cv::Mat& frame, cv::Mat& labels, cv::Mat* binView, cv::Mat* cleanView) {
+
+	return streamRows(frame, &labels, NULL, binView, cleanView);
+}
+
+
+//threshold, erosion and dilation, one row at a time, with the cleaned rows run length encoded into runs
+int CleanupStream::stream(cv::Mat& frame, RunImage& runs, cv::Mat* binView, cv::Mat* cleanView) {
+
+	return streamRows(frame, NULL, &runs, binView, cleanView);
+}
+
+
+//the stream overloads, cleaned rows go to the labeller for labels or into runs
+int CleanupStream::streamRows(cv::Mat& frame, cv::Mat* labels, RunImage* runs, cv::Mat* binView, cv::Mat* cleanView) {
+
+	if (frame.depth() != CV_8U || (frame.channels() != 1 && frame.channels() != 3)) {
+		return -1;
+	}
+
+	src = frame;
+	rows = frame.rows;
+	cols = frame.cols;
+	e = std::max(1, std::min(level, 255)) - 1;
+	dr = std::max(radius, 0);
+	int r = dr;
+
+	//buffers only grow, so after the first frame nothing is allocated
+	binRing.resize(static_cast<size_t>(2 * e + 1) * cols);
+	erodeRing.resize(static_cast<size_t>(2 * r + 2) * cols);
+	vdist.resize(cols);
+	colCount.assign(cols, 0);
+	outRow.resize(cols);
+
+	binOut = binView;
+	cleanOut = cleanView;
+	if (binOut != NULL) {
+		binOut->create(frame.size(), CV_8UC1);
+	}
+	if (cleanOut != NULL) {
+		cleanOut->create(frame.size(), CV_8UC1);
+	}
+
+	runOut = runs;
+	if (runOut != NULL) {
+		runOut->begin(frame.size());
+	}
+	else {
+		labeler.begin(*labels, frame.size());
+	}
+
+	for (int t = 0; t < rows + e + r; t++) {
+
+		if (t < rows) {
+			binaryRow(t);
+		}
+
+		int u = t - e;
+		if (u >= 0 && u < rows) {
+			erodeRow(u);
+		}
+
+		int v = u - r;
+		if (v >= 0 && v < rows) {
+			dilateRow(v);
+		}
+	}
+
+	return 0;
+}
+
+
+//resolves the labels streamed so far and fills table
+int CleanupStream::finish(std::vector<RegionInfo>& table) {
+
+	if (runOut != NULL) {
+		return runOut->finish(table);
+	}
+	return labeler.finish(table);
+}
+
+
+//thresholds frame row i into the binary ring
+void CleanupStream::binaryRow(int i) {
+
+	uchar* bptr = &binRing[static_cast<size_t>(i % (2 * e + 1)) * cols];
+	uchar* rptr = src.ptr<uchar>(i);
+
+	if (src.channels() == 3) {
+		threshRowFunc()(rptr, bptr, cols, std::max(-1, std::min(thresh, 255)));
+	}
+	else {
+		for (int j = 0; j < cols; j++) {
+			bptr[j] = (rptr[j] > thresh) ? 255 : 0;
+		}
+	}
+
+	if (binOut != NULL) {
+		memcpy(binOut->ptr<uchar>(i), bptr, cols);
+	}
+}
+
+
+//erodes row i from the binary rows within e of it
+//this is grassfire then distErosion worked out locally: a pixel stays foreground only
+//if its manhattan distance to background is more than e, so only rows i - e to i + e matter
+void CleanupStream::erodeRow(int i) {
+
+	//distance to background along each column, clipped at e + 1
+	uchar* vd = vdist.data();
+	memset(vd, e + 1, cols);
+
+	for (int dy = -e; dy <= e; dy++) {
+
+		int y = i + dy;
+		uchar dist = static_cast<uchar>(std::abs(dy));
+
+		if (y < 0 || y >= rows) { //rows outside the image are background
+			for (int j = 0; j < cols; j++) {
+				vd[j] = std::min(vd[j], dist);
+			}
+			continue;
+		}
+
+		uchar* bptr = &binRing[static_cast<size_t>(y % (2 * e + 1)) * cols];
+		for (int j = 0; j < cols; j++) {
+			uchar d = (bptr[j] != 0) ? dist : static_cast<uchar>(e + 1);
+			vd[j] = std::min(vd[j], d);
+		}
+	}
+
+	//then along the row in both directions, columns outside the image are background
+	int prev = 0;
+	for (int j = 0; j < cols; j++) {
+		prev = std::min<int>(vd[j], prev + 1);
+		vd[j] = static_cast<uchar>(prev);
+	}
+
+	uchar* eptr = &erodeRing[static_cast<size_t>(i % (2 * dr + 2)) * cols];
+	int* count = colCount.data();
+
+	prev = 0;
+	for (int j = cols - 1; j >= 0; j--) {
+		prev = std::min<int>(vd[j], prev + 1);
+		int fg = prev > e;
+		eptr[j] = fg ? 0 : 255;
+		count[j] += fg; //adding to the dilation window
+	}
+}
+
+
+//dilates row i from the eroded rows within radius of it and hands it to the labeller (or the runs)
+//colCount already holds eroded rows up to i + radius, row i - radius - 1 leaves the window here
+void CleanupStream::dilateRow(int i) {
+
+	int r = dr;
+	int* count = colCount.data();
+
+	if (i - r - 1 >= 0) {
+		uchar* eptr = &erodeRing[static_cast<size_t>((i - r - 1) % (2 * r + 2)) * cols];
+		for (int j = 0; j < cols; j++) {
+			count[j] -= (eptr[j] == 0);
+		}
+	}
+
+	//active is the number of columns within radius that have any foreground
+	int active = 0;
+	for (int k = 0; k < std::min(r, cols); k++) {
+		active += (count[k] > 0);
+	}
+
+	uchar* optr = outRow.data();
+	for (int j = 0; j < cols; j++) {
+		if (j + r < cols) {
+			active += (count[j + r] > 0);
+		}
+		optr[j] = active ? 0 : 255;
+		if (j - r >= 0) {
+			active -= (count[j - r] > 0);
+		}
+	}
+
+	if (runOut != NULL) {
+		runOut->push(optr);
+	}
+	else {
+		labeler.push(optr);
+	}
+
+	if (cleanOut != NULL) {
+		memcpy(cleanOut->ptr<uchar>(i), optr, cols);
+	}
+}
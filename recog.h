@@ -4,18 +4,26 @@
 	header for binary image feature vector functions
 */
 
+#ifndef RECOG_H
+#define RECOG_H
+
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <cstdint>
 #include <iostream>
+#include <vector>
 #include <opencv2/opencv.hpp>
+#include "database.h"
+#include "featureset.h"
 
 
 //generates a binary image of 0 or 255 based on grayscale values hitting threshold (thresh)
 int binaryImg(cv::Mat& src, cv::Mat& dst, int thresh);
 
 //Extension 1
-//fills out a matrix of int values with manhattan dist of each pix to background in 4-connected pattern
+//fills out a CV_8UC1 matrix with manhattan dist of each pix to background in 4-connected pattern
+//distances saturate at 255 and distance is reused if it already has the right size
 int grassfire(cv::Mat& src, cv::Mat& distance);
 
 //Extension 1
@@ -23,15 +31,154 @@ int grassfire(cv::Mat& src, cv::Mat& distance);
 int distErosion(cv::Mat& distance, cv::Mat& dst, int level);
 
 //Extension 1
+//grows foreground pixels over a (2 * radius + 1) square, in constant time per pixel above radius 8
+//src and dst may be the same Mat
+int dilate(cv::Mat& src, cv::Mat& dst, int radius);
+
 //grows pixels with 8-connected pattern
+//(morph.h has erosion, dilation, opening and closing for any connectivity, element and border fixed at compile time)
 int dilate(cv::Mat& src, cv::Mat& dst);
 
+//area, bounding box and centroid sums of one labelled region
+struct RegionInfo {
+	int area = 0; //total pix
+	int box[4] = { 0 }; //x min, x max, y min, y max
+	int64_t sumx = 0; //sum of x values
+	int64_t sumy = 0; //sum of y values
+};
+
 //Extension 2
-//fills destination mat with 0s for background and #s to indicate 
-//connected regions for foreground pixels
+//fills destination CV_32S mat with 0s for background and #s to indicate 
+//4-connected regions for foreground pixels
+//table gets one entry per label (entry 0 is unused)
+//returns number of labels including background
+int regions(cv::Mat& src, cv::Mat& dst, std::vector<RegionInfo>& table);
 int regions(cv::Mat& src, cv::Mat& dst);
 
+//same labelling as regions, but the binary image is handed over one row at a time
+//so it never has to exist as a full image
+class RowLabeler {
+public:
+	//starts labelling an image of the given size into dst (CV_32S)
+	int begin(cv::Mat& dst, cv::Size size);
+
+	//labels the next row of the binary image (0 is foreground)
+	int push(const uchar* src);
+
+	//finishes labels once every row is pushed and fills the region table
+	//returns number of labels including background
+	int finish(std::vector<RegionInfo>& table);
+
+private:
+	cv::Mat labels;
+	std::vector<int> parent; //union-find parents of provisional labels
+	std::vector<uchar> prevRow; //last binary row pushed
+	std::vector<std::vector<RegionInfo>> stripTables; //region table of each strip of the second pass
+	int row = 0;
+	int next = 1;
+};
+
+//one run of foreground pixels along a row, x from start to end - 1
+struct Run {
+	int start = 0;
+	int end = 0;
+	int label = 0; //region once the runs are labelled, 0 before
+};
+
+//binary image kept as the runs of foreground pixels on each row, handed over a row at a time like RowLabeler
+//regions are labelled on runs that overlap from one row to the next and measured a run at a time,
+//so on frames that are mostly background the work follows the objects' edges rather than the frame's area
+//buffers only grow, so once frames keep coming at the same size nothing is allocated
+class RunImage {
+public:
+	//starts an empty image of the given size
+	int begin(cv::Size size);
+
+	//adds the runs of the next row of the binary image (0 is foreground)
+	int push(const uchar* src);
+
+	//begin, then push for every row of src (CV_8UC1)
+	int encode(cv::Mat& src);
+
+	//labels 4-connected regions once every row is pushed and fills the region table,
+	//labels and table come out the same as regions gives for the image
+	//returns number of labels including background
+	int finish(std::vector<RegionInfo>& table);
+
+	//writes the labels as a CV_32S region map like regions makes, dst is only allocated when its size changes
+	int paint(cv::Mat& dst) const;
+
+	cv::Size size() const { return imgSize; }
+
+	//runs of row y, left to right
+	const Run* row(int y) const { return runs.data() + rowStart[y]; }
+	int rowRuns(int y) const { return rowStart[y + 1] - rowStart[y]; }
+
+	//runs in the whole image
+	int count() const { return static_cast<int>(runs.size()); }
+
+private:
+	cv::Size imgSize;
+	std::vector<Run> runs; //every row's runs one after the other
+	std::vector<int> rowStart; //first run of each row, one more entry than pushed rows
+	std::vector<int> parent; //union-find parents, run k has provisional label k + 1
+};
+
+//Extension 1 + 2
+//threshold, grassfire erosion, dilation and labelling fused into one pass down the frame
+//each stage runs a few rows behind the one before it on small ring buffers,
+//so no full size binary, distance or cleaned image is made and the working set
+//is a couple dozen rows even at 4K
+//gives the same result as binaryImg -> grassfire -> distErosion -> dilate -> regions
+class CleanupStream {
+public:
+	int thresh = 120; //binary threshold
+	int level = 2; //erosion level, pixels closer than this to background are removed (1 - 255)
+	int radius = 6; //dilation radius
+
+	//cleans and labels frame into labels (CV_32S) and table
+	//binView and cleanView get full copies of the binary and cleaned images if not NULL (for display)
+	//returns number of labels including background
+	int run(cv::Mat& frame, cv::Mat& labels, std::vector<RegionInfo>& table, cv::Mat* binView = NULL, cv::Mat* cleanView = NULL);
+
+	//run split in two so each half can be timed
+	//stream does threshold, erosion, dilation and the first labelling pass, returns -1 on a bad frame
+	//finish resolves the labels and fills table, returns number of labels including background
+	int stream(cv::Mat& frame, cv::Mat& labels, cv::Mat* binView = NULL, cv::Mat* cleanView = NULL);
+	int finish(std::vector<RegionInfo>& table);
+
+	//same as stream, but the cleaned rows go into runs instead of a region map
+	//finish then labels the runs
+	int stream(cv::Mat& frame, RunImage& runs, cv::Mat* binView = NULL, cv::Mat* cleanView = NULL);
+
+private:
+	//stream into a region map or runs, whichever isn't NULL
+	int streamRows(cv::Mat& frame, cv::Mat* labels, RunImage* runs, cv::Mat* binView, cv::Mat* cleanView);
+
+	//stage steps, each called once per row in order
+	void binaryRow(int i);
+	void erodeRow(int i);
+	void dilateRow(int i);
+
+	cv::Mat src;
+	cv::Mat* binOut = NULL;
+	cv::Mat* cleanOut = NULL;
+	int rows = 0;
+	int cols = 0;
+	int e = 1; //erosion reach, level - 1
+	int dr = 6; //dilation reach, radius clamped to 0 or more
+
+	std::vector<uchar> binRing; //last 2e + 1 binary rows
+	std::vector<uchar> erodeRing; //last 2 * radius + 2 eroded rows
+	std::vector<uchar> vdist; //clipped distance to background along each column
+	std::vector<int> colCount; //eroded foreground count per column in the dilation window
+	std::vector<uchar> outRow; //finished row
+	RowLabeler labeler;
+	RunImage* runOut = NULL; //gets the cleaned rows instead of labeler when streaming into runs
+};
+
 //creates a color coded image from connected region map 
+//dst is only allocated when its size changes
 int regColor(cv::Mat& src, cv::Mat& dst, int regCount);
 
 //iterates through central third of given Mat
@@ -39,37 +186,116 @@ int regColor(cv::Mat& src, cv::Mat& dst, int regCount);
 //returns the integer value given to that region in the region map
 int centralRegion(cv::Mat& src);
 
+//same as above but takes counts from the region table
+//for every region that lies completely inside or outside the central third
+int centralRegion(cv::Mat& src, std::vector<RegionInfo>& table);
+
+//same as above on a labelled RunImage, regions across the edge are counted a run at a time
+int centralRegion(RunImage& runs, std::vector<RegionInfo>& table);
+
+//feature values for one region, all filled in by a single pass of regionStats
+//raw sums are 64 bit so large regions on large frames don't overflow
+struct RegionStats {
+	int64_t m00 = 0; //total pix
+	int64_t m10 = 0, m01 = 0; //sum of x, sum of y
+	int64_t m20 = 0, m02 = 0, m11 = 0; //sum of x*x, y*y, x*y
+	int64_t m30 = 0, m21 = 0, m12 = 0, m03 = 0; //third order sums (x*x*x, x*x*y, x*y*y, y*y*y), 0 unless StoredFeatures needs them
+
+	double cx = 0, cy = 0; //centroid
+
+	//central moments normalized to number of pixels
+	double mu20 = 0, mu02 = 0, mu11 = 0;
+	double mu30 = 0, mu21 = 0, mu12 = 0, mu03 = 0;
+
+	double alpha = 0; //angle of least central moment
+	double beta = 0; //alpha + pi/2
+	double mu22 = 0; //second moment about beta axis
+	double hu3 = 0; //third Hu invariant, 0 unless it is stored
+
+	int box[4] = { 0 }; //x min, x max, y min, y max
+
+	//oriented box, as offsets from the centroid along the beta axis (u) and across it (v)
+	//like the other derived values it stays 0 unless a stored feature needs it (fill or h/w ratio)
+	double obb[4] = { 0 }; //u min, u max, v min, v max
+	double fill = 0; //pixels in region / pixels in oriented box
+	double ratio = 0; //short side / long side of oriented box
+};
+
 //Extension 3
-//calculate raw moments for this region (M10 avg x, M01 avg y, M00 total pix)
-int* rawMoments(cv::Mat& src, int region, int* moments);
+//accumulates raw moments, bounding box and row ends of region in one pass over src
+//then derives central moments, angles, mu22 and the oriented box with its fill and h/w ratio
+//returns -1 if region has no pixels
+int regionStats(cv::Mat& src, int region, RegionStats& stats);
 
-//places red cross at center of central region ( takes color src )
-int objCenter(cv::Mat& src, int* moments);
+//same as above but only scans the box stored in the region's table entry
+int regionStats(cv::Mat& src, int region, RegionInfo& info, RegionStats& stats);
+
+//same stats from the runs of a labelled RunImage on the rows of the region's box,
+//the sums over each run come from the arithmetic series instead of its pixels
+int regionStats(RunImage& runs, int region, RegionInfo& info, RegionStats& stats);
+
+//which regions multi-object mode classifies
+struct RegionFilter {
+	int minArea = 1000; //pixels, smaller regions are noise left over from the clean up
+	bool dropBorder = true; //skip regions touching the frame edge, they're only partly in view
+	int maxRegions = 32; //largest ones are kept if there are more, 0 for no limit
+};
 
-//calculates mu20 mu02 and mu11 in order to get angle alpha
-int angleAlpha(cv::Mat& src, int region, int* moments, double* mumoments);
+//labels of the regions in table that pass filter, largest first
+//size is the size of the region map, returns how many were selected
+int selectRegions(cv::Size size, std::vector<RegionInfo>& table, const RegionFilter& filter, std::vector<int>& selected);
 
-//extension 3
-//calculates mu22 of the given region based on previously calculated moments
-int invarMoment(cv::Mat& src, int region, int* moments, double* mumoments);
+//same stats as regionStats for every region in regions (labels with table entries), in one pass over the region map
+//stats[i] belongs to regions[i], cost depends on the pixels in the regions' rows and not on how many regions there are
+int regionStatsAll(cv::Mat& src, std::vector<RegionInfo>& table, const std::vector<int>& regions, std::vector<RegionStats>& stats);
+int regionStatsAll(RunImage& runs, std::vector<RegionInfo>& table, const std::vector<int>& regions, std::vector<RegionStats>& stats);
 
-//returns 4 coordinates that bound object
-//takes a mat with region values and an array to fill up
-int getBox(cv::Mat& src, int region, int* box);
+//pyramid mode: label in labels, a window of a frame whose top left corner is at offset, that has the most
+//pixels under region in small, a label map of the same frame shrunk by factor
+//labelCount is the number of labels in labels including background, returns 0 if none overlap
+int overlapRegion(cv::Mat& labels, int labelCount, cv::Mat& small, int region, int factor, cv::Point offset);
+int overlapRegion(RunImage& labels, int labelCount, RunImage& small, int region, int factor, cv::Point offset);
 
-//Adds both h/w ratio and fill percentage to feature vector
-int getRatio(cv::Mat& src, int region, int* obb, double* feature);
+//moves stats worked out on part of an image, whose top left corner is at (dx, dy), into the whole image's coordinates
+//central moments, angles and the oriented box don't depend on position and are left as they are
+int shiftStats(RegionStats& stats, int dx, int dy);
+
+//gets the 4 corners of the oriented box in image coordinates, in drawing order
+int obbCorners(RegionStats& stats, cv::Point* corners);
+
+//copies stats into the int center/count array used for drawing (x, y, total pix)
+//and the feature vector (FEAT_COUNT values by Feature, featureset.h), features that aren't stored are 0
+int statFeatures(RegionStats& stats, int* moments, double* mu);
+
+//places red cross at center of central region ( takes color src )
+int objCenter(cv::Mat& src, int* moments);
 
 
 //calculates stddev for invariant features and calculates distance between
 //database features and target.
 //Returns name of lowest distance object
-int nearestNeighb(double* target, float* dev, std::vector<std::vector<float>> data, std::vector<char*> objNames, char* result);
+int nearestNeighb(double* target, float* dev, const FeatureDatabase& db, char* result);
 
 //calculates stddev for invariant features (fill ratio and h/w ratio)
-int deviation(std::vector<std::vector<float>> data, float* result);
+//result gets one value per feature of MatchFeatures (featureset.h), dev arguments take the same layout
+int deviation(const FeatureDatabase& db, float* result);
 
 
 //calculates which object is closest to the target based on 
 //the sum of distances from the k-nearest neigbors of each object class to the target
-int kNearest(double* target, float* dev, std::vector<std::vector<float>> data, std::vector<char*> objNames, char* result, int k);
+int kNearest(double* target, float* dev, const FeatureDatabase& db, char* result, int k);
+
+//a database row and its distance from a query
+struct Neighbor {
+	float dist = 0;
+	int row = -1; //-1 if the database has fewer than k rows
+};
+
+//distances from m queries (feature vectors of FEAT_COUNT values, one after the other like the mu arrays) to every row of db,
+//scaled by the deviations like nearestNeighb, computed 8 rows at a time on cpus with AVX2/FMA
+//with one unrolled term per match feature
+//the k closest rows of query q go to out[q * k] onwards, nearest first with ties to the entry added first
+//distances can differ from nearestNeighb's in the last bit since the deviations are multiplied in
+int nearestBatch(const double* queries, int m, const float* dev, const FeatureDatabase& db, int k, Neighbor* out);
+
+#endif
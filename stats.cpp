@@ -0,0 +1,151 @@
+/*
+	James Marcel
+
+	Latency histograms and scoped stage timers
+*/
+
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include "stats.h"
+
+
+//bucket for a duration: below 16 ns each value has its own bucket,
+//above that the top 4 bits after the leading 1 pick one of 16 buckets in its power of 2
+int LatencyHistogram::bucket(uint64_t ns) {
+
+	if (ns < static_cast<uint64_t>(SUB_COUNT)) {
+		return static_cast<int>(ns);
+	}
+
+	int msb = 0;
+	for (int step = 32; step > 0; step /= 2) {
+		if ((ns >> (msb + step)) != 0) {
+			msb += step;
+		}
+	}
+	if (msb >= MAX_BITS) {
+		return BUCKETS - 1;
+	}
+
+	int sub = static_cast<int>((ns >> (msb - SUB_BITS)) & (SUB_COUNT - 1));
+	return (msb - SUB_BITS + 1) * SUB_COUNT + sub;
+}
+
+
+//smallest duration in bucket b
+uint64_t LatencyHistogram::bucketLow(int b) {
+
+	if (b < SUB_COUNT) {
+		return static_cast<uint64_t>(b);
+	}
+
+	int msb = b / SUB_COUNT + SUB_BITS - 1;
+	uint64_t sub = static_cast<uint64_t>(b % SUB_COUNT);
+	return (static_cast<uint64_t>(SUB_COUNT) + sub) << (msb - SUB_BITS);
+}
+
+
+//one past the largest duration in bucket b
+uint64_t LatencyHistogram::bucketHigh(int b) {
+
+	if (b < SUB_COUNT) {
+		return static_cast<uint64_t>(b) + 1;
+	}
+
+	int msb = b / SUB_COUNT + SUB_BITS - 1;
+	return bucketLow(b) + (static_cast<uint64_t>(1) << (msb - SUB_BITS));
+}
+
+
+void LatencyHistogram::record(int64_t ns) {
+
+	uint64_t v = ns > 0 ? static_cast<uint64_t>(ns) : 0;
+	counts[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+	count.fetch_add(1, std::memory_order_relaxed);
+	sumNs.fetch_add(v, std::memory_order_relaxed);
+}
+
+
+//counts read while other threads are recording may be off by the few samples in flight
+void LatencyHistogram::snapshot(HistogramSnapshot& snap) const {
+
+	snap.counts.resize(BUCKETS);
+	for (int b = 0; b < BUCKETS; b++) {
+		snap.counts[b] = counts[b].load(std::memory_order_relaxed);
+	}
+	snap.count = count.load(std::memory_order_relaxed);
+	snap.sumNs = sumNs.load(std::memory_order_relaxed);
+}
+
+
+void HistogramSnapshot::subtract(const HistogramSnapshot& earlier) {
+
+	for (size_t b = 0; b < counts.size() && b < earlier.counts.size(); b++) {
+		counts[b] -= std::min(counts[b], earlier.counts[b]);
+	}
+	count -= std::min(count, earlier.count);
+	sumNs -= std::min(sumNs, earlier.sumNs);
+}
+
+
+double HistogramSnapshot::meanMs() const {
+
+	if (count == 0) {
+		return 0;
+	}
+	return static_cast<double>(sumNs) / count / 1e6;
+}
+
+
+//middle of the bucket holding the sample at fraction p
+double HistogramSnapshot::percentileMs(double p) const {
+
+	uint64_t total = 0;
+	for (size_t b = 0; b < counts.size(); b++) {
+		total += counts[b];
+	}
+	if (total == 0) {
+		return 0;
+	}
+
+	uint64_t rank = static_cast<uint64_t>(p * total);
+	if (rank >= total) {
+		rank = total - 1;
+	}
+
+	uint64_t seen = 0;
+	for (size_t b = 0; b < counts.size(); b++) {
+		seen += counts[b];
+		if (seen > rank) {
+			int i = static_cast<int>(b);
+			return (LatencyHistogram::bucketLow(i) + LatencyHistogram::bucketHigh(i)) / 2.0 / 1e6;
+		}
+	}
+	return 0;
+}
+
+
+double HistogramSnapshot::maxMs() const {
+
+	for (size_t b = counts.size(); b > 0; b--) {
+		if (counts[b - 1] != 0) {
+			return LatencyHistogram::bucketHigh(static_cast<int>(b - 1)) / 1e6;
+		}
+	}
+	return 0;
+}
+
+
+ScopedTimer::~ScopedTimer() {
+
+	std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+	if (hist != NULL) {
+		hist->record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+	}
+	if (ms != NULL) {
+		*ms = std::chrono::duration<double, std::milli>(elapsed).count();
+	}
+}
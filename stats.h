@@ -0,0 +1,72 @@
+/*
+	James Marcel
+
+	header for latency histograms and scoped stage timers
+	cheap enough to leave on: a timer is two clock reads and a few relaxed atomic adds
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdio>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+
+//counts of durations read out of a LatencyHistogram at one moment
+struct HistogramSnapshot {
+	std::vector<uint64_t> counts;
+	uint64_t count = 0;
+	uint64_t sumNs = 0;
+
+	//removes the counts of an earlier snapshot of the same histogram, leaving what happened in between
+	void subtract(const HistogramSnapshot& earlier);
+
+	double meanMs() const;
+
+	//duration at fraction p (0 - 1) of the samples, to within 1/16 of its power of 2
+	double percentileMs(double p) const;
+
+	//upper end of the highest bucket with a sample
+	double maxMs() const;
+};
+
+//log-linear histogram of durations in nanoseconds, safe to record into from any number of threads
+//each power of 2 is split into 16 linear buckets, so values are kept to about 6%
+class LatencyHistogram {
+public:
+	static const int SUB_BITS = 4;
+	static const int SUB_COUNT = 1 << SUB_BITS;
+	static const int MAX_BITS = 44; //up to about 4.8 hours, longer durations go in the top bucket
+	static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_COUNT;
+
+	void record(int64_t ns);
+	void snapshot(HistogramSnapshot& snap) const;
+
+	//bucket for a duration and the range of durations it holds
+	static int bucket(uint64_t ns);
+	static uint64_t bucketLow(int b);
+	static uint64_t bucketHigh(int b);
+
+private:
+	std::atomic<uint64_t> counts[BUCKETS] = {};
+	std::atomic<uint64_t> count{ 0 };
+	std::atomic<uint64_t> sumNs{ 0 };
+};
+
+//times its own lifetime, records it into hist (if not NULL) and writes it in milliseconds to ms (if not NULL)
+class ScopedTimer {
+public:
+	ScopedTimer(LatencyHistogram* hist, double* ms = NULL)
+		: hist(hist), ms(ms), start(std::chrono::steady_clock::now()) {}
+	~ScopedTimer();
+
+private:
+	LatencyHistogram* hist;
+	double* ms;
+	std::chrono::steady_clock::time_point start;
+};
+
+#endif